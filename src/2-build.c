@@ -691,5 +691,7 @@ void grammar_destroy(struct grammar *grammar)
     }
     free(grammar->rules);
     free(grammar->comment_tokens);
+    free(grammar->entry_rules);
+    free(grammar->lazy_rules);
     memset(grammar, 0, sizeof(*grammar));
 }
@@ -39,6 +39,17 @@ struct grammar {
 
     // This is the starting "root" rule's index.
     uint32_t root_rule;
+
+    // Other rules the generated parser can start from (set with the
+    // --entry-rule option).
+    uint32_t *entry_rules;
+    uint32_t number_of_entry_rules;
+
+    // Rules whose matches the generated parser only builds when they're first
+    // read (set with the --lazy-rule option).  Each one is a single guard
+    // bracket.
+    uint32_t *lazy_rules;
+    uint32_t number_of_lazy_rules;
 };
 
 struct bracket;
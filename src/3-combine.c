@@ -90,6 +90,24 @@ void combine(struct combined_grammar *result, struct grammar *grammar)
         automaton_add_transition(&automaton_for_rule[i], 0, 1, symbol);
         automaton_mark_accepting_state(&automaton_for_rule[i], 1);
     }
+    // Add a token for each entry rule.  The tokenizer never produces these;
+    // the generated parser starts from the state following one instead of
+    // from the start state.
+    result->first_entry_token = result->number_of_tokens;
+    for (uint32_t i = 0; i < grammar->number_of_entry_rules; ++i) {
+        struct rule *rule = &grammar->rules[grammar->entry_rules[i]];
+        symbol_id symbol = result->number_of_tokens++;
+        if (symbol == UINT32_MAX)
+            abort();
+        result->tokens = grow_array(result->tokens, &tokens_allocated_bytes,
+         sizeof(struct token) * result->number_of_tokens);
+        result->tokens[symbol] = (struct token){
+            .string = rule->name,
+            .length = rule->name_length,
+            .range = rule->name_range,
+            .symbol = symbol,
+        };
+    }
     // Bracket symbols come after the tokens.
     symbol_id next_bracket_symbol = result->number_of_tokens;
 
@@ -274,6 +292,29 @@ void combine(struct combined_grammar *result, struct grammar *grammar)
         automaton_destroy(&bracket_automaton);
     }
 
+    // Entry rules are reached from a new start state using their entry tokens;
+    // the root rule is still reached without reading any token.
+    if (grammar->number_of_entry_rules > 0) {
+        struct automaton automaton = {0};
+        state_id start = automaton_create_state(&automaton);
+        state_id end = automaton_create_state(&automaton);
+        automaton_set_start_state(&automaton, start);
+        automaton_mark_accepting_state(&automaton, end);
+        state_id root_start = embed(&automaton,
+         &automaton_for_rule[grammar->root_rule], end, SYMBOL_EPSILON, 0);
+        automaton_add_transition(&automaton, start, root_start,
+         SYMBOL_EPSILON);
+        for (uint32_t i = 0; i < grammar->number_of_entry_rules; ++i) {
+            state_id entry_start = embed(&automaton,
+             &automaton_for_rule[grammar->entry_rules[i]], end,
+             SYMBOL_EPSILON, 0);
+            automaton_add_transition(&automaton, start, entry_start,
+             result->first_entry_token + i);
+        }
+        automaton_destroy(&automaton_for_rule[grammar->root_rule]);
+        automaton_for_rule[grammar->root_rule] = automaton;
+    }
+
     // Before we can call `disambiguate`, we need these automata to have the
     // same `number_of_symbols` so they can share bracket transition bitsets.
     // (This may be a sign that the two automata should be combined into one.)
@@ -25,6 +25,10 @@ struct combined_grammar {
     uint32_t number_of_tokens;
     // The first `number_of_keyword_tokens` are keyword tokens.
     uint32_t number_of_keyword_tokens;
+    // The tokens from `first_entry_token` on are never produced by the
+    // tokenizer.  Each one starts a path into one of the grammar's
+    // `entry_rules` (in the same order) from the automaton's start state.
+    uint32_t first_entry_token;
 
     // These symbols continue on past the last token symbol.
     uint32_t number_of_bracket_symbols;
@@ -8,6 +8,7 @@
 #define WRITE_IDENTIFIER_TOKEN %%write-identifier-token
 #define WRITE_STRING_TOKEN %%write-string-token
 #define ALLOCATE_STRING allocate_string_contents
+#define TOKEN_LIMIT_REACHED token_limit_reached
 #define ALLOW_DASHES_IN_IDENTIFIERS(...) %%allow-dashes-in-identifiers
 #define IDENTIFIER_TOKEN %%identifier-token
 #define NUMBER_TOKEN %%number-token
@@ -21,7 +22,9 @@
 #define FINISH_TOKEN finish_token
 #define RULE_T uint32_t
 #define RULE_LOOKUP rule_lookup
-#define ROOT_RULE(...) %%root-rule-index
+#define ROOT_RULE root_rule_lookup
+#define SKIP_RULE_LOOKUP skip_rule_lookup
+#define SKIP_TOKEN skip_token
 #define FIXITY_ASSOCIATIVITY_PRECEDENCE_LOOKUP(fixity_associativity, precedence, rule, choice, context) \
  do { \
      int local = 0; \
@@ -45,11 +48,83 @@
 
 static bool rule_is_named(struct rule *rule, const char *name);
 static bool token_is(struct token *token, const char *name);
+static bool rule_has_range(struct generator *gen, struct rule *rule);
+static bool builder_can_stop(struct generator *gen);
 
 static void generate_fields_for_token_rule(struct generator_output *out,
  struct rule *rule, const char *string);
 static void generate_keyword_reader(struct generator *gen,
  struct generator_output *out);
+static void generate_field_accessors(struct generator *gen,
+ struct generator_output *out, bool definitions);
+
+static void generate_node_readers(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_tree_index(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_tree_storage(struct generator *gen,
+ struct generator_output *out);
+
+static bool needs_tree_copier(struct generator *gen);
+static bool reads_whole_tree(struct generator *gen);
+
+static void generate_tree_copier(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_tree_compact(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_tree_extract(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_tree_editing(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_walker_types(struct generator *gen,
+ struct generator_output *out);
+static void generate_tree_walker(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_tree_exporters(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_tree_persistence(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_loaded_tree_validation(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_identifier_interning(struct generator_output *out);
+
+static void generate_tokenize(struct generator_output *out);
+static void generate_subtree_sharing(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_subtree_hashes(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_string_length_check(struct generator_output *out);
+static void generate_parse_string(struct generator *gen,
+ struct generator_output *out);
+
+
+static void generate_parse_tokens(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_parse_result(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_entry_points(struct generator *gen,
+ struct generator_output *out);
+
+static void generate_build_cursor(struct generator_output *out);
+
+static bool rule_is_lazy(struct generator *gen, uint32_t rule_index);
+
+static void generate_lazy_matches(struct generator *gen,
+ struct generator_output *out);
 
 static void generate_action_table(struct generator *gen,
  struct generator_output *out);
@@ -70,9 +145,56 @@ static int compare_choice_names(const void *aa, const void *bb)
     return memcmp(a->name, b->name, a->name_length);
 }
 
-static uint32_t reachability_mask_width(struct generator *gen)
+struct interned_masks {
+    struct bitset *masks;
+    uint32_t masks_allocated_bytes;
+    uint32_t number_of_masks;
+};
+
+// Returns the id of the mask, taking ownership of it.
+static uint32_t intern_mask(struct interned_masks *interned,
+ struct bitset *mask)
+{
+    for (uint32_t i = 0; i < interned->number_of_masks; ++i) {
+        if (bitset_compare(&interned->masks[i], mask) == 0) {
+            bitset_destroy(mask);
+            return i;
+        }
+    }
+    uint32_t id = interned->number_of_masks++;
+    if (id == UINT32_MAX)
+        abort();
+    interned->masks = grow_array(interned->masks,
+     &interned->masks_allocated_bytes,
+     interned->number_of_masks * sizeof(struct bitset));
+    interned->masks[id] = bitset_move(mask);
+    return id;
+}
+
+static void interned_masks_destroy(struct interned_masks *interned)
+{
+    for (uint32_t i = 0; i < interned->number_of_masks; ++i)
+        bitset_destroy(&interned->masks[i]);
+    free(interned->masks);
+}
+
+// The set of bracket transitions which can be entered from state `s`.
+static struct bitset bracket_entry_mask(struct generator *gen, struct state s)
 {
-    return (gen->deterministic->transitions.number_of_transitions + 31) / 32;
+    struct bracket_transitions ts = gen->deterministic->transitions;
+    struct bitset mask = bitset_create_empty(ts.number_of_transitions);
+    for (uint32_t i = 0; i < s.number_of_transitions; ++i) {
+        struct transition t = s.transitions[i];
+        // Symbols are either tokens or bracket symbols, so this must be a
+        // bracket symbol.
+        if (t.symbol < gen->combined->number_of_tokens)
+            continue;
+        for (uint32_t j = 0; j < ts.number_of_transitions; ++j) {
+            if (ts.transitions[j].deterministic_transition_symbol == t.symbol)
+                bitset_add(&mask, j);
+        }
+    }
+    return mask;
 }
 
 struct state_in_automaton {
@@ -124,8 +246,6 @@ static int compare_state_transitions(const void *aa, const void *bb) {
     }
     return 0;
 }
-static void generate_reachability_mask_check(struct generator *gen,
- struct generator_output *out, struct bitset *r);
 
 void generate(struct generator *gen)
 {
@@ -137,6 +257,9 @@ void generate(struct generator *gen)
      LOWERCASE_WITH_UNDERSCORES);
     set_unsigned_number_substitution(out, "root-rule-index",
      gen->grammar->root_rule);
+    // Trees created from an entry rule or extracted from another tree have a
+    // different root.
+    set_literal_substitution(out, "tree-root-rule", "tree->root_rule");
 
     output_line(out, "// This file was generated by the Owl parsing tool.");
     output_line(out, "// Make sure to #define OWL_PARSER_IMPLEMENTATION somewhere so the parser");
@@ -167,39 +290,177 @@ void generate(struct generator *gen)
     output_line(out, "// Creates an owl_tree by reading from a file.");
     output_line(out, "struct owl_tree *owl_tree_create_from_file(FILE *file);");
     output_line(out, "");
+    for (uint32_t i = 0; i < gen->grammar->number_of_entry_rules; ++i) {
+        struct rule *rule = &gen->grammar->rules[gen->grammar->entry_rules[i]];
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "// Creates an owl_tree from a string containing a single %%rule instead of a");
+        output_line(out, "// whole %%root-rule.  The root ref refers to the %%rule.");
+        output_line(out, "struct owl_tree *owl_tree_create_from_string_as_%%rule(const char *string);");
+        output_line(out, "");
+    }
     output_line(out, "// Destroys an owl_tree, freeing its resources back to the system.");
     output_line(out, "void owl_tree_destroy(struct owl_tree *);");
     output_line(out, "");
+    if (gen->options.tree_compact) {
+        output_line(out, "// Rewrites the tree so its nodes are stored in document order, which makes");
+        output_line(out, "// walking the whole tree faster.  Any refs into the tree become invalid.");
+        output_line(out, "void owl_tree_compact(struct owl_tree *);");
+        output_line(out, "");
+    }
     output_line(out, "// Prints a representation of the tree to standard output.");
     output_line(out, "void owl_tree_print(struct owl_tree *);");
     output_line(out, "");
+    if (gen->options.tree_export) {
+        output_line(out, "// Writes the tree to a file as JSON, or in a compact binary format.  Returns");
+        output_line(out, "// false if there was an error writing to the file.");
+        output_line(out, "bool owl_tree_write_json(struct owl_tree *tree, FILE *file);");
+        output_line(out, "bool owl_tree_write_binary(struct owl_tree *tree, FILE *file);");
+        output_line(out, "");
+    }
+    if (gen->options.tree_save) {
+        output_line(out, "#if defined(__unix__) || defined(__APPLE__)");
+        output_line(out, "#define OWL_TREE_SAVE_AND_LOAD");
+        output_line(out, "// Saves a tree to a file descriptor, in a format that can only be loaded by");
+        output_line(out, "// a parser generated from the same grammar with the same encoding options.");
+        output_line(out, "// Returns false if the tree has an error or the file couldn't be written.");
+        output_line(out, "bool owl_tree_save(struct owl_tree *tree, int fd);");
+        output_line(out, "");
+        output_line(out, "// Loads a tree saved by owl_tree_save() by mapping the file into memory.");
+        output_line(out, "// `string` must be the text the tree was parsed from -- as with");
+        output_line(out, "// owl_tree_create_from_string(), you're responsible for keeping it around.");
+        output_line(out, "// If the file can't be loaded, the tree has an ERROR_INVALID_FILE error.");
+        output_line(out, "struct owl_tree *owl_tree_load_mmap(const char *path, const char *string);");
+        output_line(out, "");
+        output_line(out, "// Checks every offset and length in a loaded tree against the size of the");
+        output_line(out, "// tree and the length of its string, so a damaged file can't make the");
+        output_line(out, "// accessors read out of bounds.  Loading only checks the file's header, so");
+        output_line(out, "// call this on files you don't trust.  It reads the whole tree, taking time");
+        output_line(out, "// proportional to its size.  Returns false if the tree isn't valid or has");
+        output_line(out, "// an error.");
+        output_line(out, "bool owl_tree_load_validate(struct owl_tree *tree);");
+        output_line(out, "#endif");
+        output_line(out, "");
+    }
     output_line(out, "// An owl_ref references a list of children in the parse tree.  Use the");
     output_line(out, "// parsed_..._get() function corresponding to the element type to unpack the");
     output_line(out, "// child into its appropriate parsed_... struct.");
-    output_line(out, "struct owl_ref {");
-    output_line(out, "    struct owl_tree *_tree;");
-    output_line(out, "    size_t _offset;");
-    output_line(out, "    uint32_t _type;");
-    output_line(out, "    bool empty;");
-    output_line(out, "};");
+    if (gen->options.compact_refs) {
+        output_line(out, "//");
+        output_line(out, "// This parser was generated in compact mode, so refs don't point to their");
+        output_line(out, "// tree.  Instead, each thread has a current tree which all refs are read");
+        output_line(out, "// from.  Calling owl_tree_root_ref() makes its tree current.");
+        output_line(out, "struct owl_ref {");
+        output_line(out, "    uint32_t _offset;");
+        if (gen->grammar->number_of_rules > UINT16_MAX)
+            output_line(out, "    uint32_t _type;");
+        else
+            output_line(out, "    uint16_t _type;");
+        output_line(out, "    bool empty;");
+        output_line(out, "};");
+        output_line(out, "");
+        output_line(out, "// Makes a tree current for this thread, so refs into it can be used.");
+        output_line(out, "void owl_tree_set_current(struct owl_tree *tree);");
+    } else {
+        output_line(out, "struct owl_ref {");
+        output_line(out, "    struct owl_tree *_tree;");
+        output_line(out, "    size_t _offset;");
+        output_line(out, "    uint32_t _type;");
+        output_line(out, "    bool empty;");
+        output_line(out, "};");
+    }
     output_line(out, "");
     output_line(out, "// The owl_next function advances a ref to the next sibling element.");
     output_line(out, "struct owl_ref owl_next(struct owl_ref);");
     output_line(out, "");
+    output_line(out, "// Returns the number of elements in a list, starting from the given ref.");
+    output_line(out, "size_t owl_count(struct owl_ref);");
+    output_line(out, "");
+    output_line(out, "// Stores up to `capacity` refs from a list (starting from the given ref) in");
+    output_line(out, "// `out`.  Returns the length of the list, which may be more than `capacity`.");
+    output_line(out, "size_t owl_collect(struct owl_ref, struct owl_ref *out, size_t capacity);");
+    output_line(out, "");
     output_line(out, "// Tests two refs for equality.");
     output_line(out, "bool owl_refs_equal(struct owl_ref a, struct owl_ref b);");
     output_line(out, "");
+    if (gen->options.subtree_hashes) {
+        output_line(out, "// Returns a hash of a match's rule, option, fields, and token text (or zero");
+        output_line(out, "// for an empty ref).  Matches with the same structure have the same hash.");
+        output_line(out, "uint64_t owl_ref_hash(struct owl_ref);");
+        output_line(out, "");
+    }
     output_line(out, "// Returns the root owl_ref.");
     output_line(out, "struct owl_ref owl_tree_root_ref(struct owl_tree *tree);");
     output_line(out, "");
+    if (gen->options.tree_extract) {
+        output_line(out, "// Copies the match a ref refers to (and everything inside it) into a new,");
+        output_line(out, "// compacted tree, so the original tree can be destroyed.  If `copy_text` is");
+        output_line(out, "// true, the new tree owns a copy of just the text the match covers, and its");
+        output_line(out, "// ranges are relative to the start of that text.  Otherwise it refers to the");
+        output_line(out, "// original string.  The new tree's root ref refers to the copied match.");
+        output_line(out, "struct owl_tree *owl_tree_extract(struct owl_ref ref, bool copy_text);");
+        output_line(out, "");
+    }
+    if (gen->options.tree_edit) {
+        output_line(out, "// Replaces the match `ref` refers to with a copy of the match `replacement`");
+        output_line(out, "// refers to (or removes it, if `replacement` is empty), making a new version");
+        output_line(out, "// of the tree.  The new version shares everything but the path from the");
+        output_line(out, "// match to the root (and the siblings before each node on it) with earlier");
+        output_line(out, "// versions.  The tree must be in document order (see owl_tree_compact()).");
+        output_line(out, "// Returns false if the tree can't be edited, `ref` isn't part of the current");
+        output_line(out, "// version, or the matches have different rules.");
+        if (gen->options.compact_refs) {
+            output_line(out, "//");
+            output_line(out, "// Both refs are read from the current tree.");
+        }
+        output_line(out, "bool owl_tree_edit_replace(struct owl_ref ref, struct owl_ref replacement);");
+        output_line(out, "");
+        output_line(out, "// A version of a tree saved by owl_tree_snapshot().");
+        output_line(out, "struct owl_snapshot {");
+        output_line(out, "    size_t _root_offset;");
+        output_line(out, "    size_t _next_offset;");
+        output_line(out, "    size_t _generation;");
+        output_line(out, "};");
+        output_line(out, "");
+        output_line(out, "// Saves the current version of a tree so it can be restored by");
+        output_line(out, "// owl_tree_rollback().");
+        output_line(out, "struct owl_snapshot owl_tree_snapshot(struct owl_tree *tree);");
+        output_line(out, "");
+        output_line(out, "// Restores a version saved by owl_tree_snapshot(), discarding the versions");
+        output_line(out, "// made after it.  Refs into discarded versions and snapshots taken after this");
+        output_line(out, "// one become invalid.  Returns false if the snapshot was taken before the");
+        output_line(out, "// tree was last compacted.");
+        output_line(out, "bool owl_tree_rollback(struct owl_tree *tree, struct owl_snapshot snapshot);");
+        output_line(out, "");
+    }
     output_line(out, "// As a shortcut, returns the parsed_%%root-rule struct corresponding to the root ref.");
     output_line(out, "struct parsed_%%root-rule owl_tree_get_parsed_%%root-rule(struct owl_tree *tree);");
     output_line(out, "");
     output_line(out, "// The range of text corresponding to a tree element.");
     output_line(out, "struct source_range {");
-    output_line(out, "    size_t start;");
-    output_line(out, "    size_t end;");
+    if (gen->options.compact_refs) {
+        output_line(out, "    uint32_t start;");
+        output_line(out, "    uint32_t end;");
+    } else {
+        output_line(out, "    size_t start;");
+        output_line(out, "    size_t end;");
+    }
     output_line(out, "};");
+    if (gen->options.omit_ranges) {
+        output_line(out, "");
+        if (gen->options.share_subtrees) {
+            output_line(out, "// This parser shares identical subtrees, so matches don't have a single");
+            output_line(out, "// source range.  The range fields of all matches (including tokens) are set");
+            output_line(out, "// to OWL_RANGE_UNAVAILABLE instead.");
+        } else {
+            output_line(out, "// This parser doesn't record source ranges for rules (only for tokens).  The");
+            output_line(out, "// range fields of rule matches are set to OWL_RANGE_UNAVAILABLE instead.");
+        }
+        if (gen->options.compact_refs)
+            output_line(out, "#define OWL_RANGE_UNAVAILABLE UINT32_MAX");
+        else
+            output_line(out, "#define OWL_RANGE_UNAVAILABLE SIZE_MAX");
+    }
     output_line(out, "");
     output_line(out, "enum owl_error {");
     output_line(out, "    // No error -- everything's fine!");
@@ -220,11 +481,29 @@ void generate(struct generator *gen)
     output_line(out, "    // The input is valid so far, but incomplete; more tokens could be added to");
     output_line(out, "    // complete it.");
     output_line(out, "    ERROR_MORE_INPUT_NEEDED,");
+    if (gen->options.compact_refs) {
+        output_line(out, "");
+        output_line(out, "    // The input or its parse tree was larger than 4 GB, which is too large");
+        output_line(out, "    // for the 32-bit offsets used in compact mode.");
+        output_line(out, "    ERROR_INPUT_TOO_LARGE,");
+    }
+    if (gen->options.parse_limits) {
+        output_line(out, "");
+        output_line(out, "    // Parsing went over one of the limits passed to");
+        output_line(out, "    // owl_tree_create_from_string_with_limits().");
+        output_line(out, "    ERROR_LIMIT_EXCEEDED,");
+    }
     output_line(out, "};");
     output_line(out, "// Returns an error code, or ERROR_NONE if there wasn't an error.");
     output_line(out, "// The error_range parameter can be null.");
     output_line(out, "enum owl_error owl_tree_get_error(struct owl_tree *tree, struct source_range *error_range);");
     output_line(out, "");
+    output_line(out, "// Converts an offset into the tree's string to a line and column, both");
+    output_line(out, "// starting from 1.  Columns count bytes.  Returns false if the offset is past");
+    output_line(out, "// the end of the string.  The first call builds a table of line starts, so");
+    output_line(out, "// later calls take logarithmic time.");
+    output_line(out, "bool owl_tree_line_column(struct owl_tree *tree, size_t offset, size_t *line, size_t *column);");
+    output_line(out, "");
     uint32_t n = gen->grammar->number_of_rules;
     struct choice **choices = 0;
     uint32_t choices_allocated_bytes = 0;
@@ -259,6 +538,56 @@ void generate(struct generator *gen)
         output_line(out, "};");
     }
     free(choices);
+    output_line(out, "");
+    output_line(out, "// Identifies each rule in the grammar.");
+    output_line(out, "enum owl_rule {");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         UPPERCASE_WITH_UNDERSCORES);
+        output_line(out, "    RULE_%%rule,");
+    }
+    output_line(out, "};");
+    output_line(out, "");
+    output_line(out, "// Creates an owl_tree like owl_tree_create_from_string(), but only keeps");
+    output_line(out, "// matches of the root rule and the listed rules.  Other matches are left out");
+    output_line(out, "// along with everything inside them, so their fields are empty.  The whole");
+    output_line(out, "// string is still checked for errors.");
+    output_line(out, "struct owl_tree *owl_tree_create_from_string_keeping(const char *string, const enum owl_rule *rules, size_t number_of_rules);");
+    if (gen->options.parse_limits) {
+        output_line(out, "");
+        output_line(out, "// Limits on the resources a parse can use, for parsing untrusted input.  A");
+        output_line(out, "// limit of zero means there's no limit.");
+        output_line(out, "struct owl_parse_limits {");
+        output_line(out, "    // The length of the string, not counting the null terminator.");
+        output_line(out, "    size_t max_input_bytes;");
+        output_line(out, "    // The number of tokens in the string.");
+        output_line(out, "    size_t max_tokens;");
+        output_line(out, "    // How many brackets can be open at once.");
+        output_line(out, "    size_t max_nesting_depth;");
+        output_line(out, "    // The size of the tree.  This is checked after each token, so the tree can");
+        output_line(out, "    // grow past the limit by one token's worth of nodes before parsing stops.");
+        output_line(out, "    size_t max_tree_bytes;");
+        output_line(out, "};");
+        output_line(out, "");
+        output_line(out, "// Creates an owl_tree like owl_tree_create_from_string(), but stops with an");
+        output_line(out, "// ERROR_LIMIT_EXCEEDED error if the parse goes over one of the limits.  Trees");
+        output_line(out, "// created any other way have no limits.");
+        output_line(out, "struct owl_tree *owl_tree_create_from_string_with_limits(const char *string, const struct owl_parse_limits *limits);");
+    }
+    if (gen->options.tree_index) {
+        output_line(out, "");
+        output_line(out, "// These functions use an index of the tree, which is built by the first call");
+        output_line(out, "// to any of them (or by calling owl_tree_build_index() directly).");
+        output_line(out, "void owl_tree_build_index(struct owl_tree *tree);");
+        output_line(out, "// Returns a ref to the match containing this one, or an empty ref for the root.");
+        output_line(out, "struct owl_ref owl_parent(struct owl_ref ref);");
+        output_line(out, "// Returns the number of matches for a rule in the tree.");
+        output_line(out, "size_t owl_rule_count(struct owl_tree *tree, enum owl_rule rule);");
+        output_line(out, "// Returns a ref to the i-th match for a rule (ordered by offset in the tree), or");
+        output_line(out, "// an empty ref if i is out of range.");
+        output_line(out, "struct owl_ref owl_rule_nth(struct owl_tree *tree, enum owl_rule rule, size_t i);");
+    }
     for (uint32_t i = 0; i < n; ++i) {
         struct rule *rule = &gen->grammar->rules[i];
         set_substitution(out, "rule", rule->name, rule->name_length,
@@ -276,6 +605,9 @@ void generate(struct generator *gen)
         }
         if (rule->is_token)
             generate_fields_for_token_rule(out, rule, "    %%type%%field;\n");
+        if (rule_is_named(rule, "identifier") &&
+         gen->options.intern_identifiers)
+            output_line(out, "    uint32_t id;");
         output_line(out, "};");
     }
     output_line(out, "");
@@ -286,6 +618,107 @@ void generate(struct generator *gen)
         output_line(out, "struct parsed_%%rule parsed_%%rule_get(struct owl_ref);");
     }
     output_line(out, "");
+    output_line(out, "// The parsed_..._get_many() functions unpack up to n elements of a list");
+    output_line(out, "// (starting from the given ref) into `out`, returning the number unpacked.");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "size_t parsed_%%rule_get_many(struct owl_ref, struct parsed_%%rule *out, size_t n);");
+    }
+    if (gen->options.intern_identifiers) {
+        output_line(out, "");
+        output_line(out, "// Identifiers are interned: each distinct identifier has an id, starting from");
+        output_line(out, "// zero, which is stored in the id field of parsed_identifier.  This returns");
+        output_line(out, "// the text of an identifier (which isn't null-terminated) and its length.");
+        output_line(out, "const char *owl_tree_identifier_text(struct owl_tree *tree, uint32_t id, size_t *length);");
+        output_line(out, "// Returns the number of distinct identifiers in the tree.");
+        output_line(out, "uint32_t owl_tree_identifier_count(struct owl_tree *tree);");
+    }
+    if (gen->options.walker) {
+        output_line(out, "");
+        generate_walker_types(gen, out);
+        output_line(out, "struct owl_walker *owl_walker_create(struct owl_tree *tree);");
+        output_line(out, "// Stores the next event in `event`, returning false when the walk is done.");
+        output_line(out, "bool owl_walker_next(struct owl_walker *walker, struct owl_walk_event *event);");
+        output_line(out, "// After a WALK_ENTER event, skips the matches inside the one just entered.");
+        output_line(out, "// It will still be left as usual.");
+        output_line(out, "void owl_walker_skip_children(struct owl_walker *walker);");
+        output_line(out, "void owl_walker_destroy(struct owl_walker *walker);");
+        output_line(out, "");
+        output_line(out, "// Callbacks for owl_walk().  Returning false from an enter_... callback skips");
+        output_line(out, "// the matches inside that one.  Callbacks may be NULL.");
+        output_line(out, "struct owl_visitor {");
+        for (uint32_t i = 0; i < n; ++i) {
+            struct rule *rule = &gen->grammar->rules[i];
+            set_substitution(out, "rule", rule->name, rule->name_length,
+             LOWERCASE_WITH_UNDERSCORES);
+            output_line(out, "    bool (*enter_%%rule)(void *context, struct owl_ref ref, const struct parsed_%%rule *match);");
+            output_line(out, "    void (*leave_%%rule)(void *context, struct owl_ref ref, const struct parsed_%%rule *match);");
+        }
+        output_line(out, "};");
+        output_line(out, "// Walks the whole tree with an owl_walker, calling the visitor's callbacks.");
+        output_line(out, "void owl_walk(struct owl_tree *tree, const struct owl_visitor *visitor, void *context);");
+    }
+    if (gen->options.tokenize || gen->options.from_tokens) {
+        output_line(out, "");
+        output_line(out, "enum owl_token_class {");
+        output_line(out, "    TOKEN_CLASS_KEYWORD,");
+        output_line(out, "    TOKEN_CLASS_IDENTIFIER,");
+        output_line(out, "    TOKEN_CLASS_NUMBER,");
+        output_line(out, "    TOKEN_CLASS_STRING,");
+        output_line(out, "};");
+    }
+    if (gen->options.tokenize) {
+        output_line(out, "struct owl_token {");
+        output_line(out, "    enum owl_token_class token_class;");
+        output_line(out, "    // For keywords, a number identifying the keyword.  Every occurrence of a");
+        output_line(out, "    // keyword has the same number.");
+        output_line(out, "    uint32_t keyword;");
+        output_line(out, "    struct source_range range;");
+        output_line(out, "};");
+        output_line(out, "");
+        output_line(out, "// Splits `length` bytes of text into tokens without parsing them, calling");
+        output_line(out, "// `callback` for each token in order.  The text doesn't need a null");
+        output_line(out, "// terminator.  Whitespace and comments are skipped.  Returns `length` if the");
+        output_line(out, "// whole text was tokenized.  Otherwise, returns the offset of the first byte");
+        output_line(out, "// that isn't part of a valid token, after reporting the tokens before it.");
+        output_line(out, "size_t owl_tokenize(const char *text, size_t length, void (*callback)(void *context, const struct owl_token *token), void *context);");
+    }
+    if (gen->options.from_tokens) {
+        output_line(out, "");
+        output_line(out, "// A token read by your own tokenizer, for owl_tree_create_from_tokens().");
+        output_line(out, "struct owl_input_token {");
+        output_line(out, "    enum owl_token_class token_class;");
+        output_line(out, "    // For keywords, the keyword's number (see owl_keyword_number()).");
+        output_line(out, "    uint32_t keyword;");
+        output_line(out, "    struct source_range range;");
+        output_line(out, "    // For numbers, the number's value.");
+        output_line(out, "    double number;");
+        output_line(out, "    // For strings, the string's contents, which are copied into the tree.  If");
+        output_line(out, "    // this is null, the contents are the text in `range` without its first and");
+        output_line(out, "    // last bytes (the quotes).");
+        output_line(out, "    const char *string;");
+        output_line(out, "    size_t string_length;");
+        output_line(out, "};");
+        output_line(out, "");
+        output_line(out, "// Returns the number of the keyword spelled by the `length` bytes at `text`,");
+        output_line(out, "// or UINT32_MAX if the grammar has no such keyword.");
+        output_line(out, "uint32_t owl_keyword_number(const char *text, size_t length);");
+        output_line(out, "");
+        output_line(out, "// Creates an owl_tree by parsing `n` tokens which were already read from");
+        output_line(out, "// `text`.  The tokens must be in order and mustn't overlap.  As with");
+        output_line(out, "// owl_tree_create_from_string(), you're responsible for keeping the text");
+        output_line(out, "// around until owl_tree_destroy() is called; the tokens can be freed right away.");
+        output_line(out, "struct owl_tree *owl_tree_create_from_tokens(const struct owl_input_token *tokens, size_t n, const char *text);");
+    }
+    if (gen->options.fixed_layout) {
+        output_line(out, "");
+        output_line(out, "// Each field of the tree is stored at a fixed offset, so these accessors can");
+        output_line(out, "// read a single field without unpacking the whole parsed_... struct.");
+        generate_field_accessors(gen, out, false);
+    }
+    output_line(out, "");
     output_line(out, "#endif");
 
     output_line(out, "");
@@ -295,16 +728,150 @@ void generate(struct generator *gen)
     output_line(out, "#include <stdio.h>");
     output_line(out, "#include <stdlib.h>");
     output_line(out, "#include <string.h>");
+    if (gen->options.tree_save) {
+        output_line(out, "#ifdef OWL_TREE_SAVE_AND_LOAD");
+        output_line(out, "#include <fcntl.h>");
+        output_line(out, "#include <sys/mman.h>");
+        output_line(out, "#include <sys/stat.h>");
+        output_line(out, "#include <unistd.h>");
+        output_line(out, "#endif");
+    }
     output_line(out, "");
+    if (gen->options.segmented_tree) {
+        output_line(out, "// The tree is stored in fixed-size segments, so growing it never moves data");
+        output_line(out, "// that has already been written.  Offsets are mapped to segments by their");
+        output_line(out, "// high bits.");
+        output_line(out, "#define SEGMENT_SHIFT 16");
+        output_line(out, "#define SEGMENT_SIZE ((size_t)1 << SEGMENT_SHIFT)");
+        output_line(out, "#define SEGMENT_MASK (SEGMENT_SIZE - 1)");
+        output_line(out, "struct tree_segment {");
+        output_line(out, "    uint8_t *bytes;");
+        output_line(out, "    // Large strings span several segments which share one allocation.");
+        output_line(out, "    bool owns_bytes;");
+        output_line(out, "};");
+    }
+    if (gen->options.intern_identifiers) {
+        output_line(out, "struct interned_identifier {");
+        output_line(out, "    uint64_t start;");
+        output_line(out, "    uint64_t length;");
+        output_line(out, "};");
+    }
+    if (gen->options.share_subtrees) {
+        output_line(out, "struct shared_node {");
+        output_line(out, "    // Zero marks an empty slot in the table.");
+        output_line(out, "    size_t offset;");
+        output_line(out, "    uint64_t hash;");
+        output_line(out, "    uint32_t rule;");
+        output_line(out, "    size_t length;");
+        output_line(out, "};");
+    }
+    if (gen->grammar->number_of_lazy_rules > 0) {
+        generate_build_cursor(out);
+        output_line(out, "// A match of a lazy rule whose brackets haven't been read yet.");
+        output_line(out, "struct lazy_match {");
+        output_line(out, "    // The offsets of the match's node and of its first field.");
+        output_line(out, "    size_t node;");
+        output_line(out, "    size_t fields;");
+        output_line(out, "    uint32_t rule;");
+        output_line(out, "    // Where to start reading the tokens inside the brackets.  The run is null");
+        output_line(out, "    // once the match has been built.");
+        output_line(out, "    struct build_cursor cursor;");
+        for (uint32_t i = 0; i < n; ++i) {
+            struct rule *rule = &gen->grammar->rules[i];
+            if (!rule->is_token)
+                continue;
+            set_substitution(out, "rule", rule->name, rule->name_length,
+             LOWERCASE_WITH_UNDERSCORES);
+            output_line(out, "    size_t next_%%rule_token_offset;");
+        }
+        output_line(out, "};");
+    }
     output_line(out, "struct owl_tree {");
     output_line(out, "    const char *string;");
     output_line(out, "    bool owns_string;");
-    output_line(out, "    uint8_t *parse_tree;");
-    output_line(out, "    size_t parse_tree_size;");
+    if (gen->options.segmented_tree) {
+        output_line(out, "    struct tree_segment *segments;");
+        output_line(out, "    size_t number_of_segments;");
+        output_line(out, "    size_t segments_capacity;");
+        output_line(out, "    size_t string_contents_offset;");
+    } else {
+        output_line(out, "    uint8_t *parse_tree;");
+        output_line(out, "    size_t parse_tree_size;");
+    }
     output_line(out, "    size_t next_offset;");
+    if (gen->options.compact_refs) {
+        output_line(out, "    // Set by reserve_tree() once the tree reaches offsets that don't fit in");
+        output_line(out, "    // a compact ref.");
+        output_line(out, "    bool too_large;");
+    }
     output_line(out, "    enum owl_error error;");
-    output_line(out, "    struct source_range error_range;");
+    if (gen->options.compact_refs) {
+        // The tokenizer reports error ranges using size_t.
+        output_line(out, "    struct { size_t start; size_t end; } error_range;");
+    } else
+        output_line(out, "    struct source_range error_range;");
     output_line(out, "    size_t root_offset;");
+    output_line(out, "    uint32_t root_rule;");
+    set_unsigned_number_substitution(out, "number-of-rules", n);
+    output_line(out, "    // Set by owl_tree_create_from_string_keeping() for rules left out of the tree.");
+    output_line(out, "    bool skipped_rules[%%number-of-rules];");
+    if (gen->options.parse_limits) {
+        output_line(out, "    // Set by owl_tree_create_from_string_with_limits().");
+        output_line(out, "    struct owl_parse_limits limits;");
+    }
+    output_line(out, "    // Set once owl_tree_compact() has put the tree in document order.");
+    output_line(out, "    bool preorder;");
+    if (gen->options.tree_edit) {
+        output_line(out, "    // Set by owl_tree_edit_replace(), which leaves earlier versions in the tree.");
+        output_line(out, "    bool edited;");
+        output_line(out, "    // Incremented each time owl_tree_compact() moves the tree's nodes.");
+        output_line(out, "    size_t generation;");
+        output_line(out, "    // Built by the first edit and kept up to date by the ones after it.");
+        output_line(out, "    struct edit_links *edit_links;");
+    }
+    if (gen->options.tree_index)
+        output_line(out, "    struct tree_index *index;");
+    output_line(out, "    // Built by the first call to owl_tree_line_column().");
+    output_line(out, "    size_t *line_starts;");
+    output_line(out, "    size_t number_of_lines;");
+    output_line(out, "    size_t string_length;");
+    if (gen->options.tree_save) {
+        output_line(out, "    // Set if the tree was loaded with owl_tree_load_mmap().");
+        output_line(out, "    void *mapping;");
+        output_line(out, "    size_t mapping_size;");
+    }
+    if (gen->options.tokenize) {
+        // Set by owl_tokenize(), which doesn't need token data.
+        output_line(out, "    bool tokens_only;");
+    }
+    if (gen->options.intern_identifiers) {
+        output_line(out, "    struct interned_identifier *identifiers;");
+        output_line(out, "    uint32_t number_of_identifiers;");
+        output_line(out, "    uint32_t identifiers_capacity;");
+        output_line(out, "    // A hash table of identifier ids plus one (so zero means empty).");
+        output_line(out, "    uint32_t *identifier_table;");
+        output_line(out, "    size_t identifier_table_size;");
+    }
+    if (gen->options.share_subtrees) {
+        output_line(out, "    // A hash table of the nodes written so far, used while building the tree");
+        output_line(out, "    // to find earlier copies of each new node.");
+        output_line(out, "    struct shared_node *shared_nodes;");
+        output_line(out, "    size_t shared_nodes_size;");
+        output_line(out, "    size_t number_of_shared_nodes;");
+    }
+    if (gen->grammar->number_of_lazy_rules > 0) {
+        output_line(out, "    // Lazy matches in the order of their nodes.");
+        output_line(out, "    struct lazy_match *lazy_matches;");
+        output_line(out, "    size_t number_of_lazy_matches;");
+        output_line(out, "    size_t lazy_matches_capacity;");
+        output_line(out, "    size_t lazy_matches_left;");
+        output_line(out, "    // Set between reading a lazy match's brackets and writing its node.");
+        output_line(out, "    bool lazy_match_pending;");
+        output_line(out, "    // The rule of the lazy match being built plus one (so zero means none).");
+        output_line(out, "    uint32_t building_rule;");
+        output_line(out, "    // Lazy matches are built from these runs.");
+        output_line(out, "    struct owl_token_run *token_runs;");
+    }
     for (uint32_t i = 0; i < n; ++i) {
         struct rule *rule = &gen->grammar->rules[i];
         if (!rule->is_token)
@@ -315,104 +882,236 @@ void generate(struct generator *gen)
     }
     output_line(out, "};");
 
+    if (gen->options.compact_refs) {
+        output_line(out, "#if __STDC_VERSION__ >= 201112L");
+        output_line(out, "#define OWL_THREAD_LOCAL _Thread_local");
+        output_line(out, "#elif defined(__GNUC__)");
+        output_line(out, "#define OWL_THREAD_LOCAL __thread");
+        output_line(out, "#else");
+        output_line(out, "#define OWL_THREAD_LOCAL");
+        output_line(out, "#endif");
+        output_line(out, "static OWL_THREAD_LOCAL struct owl_tree *owl_current_tree;");
+        set_literal_substitution(out, "ref-tree", "owl_current_tree");
+    } else
+        set_literal_substitution(out, "ref-tree", "ref._tree");
+
     set_literal_substitution(out, "token-type", "uint32_t");
     set_literal_substitution(out, "state-type", "uint32_t");
 
     // Code for reading and writing packed parse trees.
-    output_line(out, "// Reserve 10 bytes for each entry (the maximum encoded size of a 64-bit value).");
-    output_line(out, "#define RESERVATION_AMOUNT 10");
+    if (gen->options.segmented_tree) {
+        output_line(out, "static inline uint8_t *tree_bytes(struct owl_tree *tree, size_t offset) {");
+        output_line(out, "    return tree->segments[offset >> SEGMENT_SHIFT].bytes + (offset & SEGMENT_MASK);");
+        output_line(out, "}");
+        set_literal_substitution(out, "tree-bytes-at-i", "tree_bytes(tree, i)");
+        set_literal_substitution(out, "tree-bytes-at-next-offset",
+         "tree_bytes(tree, tree->next_offset)");
+    } else {
+        set_literal_substitution(out, "tree-bytes-at-i", "tree->parse_tree + i");
+        set_literal_substitution(out, "tree-bytes-at-next-offset",
+         "tree->parse_tree + tree->next_offset");
+    }
+    if (gen->options.fixed_layout) {
+        output_line(out, "// Each entry is an aligned 64-bit word.");
+        output_line(out, "#define RESERVATION_AMOUNT 8");
+        // Offset zero is reserved for empty refs, so start at the next
+        // aligned offset.
+        set_unsigned_number_substitution(out, "first-tree-offset", 8);
+    } else {
+        output_line(out, "// Reserve 10 bytes for each entry (the maximum encoded size of a 64-bit value).");
+        output_line(out, "#define RESERVATION_AMOUNT 10");
+        set_unsigned_number_substitution(out, "first-tree-offset", 1);
+    }
     output_line(out, "static inline uint64_t read_tree(size_t *offset, struct owl_tree *tree) {");
-    output_line(out, "    uint8_t *parse_tree = tree->parse_tree;");
-    output_line(out, "    size_t parse_tree_size = tree->parse_tree_size;");
     output_line(out, "    size_t i = *offset;");
-    output_line(out, "    if (i + RESERVATION_AMOUNT >= parse_tree_size)");
+    if (gen->options.segmented_tree) {
+        // Entries never straddle two segments (see reserve_tree).
+        output_line(out, "    if ((i >> SEGMENT_SHIFT) >= tree->number_of_segments ||");
+        output_line(out, "     (i & SEGMENT_MASK) + RESERVATION_AMOUNT > SEGMENT_SIZE)");
+    } else if (gen->options.fixed_layout)
+        output_line(out, "    if (i + RESERVATION_AMOUNT > tree->parse_tree_size)");
+    else
+        output_line(out, "    if (i + RESERVATION_AMOUNT >= tree->parse_tree_size)");
     output_line(out, "        return 0;");
-    output_line(out, "    uint64_t result = 0;");
-    output_line(out, "    int shift_amount = 0;");
-    output_line(out, "    while ((parse_tree[i] & 0x80) != 0 && shift_amount < 64) {");
-    output_line(out, "        result |= ((uint64_t)parse_tree[i] & 0x7f) << shift_amount;");
-    output_line(out, "        shift_amount += 7;");
-    output_line(out, "        i++;");
-    output_line(out, "    }");
-    output_line(out, "    result |= ((uint64_t)parse_tree[i] & 0x7f) << shift_amount;");
-    output_line(out, "    i++;");
-    output_line(out, "    *offset = i;");
+    output_line(out, "    const uint8_t *bytes = %%tree-bytes-at-i;");
+    if (gen->options.fixed_layout) {
+        output_line(out, "    uint64_t result;");
+        output_line(out, "    memcpy(&result, bytes, sizeof(result));");
+        output_line(out, "    *offset = i + sizeof(result);");
+    } else {
+        output_line(out, "    uint64_t result = 0;");
+        output_line(out, "    int shift_amount = 0;");
+        output_line(out, "    size_t j = 0;");
+        output_line(out, "    while ((bytes[j] & 0x80) != 0 && shift_amount < 63) {");
+        output_line(out, "        result |= ((uint64_t)bytes[j] & 0x7f) << shift_amount;");
+        output_line(out, "        shift_amount += 7;");
+        output_line(out, "        j++;");
+        output_line(out, "    }");
+        output_line(out, "    result |= ((uint64_t)bytes[j] & 0x7f) << shift_amount;");
+        output_line(out, "    *offset = i + j + 1;");
+    }
     output_line(out, "    return result;");
     output_line(out, "}");
-    output_line(out, "static bool grow_tree(struct owl_tree *tree, size_t size)");
-    output_line(out, "{");
-    output_line(out, "    size_t n = tree->parse_tree_size;");
-    output_line(out, "    while (n < size || n < 4096)");
-    output_line(out, "        n = (n + 1) * 3 / 2;");
-    output_line(out, "    uint8_t *parse_tree = realloc(tree->parse_tree, n);");
-    output_line(out, "    if (!parse_tree)");
-    output_line(out, "        return false;");
-    output_line(out, "    tree->parse_tree_size = n;");
-    output_line(out, "    tree->parse_tree = parse_tree;");
-    output_line(out, "    return true;");
-    output_line(out, "}");
+    if (gen->options.segmented_tree) {
+        output_line(out, "static bool add_segments(struct owl_tree *tree, size_t count)");
+        output_line(out, "{");
+        output_line(out, "    size_t n = tree->number_of_segments;");
+        output_line(out, "    if (n + count > tree->segments_capacity) {");
+        output_line(out, "        size_t capacity = tree->segments_capacity;");
+        output_line(out, "        while (capacity < n + count)");
+        output_line(out, "            capacity = (capacity + 1) * 2;");
+        output_line(out, "        struct tree_segment *segments = realloc(tree->segments,");
+        output_line(out, "         capacity * sizeof(struct tree_segment));");
+        output_line(out, "        if (!segments)");
+        output_line(out, "            return false;");
+        output_line(out, "        tree->segments = segments;");
+        output_line(out, "        tree->segments_capacity = capacity;");
+        output_line(out, "    }");
+        output_line(out, "    uint8_t *bytes = malloc(count << SEGMENT_SHIFT);");
+        output_line(out, "    if (!bytes)");
+        output_line(out, "        return false;");
+        output_line(out, "    for (size_t i = 0; i < count; ++i) {");
+        output_line(out, "        tree->segments[n + i] = (struct tree_segment){");
+        output_line(out, "            .bytes = bytes + (i << SEGMENT_SHIFT),");
+        output_line(out, "            .owns_bytes = i == 0,");
+        output_line(out, "        };");
+        output_line(out, "    }");
+        output_line(out, "    tree->number_of_segments = n + count;");
+        output_line(out, "    return true;");
+        output_line(out, "}");
+        output_line(out, "// Make room for `size` bytes at the end of the tree.  If they don't fit in");
+        output_line(out, "// the current segment, skip to the start of a new one.");
+        output_line(out, "static void reserve_tree(struct owl_tree *tree, size_t size)");
+        output_line(out, "{");
+        if (gen->options.compact_refs) {
+            output_line(out, "    if (tree->next_offset + size > UINT32_MAX)");
+            output_line(out, "        tree->too_large = true;");
+        }
+        output_line(out, "    size_t offset = tree->next_offset;");
+        output_line(out, "    if ((offset >> SEGMENT_SHIFT) < tree->number_of_segments) {");
+        output_line(out, "        if ((offset & SEGMENT_MASK) + size <= SEGMENT_SIZE)");
+        output_line(out, "            return;");
+        output_line(out, "        offset = tree->number_of_segments << SEGMENT_SHIFT;");
+        output_line(out, "    }");
+        output_line(out, "    size_t end = (offset & SEGMENT_MASK) + size;");
+        output_line(out, "    if (!add_segments(tree, (end + SEGMENT_SIZE - 1) >> SEGMENT_SHIFT))");
+        output_line(out, "        abort();");
+        output_line(out, "    tree->next_offset = offset;");
+        output_line(out, "}");
+    } else {
+        output_line(out, "static bool grow_tree(struct owl_tree *tree, size_t size)");
+        output_line(out, "{");
+        output_line(out, "    size_t n = tree->parse_tree_size;");
+        output_line(out, "    while (n < size || n < 4096)");
+        output_line(out, "        n = (n + 1) * 3 / 2;");
+        output_line(out, "    uint8_t *parse_tree = realloc(tree->parse_tree, n);");
+        output_line(out, "    if (!parse_tree)");
+        output_line(out, "        return false;");
+        output_line(out, "    tree->parse_tree_size = n;");
+        output_line(out, "    tree->parse_tree = parse_tree;");
+        output_line(out, "    return true;");
+        output_line(out, "}");
+        output_line(out, "// Make room for `size` bytes at the end of the tree.");
+        output_line(out, "static void reserve_tree(struct owl_tree *tree, size_t size)");
+        output_line(out, "{");
+        output_line(out, "    size_t reserved_size = tree->next_offset + size;");
+        if (gen->options.compact_refs) {
+            output_line(out, "    if (reserved_size > UINT32_MAX)");
+            output_line(out, "        tree->too_large = true;");
+        }
+        output_line(out, "    if (tree->parse_tree_size <= reserved_size && !grow_tree(tree, reserved_size))");
+        output_line(out, "        abort();");
+        output_line(out, "}");
+    }
+    // Each record (a node or a token's data) reserves room for all of its
+    // entries up front, so write_tree doesn't need to check the size.
     output_line(out, "static void write_tree(struct owl_tree *tree, uint64_t value)");
     output_line(out, "{");
-    output_line(out, "    size_t reserved_size = tree->next_offset + RESERVATION_AMOUNT;");
-    output_line(out, "    if (tree->parse_tree_size <= reserved_size && !grow_tree(tree, reserved_size))");
-    output_line(out, "        abort();");
-    output_line(out, "    while (value >> 7 != 0) {");
-    output_line(out, "        tree->parse_tree[tree->next_offset++] = 0x80 | (value & 0x7f);");
-    output_line(out, "        value >>= 7;");
-    output_line(out, "    }");
-    output_line(out, "    tree->parse_tree[tree->next_offset++] = value & 0x7f;");
+    output_line(out, "    uint8_t *bytes = %%tree-bytes-at-next-offset;");
+    if (gen->options.fixed_layout) {
+        output_line(out, "    memcpy(bytes, &value, sizeof(value));");
+        output_line(out, "    tree->next_offset += sizeof(value);");
+    } else {
+        output_line(out, "    size_t j = 0;");
+        output_line(out, "    while (value >> 7 != 0) {");
+        output_line(out, "        bytes[j++] = 0x80 | (value & 0x7f);");
+        output_line(out, "        value >>= 7;");
+        output_line(out, "    }");
+        output_line(out, "    bytes[j++] = value & 0x7f;");
+        output_line(out, "    tree->next_offset += j;");
+    }
     output_line(out, "}");
+    if (gen->grammar->number_of_lazy_rules > 0) {
+        output_line(out, "static void write_tree_padded(struct owl_tree *tree, uint64_t value, size_t width);");
+        output_line(out, "static void build_lazy_match_at(struct owl_tree *tree, size_t node);");
+        if (reads_whole_tree(gen))
+            output_line(out, "static void build_lazy_matches(struct owl_tree *tree);");
+    }
     for (uint32_t i = 0; i < n; ++i) {
         struct rule *rule = &gen->grammar->rules[i];
         set_unsigned_number_substitution(out, "rule-index", i);
         set_substitution(out, "rule", rule->name, rule->name_length,
          LOWERCASE_WITH_UNDERSCORES);
-        output_line(out, "struct parsed_%%rule parsed_%%rule_get(struct owl_ref ref) {");
-        output_line(out, "    if (ref.empty || ref._type != %%rule-index) {");
-        output_line(out, "        return (struct parsed_%%rule){");
-        for (uint32_t j = 0; j < rule->number_of_slots; ++j) {
-            set_substitution(out, "referenced-slot", rule->slots[j].name,
-             rule->slots[j].name_length, LOWERCASE_WITH_UNDERSCORES);
-            output_line(out, "            .%%referenced-slot.empty = true,");
+        // The 'next offset' field is passed back so lists can be decoded
+        // without reading it twice.
+        output_line(out, "static inline struct parsed_%%rule read_parsed_%%rule(struct owl_ref ref, size_t *next_delta) {");
+        if (rule_is_lazy(gen, i)) {
+            output_line(out, "    if (%%ref-tree->lazy_matches_left > 0)");
+            output_line(out, "        build_lazy_match_at(%%ref-tree, ref._offset);");
         }
-        if (rule->number_of_slots == 0)
-            output_line(out, "        0");
-        output_line(out, "        };");
-        output_line(out, "    }");
         output_line(out, "    size_t offset = ref._offset;");
-        output_line(out, "    read_tree(&offset, ref._tree); // Read and ignore the 'next offset' field.");
+        output_line(out, "    *next_delta = read_tree(&offset, %%ref-tree);");
         if (rule->is_token) {
-            output_line(out, "    size_t token_offset = read_tree(&offset, ref._tree);");
-            output_line(out, "    read_tree(&token_offset, ref._tree);");
-            output_line(out, "    size_t start_location = read_tree(&token_offset, ref._tree);");
-            output_line(out, "    size_t end_location = start_location + read_tree(&token_offset, ref._tree);");
+            output_line(out, "    size_t token_offset = read_tree(&offset, %%ref-tree);");
+            output_line(out, "    read_tree(&token_offset, %%ref-tree);");
+            if (rule_is_named(rule, "number") && !rule_has_range(gen, rule)) {
+                // Skip the range; a number's value doesn't depend on it.
+                output_line(out, "    read_tree(&token_offset, %%ref-tree);");
+                output_line(out, "    read_tree(&token_offset, %%ref-tree);");
+            } else {
+                output_line(out, "    size_t start_location = read_tree(&token_offset, %%ref-tree);");
+                output_line(out, "    size_t end_location = start_location + read_tree(&token_offset, %%ref-tree);");
+            }
             if (rule_is_named(rule, "string")) {
-                output_line(out, "    size_t string_offset = read_tree(&token_offset, ref._tree);");
+                output_line(out, "    size_t string_offset = read_tree(&token_offset, %%ref-tree);");
                 output_line(out, "    const char *string = string_offset ?");
-                output_line(out, "     (const char *)ref._tree->parse_tree + string_offset : ref._tree->string + start_location + 1;");
+                if (gen->options.segmented_tree)
+                    output_line(out, "     (const char *)tree_bytes(%%ref-tree, string_offset) : %%ref-tree->string + start_location + 1;");
+                else
+                    output_line(out, "     (const char *)%%ref-tree->parse_tree + string_offset : %%ref-tree->string + start_location + 1;");
                 output_line(out, "    size_t string_length = string_offset ?");
-                output_line(out, "     read_tree(&token_offset, ref._tree) : end_location - start_location - 2;");
+                output_line(out, "     read_tree(&token_offset, %%ref-tree) : end_location - start_location - 2;");
             }
+        } else if (gen->options.omit_ranges) {
+            output_line(out, "    size_t start_location = OWL_RANGE_UNAVAILABLE;");
+            output_line(out, "    size_t end_location = OWL_RANGE_UNAVAILABLE;");
         } else {
-            output_line(out, "    size_t start_location = read_tree(&offset, ref._tree);");
-            output_line(out, "    size_t end_location = start_location + read_tree(&offset, ref._tree);");
+            output_line(out, "    size_t start_location = read_tree(&offset, %%ref-tree);");
+            output_line(out, "    size_t end_location = start_location + read_tree(&offset, %%ref-tree);");
         }
         output_line(out, "    struct parsed_%%rule result = {");
         if (rule->is_token) {
             if (rule_is_named(rule, "identifier")) {
-                output_line(out, "        .identifier = ref._tree->string + start_location,");
+                output_line(out, "        .identifier = %%ref-tree->string + start_location,");
                 output_line(out, "        .length = end_location - start_location,");
+                if (gen->options.intern_identifiers)
+                    output_line(out, "        .id = (uint32_t)read_tree(&token_offset, %%ref-tree),");
             } else if (rule_is_named(rule, "number")) {
-                output_line(out, "        .number = (union { double n; uint64_t v; }){ .v = read_tree(&token_offset, ref._tree) }.n,");
+                output_line(out, "        .number = (union { double n; uint64_t v; }){ .v = read_tree(&token_offset, %%ref-tree) }.n,");
             } else if (rule_is_named(rule, "string")) {
                 output_line(out, "        .string = string,");
                 output_line(out, "        .length = string_length,");
             }
         }
-        output_line(out, "        .range.start = start_location,");
-        output_line(out, "        .range.end = end_location,");
+        if (rule->is_token && !rule_has_range(gen, rule)) {
+            output_line(out, "        .range.start = OWL_RANGE_UNAVAILABLE,");
+            output_line(out, "        .range.end = OWL_RANGE_UNAVAILABLE,");
+        } else {
+            output_line(out, "        .range.start = start_location,");
+            output_line(out, "        .range.end = end_location,");
+        }
         if (rule->number_of_choices > 0)
-            output_line(out, "        .type = (enum parsed_type)read_tree(&offset, ref._tree),");
+            output_line(out, "        .type = (enum parsed_type)read_tree(&offset, %%ref-tree),");
         output_line(out, "    };");
         for (uint32_t j = 0; j < rule->number_of_slots; ++j) {
             struct slot slot = rule->slots[j];
@@ -420,21 +1119,79 @@ void generate(struct generator *gen)
              slot.name_length, LOWERCASE_WITH_UNDERSCORES);
             set_unsigned_number_substitution(out, "referenced-slot-type",
              slot.rule_index);
-            output_line(out, "    result.%%referenced-slot._tree = ref._tree;");
-            output_line(out, "    result.%%referenced-slot._offset = read_tree(&offset, ref._tree);");
+            if (!gen->options.compact_refs)
+                output_line(out, "    result.%%referenced-slot._tree = ref._tree;");
+            output_line(out, "    result.%%referenced-slot._offset = read_tree(&offset, %%ref-tree);");
             output_line(out, "    result.%%referenced-slot._type = %%referenced-slot-type;");
             output_line(out, "    result.%%referenced-slot.empty = result.%%referenced-slot._offset == 0;");
         }
         output_line(out, "    return result;");
         output_line(out, "}");
+        output_line(out, "struct parsed_%%rule parsed_%%rule_get(struct owl_ref ref) {");
+        output_line(out, "    if (ref.empty || ref._type != %%rule-index) {");
+        output_line(out, "        return (struct parsed_%%rule){");
+        for (uint32_t j = 0; j < rule->number_of_slots; ++j) {
+            set_substitution(out, "referenced-slot", rule->slots[j].name,
+             rule->slots[j].name_length, LOWERCASE_WITH_UNDERSCORES);
+            output_line(out, "            .%%referenced-slot.empty = true,");
+        }
+        if (rule->number_of_slots == 0)
+            output_line(out, "        0");
+        output_line(out, "        };");
+        output_line(out, "    }");
+        output_line(out, "    size_t next_delta;");
+        output_line(out, "    return read_parsed_%%rule(ref, &next_delta);");
+        output_line(out, "}");
+        output_line(out, "size_t parsed_%%rule_get_many(struct owl_ref ref, struct parsed_%%rule *out, size_t n) {");
+        output_line(out, "    if (ref._type != %%rule-index)");
+        output_line(out, "        return 0;");
+        output_line(out, "    size_t i = 0;");
+        output_line(out, "    while (i < n && !ref.empty) {");
+        output_line(out, "        size_t next_delta;");
+        output_line(out, "        out[i++] = read_parsed_%%rule(ref, &next_delta);");
+        output_line(out, "        ref._offset = %%ref-tree->preorder ? ref._offset + next_delta : ref._offset - next_delta;");
+        output_line(out, "        ref.empty = next_delta == 0;");
+        output_line(out, "    }");
+        output_line(out, "    return i;");
+        output_line(out, "}");
+    }
+    if (gen->options.fixed_layout)
+        generate_field_accessors(gen, out, true);
+    uint32_t max_slots = 1;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (gen->grammar->rules[i].number_of_slots > max_slots)
+            max_slots = gen->grammar->rules[i].number_of_slots;
+    }
+    set_unsigned_number_substitution(out, "max-slots", max_slots);
+    output_line(out, "#define MAX_NUMBER_OF_SLOTS %%max-slots");
+    uint32_t max_node_entries = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        if (rule->is_token)
+            continue;
+        uint32_t entries = 1 + (gen->options.omit_ranges ? 0 : 2) +
+         (rule->number_of_choices > 0 ? 1 : 0) + rule->number_of_slots +
+         (gen->options.subtree_hashes ? 1 : 0);
+        if (entries > max_node_entries)
+            max_node_entries = entries;
     }
+    set_unsigned_number_substitution(out, "max-node-entries", max_node_entries);
+    if (gen->options.share_subtrees)
+        generate_subtree_sharing(gen, out);
+    if (gen->options.subtree_hashes)
+        generate_subtree_hashes(gen, out);
     output_line(out, "static size_t finish_node(uint32_t rule, uint32_t choice, "
      "size_t next_sibling, size_t *slots, size_t start_location, size_t end_location, void *info) {");
     output_line(out, "    struct owl_tree *tree = info;");
+    output_line(out, "    reserve_tree(tree, %%max-node-entries * RESERVATION_AMOUNT);");
     output_line(out, "    size_t offset = tree->next_offset;");
     output_line(out, "    write_tree(tree, next_sibling ? offset - next_sibling : 0);");
-    output_line(out, "    write_tree(tree, start_location);");
-    output_line(out, "    write_tree(tree, end_location - start_location);");
+    if (!gen->options.omit_ranges) {
+        output_line(out, "    write_tree(tree, start_location);");
+        output_line(out, "    write_tree(tree, end_location - start_location);");
+    }
+    if (gen->options.subtree_hashes)
+        output_line(out, "    uint64_t type = 0;");
     output_line(out, "    switch (rule) {");
     for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
         struct rule *rule = &gen->grammar->rules[i];
@@ -442,6 +1199,21 @@ void generate(struct generator *gen)
             continue;
         set_unsigned_number_substitution(out, "rule-index", i);
         output_line(out, "    case %%rule-index: {");
+        if (rule_is_lazy(gen, i)) {
+            // Lazy rules are single brackets, so they have no choices.
+            set_unsigned_number_substitution(out, "number-of-slots",
+             rule->number_of_slots);
+            output_line(out, "        if (tree->lazy_match_pending) {");
+            output_line(out, "            // Leave room to fill in the fields when the match is built.");
+            output_line(out, "            struct lazy_match *match = &tree->lazy_matches[tree->number_of_lazy_matches - 1];");
+            output_line(out, "            tree->lazy_match_pending = false;");
+            output_line(out, "            match->node = offset;");
+            output_line(out, "            match->fields = tree->next_offset;");
+            output_line(out, "            for (int i = 0; i < %%number-of-slots; ++i)");
+            output_line(out, "                write_tree_padded(tree, 0, RESERVATION_AMOUNT);");
+            output_line(out, "            return offset;");
+            output_line(out, "        }");
+        }
         if (rule->number_of_choices > 0) {
             output_line(out, "        switch (choice) {");
             for (uint32_t i = 0; i < rule->number_of_choices; ++i) {
@@ -449,6 +1221,8 @@ void generate(struct generator *gen)
                 set_substitution(out, "choice-name", rule->choices[i].name,
                  rule->choices[i].name_length, UPPERCASE_WITH_UNDERSCORES);
                 output_line(out, "        case %%choice-index:");
+                if (gen->options.subtree_hashes)
+                    output_line(out, "            type = PARSED_%%choice-name;");
                 output_line(out, "            write_tree(tree, PARSED_%%choice-name);");
                 output_line(out, "            break;");
             }
@@ -464,10 +1238,16 @@ void generate(struct generator *gen)
     output_line(out, "    default:");
     output_line(out, "        break;");
     output_line(out, "    }");
-    output_line(out, "    return offset;");
+    if (gen->options.subtree_hashes)
+        output_line(out, "    write_tree(tree, hash_node(tree, rule, type, slots));");
+    if (gen->options.share_subtrees)
+        output_line(out, "    return share_node(tree, rule, offset, false);");
+    else
+        output_line(out, "    return offset;");
     output_line(out, "}");
     output_line(out, "static size_t finish_token(uint32_t rule, size_t next_sibling, void *info) {");
     output_line(out, "    struct owl_tree *tree = info;");
+    output_line(out, "    reserve_tree(tree, 2 * RESERVATION_AMOUNT);");
     output_line(out, "    size_t offset = tree->next_offset;");
     output_line(out, "    write_tree(tree, next_sibling ? offset - next_sibling : 0);");
     output_line(out, "    switch (rule) {");
@@ -490,123 +1270,120 @@ void generate(struct generator *gen)
     output_line(out, "    default:");
     output_line(out, "        break;");
     output_line(out, "    }");
-    output_line(out, "    return offset;");
+    if (gen->options.share_subtrees)
+        output_line(out, "    return share_node(tree, rule, offset, true);");
+    else
+        output_line(out, "    return offset;");
     output_line(out, "}");
-    output_line(out, "static void check_for_error(struct owl_tree *tree) {");
-    output_line(out, "    if (tree->error == ERROR_NONE)");
-    output_line(out, "        return;");
-    output_line(out, "    fprintf(stderr, \"parse error: \");");
-    output_line(out, "    switch (tree->error) {");
-    output_line(out, "    case ERROR_INVALID_FILE:");
-    output_line(out, "        fprintf(stderr, \"invalid file\\n\");");
-    output_line(out, "        break;");
-    output_line(out, "    case ERROR_INVALID_TOKEN:");
-    output_line(out, "        fprintf(stderr, \"invalid token '%.*s'\\n\", (int)(tree->error_range.end - tree->error_range.start), tree->string + tree->error_range.start);");
-    output_line(out, "        break;");
-    output_line(out, "    case ERROR_UNEXPECTED_TOKEN:");
-    output_line(out, "        fprintf(stderr, \"unexpected token '%.*s'\\n\", (int)(tree->error_range.end - tree->error_range.start), tree->string + tree->error_range.start);");
-    output_line(out, "        break;");
-    output_line(out, "    case ERROR_MORE_INPUT_NEEDED:");
-    output_line(out, "        fprintf(stderr, \"more input needed\\n\");");
-    output_line(out, "        break;");
-    output_line(out, "    default:");
-    output_line(out, "        break;");
-    output_line(out, "    }");
-    output_line(out, "    exit(-1);");
-    output_line(out, "}");
-    // Only generate print functions that will actually be called (mostly to
-    // avoid compiler warnings).
-    struct bitset printable_rules = bitset_create_empty(n);
-    bitset_add(&printable_rules, gen->grammar->root_rule);
-    for (uint32_t i = 0; i < n; ++i) {
-        struct rule *rule = &gen->grammar->rules[i];
-        for (uint32_t j = 0; j < rule->number_of_slots; ++j)
-            bitset_add(&printable_rules, rule->slots[j].rule_index);
-    }
-    for (uint32_t i = 0; i < n; ++i) {
-        if (!bitset_contains(&printable_rules, i))
-            continue;
+    output_line(out, "// Moves past a token's data without using it, for tokens in skipped rules.");
+    output_line(out, "static void skip_token(uint32_t rule, void *info) {");
+    output_line(out, "    struct owl_tree *tree = info;");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
         struct rule *rule = &gen->grammar->rules[i];
-        set_substitution(out, "rule", rule->name, rule->name_length,
-         LOWERCASE_WITH_UNDERSCORES);
-        output_line(out, "static void parsed_%%rule_print(struct owl_tree *tree, struct owl_ref ref, const char *slot_name, int indent);");
-    }
-    for (uint32_t i = 0; i < n; ++i) {
-        if (!bitset_contains(&printable_rules, i))
+        if (!rule->is_token)
             continue;
-        struct rule *rule = &gen->grammar->rules[i];
+        set_unsigned_number_substitution(out, "rule-index", i);
         set_substitution(out, "rule", rule->name, rule->name_length,
          LOWERCASE_WITH_UNDERSCORES);
-        output_line(out, "static void parsed_%%rule_print(struct owl_tree *tree, struct owl_ref ref, const char *slot_name, int indent) {");
-        output_line(out, "    while (!ref.empty) {");
-        output_line(out, "        struct parsed_%%rule it = parsed_%%rule_get(ref);");
-        output_line(out, "        for (int i = 0; i < indent; ++i) printf(\"  \");");
-        output_line(out, "        printf(\"%%rule\");");
-        output_line(out, "        if (strcmp(\"%%rule\", slot_name))");
-        output_line(out, "            printf(\"@%s\", slot_name);");
-        if (rule->number_of_choices > 0) {
-            output_line(out, "        switch (it.type) {");
-            for (uint32_t j = 0; j < rule->number_of_choices; ++j) {
-                set_substitution(out, "choice-name", rule->choices[j].name,
-                 rule->choices[j].name_length, UPPERCASE_WITH_UNDERSCORES);
-                output_line(out, "        case PARSED_%%choice-name:");
-                output_line(out, "            printf(\" : %%choice-name\");");
-                output_line(out, "            break;");
-            }
-            output_line(out, "        default:");
-            output_line(out, "            break;");
-            output_line(out, "        }");
-        }
-        if (rule->is_token) {
-            if (rule_is_named(rule, "identifier"))
-                output_line(out, "        printf(\" - %.*s\", (int)it.length, it.identifier);");
-            else if (rule_is_named(rule, "number"))
-                output_line(out, "        printf(\" - %f\", it.number);");
-            else if (rule_is_named(rule, "string"))
-                output_line(out, "        printf(\" - %.*s\", (int)it.length, it.string);");
-        }
-        output_line(out, "        printf(\" (%zu - %zu)\\n\", it.range.start, it.range.end);");
-        for (uint32_t j = 0; j < rule->number_of_slots; ++j) {
-            struct slot slot = rule->slots[j];
-            set_substitution(out, "slot-name", slot.name, slot.name_length,
-             LOWERCASE_WITH_UNDERSCORES);
-            struct rule *slot_rule = &gen->grammar->rules[slot.rule_index];
-            set_substitution(out, "slot-rule", slot_rule->name,
-             slot_rule->name_length, LOWERCASE_WITH_UNDERSCORES);
-            output_line(out, "        parsed_%%slot-rule_print(tree, it.%%slot-name, \"%%slot-name\", indent + 1);");
-        }
-        output_line(out, "        ref = owl_next(ref);");
+        output_line(out, "    case %%rule-index: {");
+        output_line(out, "        size_t offset = tree->next_%%rule_token_offset;");
+        output_line(out, "        if (offset == 0)");
+        output_line(out, "            abort();");
+        output_line(out, "        tree->next_%%rule_token_offset = offset - read_tree(&offset, tree);");
+        output_line(out, "        break;");
         output_line(out, "    }");
-        output_line(out, "}");
     }
-    bitset_destroy(&printable_rules);
-    output_line(out, "void owl_tree_print(struct owl_tree *tree) {");
-    output_line(out, "    check_for_error(tree);");
-    output_line(out, "    parsed_%%root-rule_print(tree, owl_tree_root_ref(tree), \"%%root-rule\", 0);");
+    output_line(out, "    default:");
+    output_line(out, "        break;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "static void check_for_error(struct owl_tree *tree) {");
+    output_line(out, "    if (tree->error == ERROR_NONE)");
+    output_line(out, "        return;");
+    output_line(out, "    fprintf(stderr, \"parse error: \");");
+    output_line(out, "    switch (tree->error) {");
+    output_line(out, "    case ERROR_INVALID_FILE:");
+    output_line(out, "        fprintf(stderr, \"invalid file\\n\");");
+    output_line(out, "        break;");
+    output_line(out, "    case ERROR_INVALID_TOKEN:");
+    output_line(out, "        fprintf(stderr, \"invalid token '%.*s'\\n\", (int)(tree->error_range.end - tree->error_range.start), tree->string + tree->error_range.start);");
+    output_line(out, "        break;");
+    output_line(out, "    case ERROR_UNEXPECTED_TOKEN:");
+    output_line(out, "        fprintf(stderr, \"unexpected token '%.*s'\\n\", (int)(tree->error_range.end - tree->error_range.start), tree->string + tree->error_range.start);");
+    output_line(out, "        break;");
+    output_line(out, "    case ERROR_MORE_INPUT_NEEDED:");
+    output_line(out, "        fprintf(stderr, \"more input needed\\n\");");
+    output_line(out, "        break;");
+    if (gen->options.compact_refs) {
+        output_line(out, "    case ERROR_INPUT_TOO_LARGE:");
+        output_line(out, "        fprintf(stderr, \"input too large\\n\");");
+        output_line(out, "        break;");
+    }
+    if (gen->options.parse_limits) {
+        output_line(out, "    case ERROR_LIMIT_EXCEEDED:");
+        output_line(out, "        fprintf(stderr, \"limit exceeded\\n\");");
+        output_line(out, "        break;");
+    }
+    output_line(out, "    default:");
+    output_line(out, "        break;");
+    output_line(out, "    }");
+    output_line(out, "    exit(-1);");
     output_line(out, "}");
+    if (gen->grammar->number_of_entry_rules > 0)
+        generate_entry_points(gen, out);
+    generate_tree_walker(gen, out);
 
     output_line(out, "struct owl_ref owl_next(struct owl_ref ref) {");
     output_line(out, "    if (ref.empty) return ref;");
     output_line(out, "    size_t offset = ref._offset;");
-    output_line(out, "    size_t delta = read_tree(&ref._offset, ref._tree);");
+    output_line(out, "    size_t delta = read_tree(&offset, %%ref-tree);");
     output_line(out, "    return (struct owl_ref){");
-    output_line(out, "        ._tree = ref._tree,");
-    output_line(out, "        ._offset = offset - delta,");
+    if (!gen->options.compact_refs)
+        output_line(out, "        ._tree = ref._tree,");
+    output_line(out, "        ._offset = %%ref-tree->preorder ? ref._offset + delta : ref._offset - delta,");
     output_line(out, "        ._type = ref._type,");
     output_line(out, "        .empty = delta == 0,");
     output_line(out, "    };");
     output_line(out, "}");
 
+    output_line(out, "size_t owl_count(struct owl_ref ref) {");
+    output_line(out, "    return owl_collect(ref, 0, 0);");
+    output_line(out, "}");
+    output_line(out, "size_t owl_collect(struct owl_ref ref, struct owl_ref *out, size_t capacity) {");
+    output_line(out, "    size_t count = 0;");
+    output_line(out, "    while (!ref.empty) {");
+    output_line(out, "        if (count < capacity)");
+    output_line(out, "            out[count] = ref;");
+    output_line(out, "        count++;");
+    output_line(out, "        size_t offset = ref._offset;");
+    output_line(out, "        size_t delta = read_tree(&offset, %%ref-tree);");
+    output_line(out, "        ref._offset = %%ref-tree->preorder ? ref._offset + delta : ref._offset - delta;");
+    output_line(out, "        ref.empty = delta == 0;");
+    output_line(out, "    }");
+    output_line(out, "    return count;");
+    output_line(out, "}");
     output_line(out, "bool owl_refs_equal(struct owl_ref a, struct owl_ref b) {");
-    output_line(out, "    return a._tree == b._tree && a._offset == b._offset;");
+    if (gen->options.compact_refs)
+        output_line(out, "    return a._offset == b._offset;");
+    else
+        output_line(out, "    return a._tree == b._tree && a._offset == b._offset;");
     output_line(out, "}");
 
+    if (gen->options.compact_refs) {
+        output_line(out, "void owl_tree_set_current(struct owl_tree *tree) {");
+        output_line(out, "    owl_current_tree = tree;");
+        output_line(out, "}");
+    }
     output_line(out, "struct owl_ref owl_tree_root_ref(struct owl_tree *tree) {");
     output_line(out, "    check_for_error(tree);");
+    if (gen->options.compact_refs)
+        output_line(out, "    owl_current_tree = tree;");
     output_line(out, "    return (struct owl_ref){");
-    output_line(out, "        ._tree = tree,");
+    if (!gen->options.compact_refs)
+        output_line(out, "        ._tree = tree,");
     output_line(out, "        ._offset = tree->root_offset,");
-    output_line(out, "        ._type = %%root-rule-index,");
+    output_line(out, "        ._type = %%tree-root-rule,");
     output_line(out, "        .empty = tree->root_offset == 0,");
     output_line(out, "    };");
     output_line(out, "}");
@@ -642,25 +1419,41 @@ void generate(struct generator *gen)
         set_substitution(out, "rule", rule->name, rule->name_length,
          LOWERCASE_WITH_UNDERSCORES);
         if (rule_is_named(rule, "identifier")) {
+            if (gen->options.intern_identifiers)
+                generate_identifier_interning(out);
             set_literal_substitution(out, "write-identifier-token", "write_identifier_token");
             output_line(out, "static void write_identifier_token(size_t offset, size_t length, void *info) {");
             output_line(out, "    struct owl_tree *tree = info;");
+            if (gen->options.intern_identifiers)
+                output_line(out, "    reserve_tree(tree, 4 * RESERVATION_AMOUNT);");
+            else
+                output_line(out, "    reserve_tree(tree, 3 * RESERVATION_AMOUNT);");
         } else if (rule_is_named(rule, "number")) {
             set_literal_substitution(out, "write-number-token", "write_number_token");
             output_line(out, "static void write_number_token(size_t offset, size_t length, double number, void *info) {");
             output_line(out, "    struct owl_tree *tree = info;");
+            output_line(out, "    reserve_tree(tree, 4 * RESERVATION_AMOUNT);");
         } else if (rule_is_named(rule, "string")) {
             set_literal_substitution(out, "write-string-token", "write_string_token");
             output_line(out, "static void write_string_token(size_t offset, size_t length, const char *string, size_t string_length, bool has_escapes, void *info) {");
             output_line(out, "    struct owl_tree *tree = info;");
-            output_line(out, "    size_t string_offset = has_escapes ? (uint8_t *)string - tree->parse_tree : 0;");
+            if (gen->options.segmented_tree)
+                output_line(out, "    size_t string_offset = has_escapes ? tree->string_contents_offset : 0;");
+            else
+                output_line(out, "    size_t string_offset = has_escapes ? (uint8_t *)string - tree->parse_tree : 0;");
+            output_line(out, "    reserve_tree(tree, 5 * RESERVATION_AMOUNT);");
+        }
+        if (gen->options.tokenize) {
+            output_line(out, "    if (tree->tokens_only)");
+            output_line(out, "        return;");
         }
         output_line(out, "    size_t token_offset = tree->next_offset;");
         output_line(out, "    write_tree(tree, token_offset - tree->next_%%rule_token_offset);");
         output_line(out, "    write_tree(tree, offset);");
         output_line(out, "    write_tree(tree, length);");
         if (rule_is_named(rule, "identifier")) {
-            // We don't need to do anything else.
+            if (gen->options.intern_identifiers)
+                output_line(out, "    write_tree(tree, intern_identifier(tree, offset, length));");
         } else if (rule_is_named(rule, "number")) {
             output_line(out, "    union { double n; uint64_t v; } u = { .n = number };");
             output_line(out, "    write_tree(tree, u.v);");
@@ -676,18 +1469,49 @@ void generate(struct generator *gen)
     }
     output_line(out, "static void *allocate_string_contents(size_t size, void *info) {");
     output_line(out, "    struct owl_tree *tree = info;");
-    output_line(out, "    if (tree->next_offset + size > tree->parse_tree_size)");
-    output_line(out, "        grow_tree(tree, tree->next_offset + size);");
-    output_line(out, "    void *p = tree->parse_tree + tree->next_offset;");
+    if (gen->options.fixed_layout)
+        output_line(out, "    size = (size + RESERVATION_AMOUNT - 1) & ~(size_t)(RESERVATION_AMOUNT - 1);");
+    output_line(out, "    reserve_tree(tree, size);");
+    if (gen->options.segmented_tree)
+        output_line(out, "    tree->string_contents_offset = tree->next_offset;");
+    output_line(out, "    void *p = %%tree-bytes-at-next-offset;");
     output_line(out, "    tree->next_offset += size;");
     output_line(out, "    return p;");
     output_line(out, "}");
+    if (gen->options.parse_limits) {
+        output_line(out, "// Checks the limits that can be reached while tokenizing, setting the tree's");
+        output_line(out, "// error if the next token would go over one.");
+        output_line(out, "static bool token_limit_reached(size_t tokens_read, size_t offset, size_t length, void *info) {");
+        output_line(out, "    struct owl_tree *tree = info;");
+        output_line(out, "    if (tree->limits.max_tokens && tokens_read >= tree->limits.max_tokens) {");
+        output_line(out, "        tree->error = ERROR_LIMIT_EXCEEDED;");
+        output_line(out, "        tree->error_range.start = offset;");
+        output_line(out, "        tree->error_range.end = offset + length;");
+        output_line(out, "        return true;");
+        output_line(out, "    }");
+        output_line(out, "    // Token data is written to the tree as it's read.");
+        output_line(out, "    if (tree->limits.max_tree_bytes && tree->next_offset > tree->limits.max_tree_bytes) {");
+        output_line(out, "        tree->error = ERROR_LIMIT_EXCEEDED;");
+        output_line(out, "        tree->error_range.start = 0;");
+        output_line(out, "        tree->error_range.end = 0;");
+        output_line(out, "        return true;");
+        output_line(out, "    }");
+        output_line(out, "    return false;");
+        output_line(out, "}");
+    } else {
+        output_line(out, "static bool token_limit_reached(size_t tokens_read, size_t offset, size_t length, void *info) {");
+        output_line(out, "    return false;");
+        output_line(out, "}");
+    }
     if (SHOULD_ALLOW_DASHES_IN_IDENTIFIERS(gen->combined))
         set_literal_substitution(out, "allow-dashes-in-identifiers", "true");
     else
         set_literal_substitution(out, "allow-dashes-in-identifiers", "false");
     output_formatted_source(out, tokenizer_source);
+    output_line(out, "static uint32_t root_rule_lookup(void *context);");
     output_line(out, "static uint32_t rule_lookup(uint32_t parent, uint32_t slot, void *context);");
+    output_line(out, "static bool skip_rule_lookup(uint32_t rule, void *context);");
+    output_line(out, "static void skip_token(uint32_t rule, void *info);");
     output_line(out, "static void fixity_associativity_precedence_lookup(int *fixity_associativity, int *precedence, uint32_t rule, uint32_t choice, void *context);");
     output_line(out, "static size_t number_of_slots_lookup(uint32_t rule, void *context);");
     output_line(out, "static void left_right_operand_slots_lookup(uint32_t rule, uint32_t *left, uint32_t *right, uint32_t *operand, void *context);");
@@ -697,32 +1521,8 @@ void generate(struct generator *gen)
     set_unsigned_number_substitution(out, "start-state",
      gen->deterministic->automaton.start_state);
     output_line(out, "");
-    uint32_t mask_width = reachability_mask_width(gen);
-    if (mask_width == 0)
-        mask_width = 1;
-    set_unsigned_number_substitution(out, "reachability-mask-width", mask_width);
-    output_line(out, "struct fill_run_continuation;");
-    output_line(out, "struct fill_run_state {");
-    output_line(out, "    %%state-type state;");
-    output_line(out, "    uint32_t reachability_mask[%%reachability-mask-width];");
-    output_line(out, "    struct fill_run_continuation *cont;");
-    output_line(out, "};");
-    output_line(out, "struct fill_run_continuation {");
-    output_line(out, "    struct fill_run_state *stack;");
-    output_line(out, "    size_t top_index;");
-    output_line(out, "    size_t capacity;");
-    output_line(out, "    int error;");
-    output_line(out, "};");
     struct automaton *a = &gen->deterministic->automaton;
     struct automaton *b = &gen->deterministic->bracket_automaton;
-    set_unsigned_number_substitution(out, "first-bracket-state-id",
-     a->number_of_states);
-    output_string(out, "static void bracket_entry_state(struct owl_token_run *run, struct fill_run_state *top, uint16_t token_index");
-    for (uint32_t i = 0; i < mask_width; ++i) {
-        set_unsigned_number_substitution(out, "mask-index", i);
-        output_string(out, ", uint32_t mask%%mask-index");
-    }
-    output_line(out, ");");
     uint32_t total_states = a->number_of_states + b->number_of_states;
     struct state_in_automaton *sorted_states =
      malloc(sizeof(struct state_in_automaton) * total_states);
@@ -745,6 +1545,89 @@ void generate(struct generator *gen)
     }
     qsort(sorted_states, total_states, sizeof(struct state_in_automaton),
      compare_state_transitions);
+
+    // Each bracket entry pushes a reachability mask onto the stack, and each
+    // bracket state checks the mask against its own set of reachable bracket
+    // transitions.  There are only a few distinct masks of either kind, so we
+    // give them ids and precompute the result of every possible check.
+    struct interned_masks entry_masks = {0};
+    struct interned_masks check_masks = {0};
+    uint32_t *entry_mask_ids = calloc(total_states, sizeof(uint32_t));
+    uint32_t *check_mask_ids = calloc(total_states, sizeof(uint32_t));
+    uint32_t number_of_bracket_transitions =
+     gen->deterministic->transitions.number_of_transitions;
+    for (uint32_t i = 0; i < total_states; ++i) {
+        entry_mask_ids[i] = UINT32_MAX;
+        check_mask_ids[i] = UINT32_MAX;
+        if (i > 0 && compare_state_transitions(sorted_states + i,
+         sorted_states + i - 1) == 0)
+            continue;
+        if (sorted_states[i].reachability_mask &&
+         number_of_bracket_transitions > 0) {
+            struct bitset mask =
+             bitset_create_empty(number_of_bracket_transitions);
+            bitset_union(&mask, sorted_states[i].reachability_mask);
+            check_mask_ids[i] = intern_mask(&check_masks, &mask);
+        }
+        if (sorted_states[i].bracket_accepting)
+            continue;
+        struct bitset mask = bracket_entry_mask(gen,
+         sorted_states[i].automaton->states[sorted_states[i].state]);
+        if (bitset_is_empty(&mask))
+            bitset_destroy(&mask);
+        else
+            entry_mask_ids[i] = intern_mask(&entry_masks, &mask);
+    }
+    if (entry_masks.number_of_masks > UINT16_MAX + 1)
+        set_literal_substitution(out, "mask-id-type", "uint32_t");
+    else
+        set_literal_substitution(out, "mask-id-type", "uint16_t");
+    output_line(out, "struct fill_run_continuation;");
+    output_line(out, "struct fill_run_state {");
+    output_line(out, "    %%state-type state;");
+    output_line(out, "    %%mask-id-type reachability_mask_id;");
+    output_line(out, "    struct fill_run_continuation *cont;");
+    output_line(out, "};");
+    output_line(out, "struct fill_run_continuation {");
+    output_line(out, "    struct fill_run_state *stack;");
+    output_line(out, "    size_t top_index;");
+    output_line(out, "    size_t capacity;");
+    if (gen->options.parse_limits) {
+        output_line(out, "    // Brackets nested deeper than this set the error to 2.");
+        output_line(out, "    size_t max_depth;");
+    }
+    output_line(out, "    int error;");
+    output_line(out, "};");
+    if (entry_masks.number_of_masks > 0 && check_masks.number_of_masks > 0) {
+        uint32_t check_words = (check_masks.number_of_masks + 31) / 32;
+        set_unsigned_number_substitution(out, "number-of-entry-masks",
+         entry_masks.number_of_masks);
+        set_unsigned_number_substitution(out, "number-of-check-words",
+         check_words);
+        output_line(out, "static const uint32_t reachability_table[%%number-of-entry-masks][%%number-of-check-words] = {");
+        for (uint32_t i = 0; i < entry_masks.number_of_masks; ++i) {
+            output_string(out, "    {");
+            for (uint32_t j = 0; j < check_words; ++j) {
+                uint32_t bits = 0;
+                for (uint32_t k = j * 32; k < check_masks.number_of_masks &&
+                 k < (j + 1) * 32; ++k) {
+                    if (bitset_intersects(&entry_masks.masks[i],
+                     &check_masks.masks[k]))
+                        bits |= 1U << (k % 32);
+                }
+                set_unsigned_number_substitution(out, "mask-bits", bits);
+                output_string(out, "%%mask-bits,");
+            }
+            output_line(out, "},");
+        }
+        output_line(out, "};");
+    }
+    set_unsigned_number_substitution(out, "first-bracket-state-id",
+     a->number_of_states);
+    // Grammars without brackets never enter a bracket state.
+    bool has_bracket_entries = entry_masks.number_of_masks > 0;
+    if (has_bracket_entries)
+        output_line(out, "static void bracket_entry_state(struct owl_token_run *run, struct fill_run_state *top, uint16_t token_index, %%mask-id-type mask_id);");
     set_unsigned_number_substitution(out, "total-number-of-states", total_states);
     output_line(out, "static void (*state_funcs[%%total-number-of-states])(struct owl_token_run *, struct fill_run_state *, uint16_t);");
     state_id *func_id_for_state = calloc(total_states, sizeof(state_id));
@@ -762,10 +1645,18 @@ void generate(struct generator *gen)
         struct state s = sorted_states[i].automaton->states[sorted_states[i].state];
         set_unsigned_number_substitution(out, "func-id", func_id);
         output_line(out, "static void state_func_%%func-id(struct owl_token_run *run, struct fill_run_state *top, uint16_t token_index) {");
-        uint32_t mask_width = reachability_mask_width(gen);
-        if (sorted_states[i].reachability_mask) {
-            generate_reachability_mask_check(gen, out,
-             sorted_states[i].reachability_mask);
+        if (check_mask_ids[i] != UINT32_MAX &&
+         entry_masks.number_of_masks > 0) {
+            // Check if any of the end states we're expecting are still
+            // reachable.
+            set_unsigned_number_substitution(out, "check-word",
+             check_mask_ids[i] / 32);
+            set_unsigned_number_substitution(out, "check-bit",
+             1U << (check_mask_ids[i] % 32));
+            output_line(out, "    if (!(reachability_table[top->reachability_mask_id][%%check-word] & %%check-bit)) {");
+            output_line(out, "        top->cont->error = -1;");
+            output_line(out, "        return;");
+            output_line(out, "    }");
         }
         if (sorted_states[i].bracket_accepting) {
             set_unsigned_number_substitution(out, "state-transition-symbol",
@@ -785,41 +1676,20 @@ void generate(struct generator *gen)
         }
         output_line(out, "    %%token-type token = run->tokens[token_index];");
         output_line(out, "    switch (token) {");
-        struct bitset reachability_mask = bitset_create_empty(reachability_mask_width(gen));
         for (uint32_t j = 0; j < s.number_of_transitions; ++j) {
             struct transition t = s.transitions[j];
-            if (t.symbol >= gen->combined->number_of_tokens) {
-                // Symbols are either tokens or bracket symbols, so this must
-                // be a bracket symbol.
-                struct bracket_transitions ts = gen->deterministic->transitions;
-                for (uint32_t k = 0; k < ts.number_of_transitions; ++k) {
-                    if (ts.transitions[k].deterministic_transition_symbol == t.symbol)
-                        bitset_add(&reachability_mask, k);
-                }
-            }
             set_unsigned_number_substitution(out, "token-symbol", t.symbol);
             set_unsigned_number_substitution(out, "token-target", t.target + sorted_states[i].state_offset);
             output_line(out, "    case %%token-symbol: top->state = %%token-target; return;");
         }
         output_string(out, "    default:");
-        if (!bitset_is_empty(&reachability_mask)) {
+        if (entry_mask_ids[i] != UINT32_MAX) {
+            set_unsigned_number_substitution(out, "mask-id", entry_mask_ids[i]);
             output_line(out, "");
-            output_string(out, "        bracket_entry_state(run, top, token_index");
-            for (uint32_t i = 0; i < mask_width; ++i) {
-                set_unsigned_number_substitution(out, "mask-index", i);
-                uint64_t bits = reachability_mask.bit_groups[i / 2];
-                if (i % 2)
-                    bits >>= 32;
-                else
-                    bits &= UINT32_MAX;
-                set_unsigned_number_substitution(out, "mask-bits", (uint32_t)bits);
-                output_string(out, ", %%mask-bits");
-            }
-            output_line(out, ");");
+            output_line(out, "        bracket_entry_state(run, top, token_index, %%mask-id);");
             output_line(out, "        return;");
         } else
             output_line(out, " top->cont->error = 1; return;");
-        bitset_destroy(&reachability_mask);
         output_line(out, "    }");
         output_line(out, "}");
     }
@@ -836,41 +1706,48 @@ void generate(struct generator *gen)
     output_line(out, "};");
     free(sorted_states);
     free(func_id_for_state);
-    output_string(out, "static void bracket_entry_state(struct owl_token_run *run, struct fill_run_state *top, uint16_t token_index");
-    for (uint32_t i = 0; i < mask_width; ++i) {
-        set_unsigned_number_substitution(out, "mask-index", i);
-        output_string(out, ", uint32_t mask%%mask-index");
-    }
-    output_line(out, ") {");
-    output_line(out, "    struct fill_run_continuation *cont = top->cont;");
-    output_line(out, "    cont->top_index++;");
-    output_line(out, "    if (cont->top_index >= cont->capacity) {");
-    output_line(out, "        size_t new_capacity = (cont->capacity + 2) * 3 / 2;");
-    output_line(out, "        if (new_capacity <= cont->capacity)");
-    output_line(out, "            abort();");
-    output_line(out, "        struct fill_run_state *new_states = realloc(cont->stack, new_capacity * sizeof(struct fill_run_state));");
-    output_line(out, "        if (!new_states)");
-    output_line(out, "            abort();");
-    output_line(out, "        cont->stack = new_states;");
-    output_line(out, "        cont->capacity = new_capacity;");
-    output_line(out, "        top = &cont->stack[cont->top_index];");
-    output_line(out, "    } else");
-    output_line(out, "        top++;");
-    output_line(out, "    top->cont = cont;");
-    for (uint32_t i = 0; i < mask_width; ++i) {
-        set_unsigned_number_substitution(out, "mask-index", i);
-        output_line(out, "    top->reachability_mask[%%mask-index] = mask%%mask-index;");
-    }
-    output_line(out, "    run->states[token_index] = %%first-bracket-state-id;");
-    output_line(out, "    state_func_%%first-bracket-state-id(run, top, token_index);");
-    output_line(out, "    if (top->cont->error == -1)");
-    output_line(out, "        top->cont->error = 1;");
-    output_line(out, "}");
+    free(entry_mask_ids);
+    free(check_mask_ids);
+    interned_masks_destroy(&entry_masks);
+    interned_masks_destroy(&check_masks);
+    if (has_bracket_entries) {
+        output_line(out, "static void bracket_entry_state(struct owl_token_run *run, struct fill_run_state *top, uint16_t token_index, %%mask-id-type mask_id) {");
+        output_line(out, "    struct fill_run_continuation *cont = top->cont;");
+        if (gen->options.parse_limits) {
+            output_line(out, "    if (cont->top_index >= cont->max_depth) {");
+            output_line(out, "        cont->error = 2;");
+            output_line(out, "        return;");
+            output_line(out, "    }");
+        }
+        output_line(out, "    cont->top_index++;");
+        output_line(out, "    if (cont->top_index >= cont->capacity) {");
+        output_line(out, "        size_t new_capacity = (cont->capacity + 2) * 3 / 2;");
+        output_line(out, "        if (new_capacity <= cont->capacity)");
+        output_line(out, "            abort();");
+        output_line(out, "        struct fill_run_state *new_states = realloc(cont->stack, new_capacity * sizeof(struct fill_run_state));");
+        output_line(out, "        if (!new_states)");
+        output_line(out, "            abort();");
+        output_line(out, "        cont->stack = new_states;");
+        output_line(out, "        cont->capacity = new_capacity;");
+        output_line(out, "        top = &cont->stack[cont->top_index];");
+        output_line(out, "    } else");
+        output_line(out, "        top++;");
+        output_line(out, "    top->cont = cont;");
+        output_line(out, "    top->reachability_mask_id = mask_id;");
+        output_line(out, "    run->states[token_index] = %%first-bracket-state-id;");
+        output_line(out, "    state_func_%%first-bracket-state-id(run, top, token_index);");
+        output_line(out, "    if (top->cont->error == -1)");
+        output_line(out, "        top->cont->error = 1;");
+        output_line(out, "}");
+    }
     output_line(out, "static bool fill_run_states(struct owl_token_run *run, struct fill_run_continuation *cont, uint16_t *failing_index);");
     output_line(out, "static size_t build_parse_tree(struct owl_default_tokenizer *, struct owl_token_run *, struct owl_tree *);");
     output_line(out, "");
     output_line(out, "static struct owl_tree *owl_tree_create_empty(void) {");
-    output_line(out, "    return calloc(1, sizeof(struct owl_tree));");
+    output_line(out, "    struct owl_tree *tree = calloc(1, sizeof(struct owl_tree));");
+    output_line(out, "    if (tree)");
+    output_line(out, "        tree->root_rule = %%root-rule-index;");
+    output_line(out, "    return tree;");
     output_line(out, "}");
     output_line(out, "");
     output_line(out, "static void free_token_runs(struct owl_token_run **run) {");
@@ -880,67 +1757,80 @@ void generate(struct generator *gen)
     output_line(out, "        *run = prev;");
     output_line(out, "    }");
     output_line(out, "}");
+    if (gen->options.tokenize) {
+        output_line(out, "// Reads the token lengths in a run from front to back (decode_length reads them");
+        output_line(out, "// from back to front).");
+        output_line(out, "static size_t read_token_run_length(struct owl_token_run *run, uint16_t *length_offset) {");
+        output_line(out, "    size_t length = 0;");
+        output_line(out, "    int shift = 0;");
+        output_line(out, "    do {");
+        output_line(out, "        length |= (size_t)(run->lengths[(*length_offset)++] & 0x7f) << shift;");
+        output_line(out, "        shift += 7;");
+        output_line(out, "    } while (*length_offset < run->lengths_size && (run->lengths[*length_offset] & 0x80));");
+        output_line(out, "    return length;");
+        output_line(out, "}");
+    }
+    if (gen->options.parse_limits) {
+        output_line(out, "static size_t max_nesting_depth(struct owl_tree *tree) {");
+        output_line(out, "    return tree->limits.max_nesting_depth ? tree->limits.max_nesting_depth : SIZE_MAX;");
+        output_line(out, "}");
+    }
+    if (gen->grammar->number_of_entry_rules > 0) {
+        set_literal_substitution(out, "initial-state",
+         "entry_point_for_rule(tree->root_rule)->state");
+    } else {
+        set_unsigned_number_substitution(out, "initial-state",
+         gen->deterministic->automaton.start_state);
+    }
+    generate_parse_string(gen, out);
+    if (gen->options.from_tokens)
+        generate_parse_tokens(gen, out);
     output_line(out, "struct owl_tree *owl_tree_create_from_string(const char *string) {");
     output_line(out, "    struct owl_tree *tree = owl_tree_create_empty();");
-    output_line(out, "    tree->string = string;");
-    output_line(out, "    tree->next_offset = 1;");
-    output_line(out, "    struct owl_default_tokenizer tokenizer = {");
-    output_line(out, "        .text = string,");
-    output_line(out, "        .info = tree,");
-    output_line(out, "    };");
-    output_line(out, "    struct owl_token_run *token_run = 0;");
-    output_line(out, "    struct fill_run_continuation c = {");
-    output_line(out, "        .capacity = 8,");
-    output_line(out, "        .top_index = 0,");
-    output_line(out, "    };");
-    output_line(out, "    c.stack = calloc(c.capacity, sizeof(struct fill_run_state));");
-    output_line(out, "    c.stack[0].state = %%start-state;");
-    output_line(out, "    c.stack[0].cont = &c;");
-    output_line(out, "    uint16_t failing_index = 0;");
-    output_line(out, "    while (owl_default_tokenizer_advance(&tokenizer, &token_run)) {");
-    output_line(out, "        if (!fill_run_states(token_run, &c, &failing_index)) {");
-    output_line(out, "            free(c.stack);");
-    output_line(out, "            tree->error = ERROR_UNEXPECTED_TOKEN;");
-    output_line(out, "            find_token_range(&tokenizer, token_run, failing_index, &tree->error_range.start, &tree->error_range.end);");
-    output_line(out, "            free_token_runs(&token_run);");
-    output_line(out, "            return tree;");
-    output_line(out, "        }");
-    output_line(out, "    }");
-    output_line(out, "    struct fill_run_state top = c.stack[c.top_index];");
-    output_line(out, "    free(c.stack);");
-    output_line(out, "    if (string[tokenizer.offset] != '\\0') {");
-    output_line(out, "        tree->error = ERROR_INVALID_TOKEN;");
-    output_line(out, "        estimate_next_token_range(&tokenizer, &tree->error_range.start, &tree->error_range.end);");
-    output_line(out, "        free_token_runs(&token_run);");
-    output_line(out, "        return tree;");
-    output_line(out, "    }");
-    output_line(out, "    switch (top.state) {");
-    for (state_id i = 0; i < gen->deterministic->automaton.number_of_states; ++i) {
-        if (!gen->deterministic->automaton.states[i].accepting)
-            continue;
-        set_unsigned_number_substitution(out, "state-id", i);
-        output_line(out, "    case %%state-id:");
+    output_line(out, "    parse_string(tree, string);");
+    output_line(out, "    return tree;");
+    output_line(out, "}");
+    for (uint32_t i = 0; i < gen->grammar->number_of_entry_rules; ++i) {
+        struct rule *rule = &gen->grammar->rules[gen->grammar->entry_rules[i]];
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        set_unsigned_number_substitution(out, "rule-index",
+         gen->grammar->entry_rules[i]);
+        output_line(out, "struct owl_tree *owl_tree_create_from_string_as_%%rule(const char *string) {");
+        output_line(out, "    struct owl_tree *tree = owl_tree_create_empty();");
+        output_line(out, "    tree->root_rule = %%rule-index;");
+        output_line(out, "    parse_string(tree, string);");
+        output_line(out, "    return tree;");
+        output_line(out, "}");
     }
-    output_line(out, "        break;");
-    output_line(out, "    default:");
-    output_line(out, "        tree->error = ERROR_MORE_INPUT_NEEDED;");
-    output_line(out, "        find_end_range(&tokenizer, &tree->error_range.start, &tree->error_range.end);");
-    output_line(out, "        free_token_runs(&token_run);");
-    output_line(out, "        return tree;");
-    output_line(out, "    }");
-    /*
-    output_line(out, "    struct owl_token_run *run_to_print = token_run;");
-    output_line(out, "    while (run_to_print) {");
-    output_line(out, "        for (uint32_t i = 0; i < run_to_print->number_of_tokens; ++i) {");
-    output_line(out, "            printf(\"%u -> %u\\n\", run_to_print->tokens[i], run_to_print->states[i]);");
-    output_line(out, "        }");
-    output_line(out, "        printf(\"--\\n\");");
-    output_line(out, "        run_to_print = run_to_print->prev;");
+    output_line(out, "struct owl_tree *owl_tree_create_from_string_keeping(const char *string, const enum owl_rule *rules, size_t number_of_rules) {");
+    output_line(out, "    struct owl_tree *tree = owl_tree_create_empty();");
+    output_line(out, "    memset(tree->skipped_rules, true, sizeof(tree->skipped_rules));");
+    output_line(out, "    for (size_t i = 0; i < number_of_rules; ++i) {");
+    output_line(out, "        if ((size_t)rules[i] < sizeof(tree->skipped_rules))");
+    output_line(out, "            tree->skipped_rules[rules[i]] = false;");
     output_line(out, "    }");
-     */
-    output_line(out, "    tree->root_offset = build_parse_tree(&tokenizer, token_run, tree);");
+    output_line(out, "    tree->skipped_rules[%%root-rule-index] = false;");
+    output_line(out, "    parse_string(tree, string);");
     output_line(out, "    return tree;");
     output_line(out, "}");
+    if (gen->options.parse_limits) {
+        output_line(out, "struct owl_tree *owl_tree_create_from_string_with_limits(const char *string, const struct owl_parse_limits *limits) {");
+        output_line(out, "    struct owl_tree *tree = owl_tree_create_empty();");
+        output_line(out, "    tree->limits = *limits;");
+        output_line(out, "    // Look for the end of the string no further than the limit.");
+        output_line(out, "    size_t max_input_bytes = limits->max_input_bytes;");
+        output_line(out, "    if (max_input_bytes && max_input_bytes < SIZE_MAX && !memchr(string, '\\0', max_input_bytes + 1)) {");
+        output_line(out, "        tree->string = string;");
+        output_line(out, "        tree->error = ERROR_LIMIT_EXCEEDED;");
+        output_line(out, "        return tree;");
+        output_line(out, "    }");
+        output_line(out, "    parse_string(tree, string);");
+        output_line(out, "    return tree;");
+        output_line(out, "}");
+    }
+    if (gen->options.tokenize)
+        generate_tokenize(out);
     output_line(out, "static struct owl_tree *owl_tree_create_with_error(enum owl_error e) {");
     output_line(out, "    struct owl_tree *tree = owl_tree_create_empty();");
     output_line(out, "    tree->error = e;");
@@ -975,16 +1865,113 @@ void generate(struct generator *gen)
     output_line(out, "    return tree;");
     output_line(out, "}");
     output_line(out, "enum owl_error owl_tree_get_error(struct owl_tree *tree, struct source_range *error_range) {");
-    output_line(out, "    if (error_range)");
-    output_line(out, "        *error_range = tree->error_range;");
+    output_line(out, "    if (error_range) {");
+    output_line(out, "        error_range->start = tree->error_range.start;");
+    output_line(out, "        error_range->end = tree->error_range.end;");
+    output_line(out, "    }");
     output_line(out, "    return tree->error;");
     output_line(out, "}");
+    output_line(out, "static void build_line_starts(struct owl_tree *tree) {");
+    output_line(out, "    const char *string = tree->string ? tree->string : \"\";");
+    output_line(out, "    size_t length = strlen(string);");
+    output_line(out, "    size_t capacity = 64;");
+    output_line(out, "    size_t *starts = malloc(capacity * sizeof(size_t));");
+    output_line(out, "    if (!starts)");
+    output_line(out, "        abort();");
+    output_line(out, "    size_t count = 0;");
+    output_line(out, "    starts[count++] = 0;");
+    output_line(out, "    // memchr is usually vectorized, so this skips long lines quickly.");
+    output_line(out, "    const char *p = string;");
+    output_line(out, "    const char *end = string + length;");
+    output_line(out, "    while ((p = memchr(p, '\\n', (size_t)(end - p)))) {");
+    output_line(out, "        p++;");
+    output_line(out, "        if (count >= capacity) {");
+    output_line(out, "            capacity *= 2;");
+    output_line(out, "            starts = realloc(starts, capacity * sizeof(size_t));");
+    output_line(out, "            if (!starts)");
+    output_line(out, "                abort();");
+    output_line(out, "        }");
+    output_line(out, "        starts[count++] = (size_t)(p - string);");
+    output_line(out, "    }");
+    output_line(out, "    tree->line_starts = starts;");
+    output_line(out, "    tree->number_of_lines = count;");
+    output_line(out, "    tree->string_length = length;");
+    output_line(out, "}");
+    output_line(out, "bool owl_tree_line_column(struct owl_tree *tree, size_t offset, size_t *line, size_t *column) {");
+    output_line(out, "    if (!tree->line_starts)");
+    output_line(out, "        build_line_starts(tree);");
+    output_line(out, "    if (offset > tree->string_length)");
+    output_line(out, "        return false;");
+    output_line(out, "    // Find the last line starting at or before the offset.");
+    output_line(out, "    size_t low = 0;");
+    output_line(out, "    size_t high = tree->number_of_lines;");
+    output_line(out, "    while (high - low > 1) {");
+    output_line(out, "        size_t middle = low + (high - low) / 2;");
+    output_line(out, "        if (tree->line_starts[middle] <= offset)");
+    output_line(out, "            low = middle;");
+    output_line(out, "        else");
+    output_line(out, "            high = middle;");
+    output_line(out, "    }");
+    output_line(out, "    *line = low + 1;");
+    output_line(out, "    *column = offset - tree->line_starts[low] + 1;");
+    output_line(out, "    return true;");
+    output_line(out, "}");
+    if (gen->options.tree_index || gen->options.tree_edit ||
+     gen->grammar->number_of_lazy_rules > 0)
+        generate_node_readers(gen, out);
+    if (gen->options.tree_index)
+        generate_tree_index(gen, out);
+    generate_tree_storage(gen, out);
+    if (needs_tree_copier(gen))
+        generate_tree_copier(gen, out);
+    if (gen->options.tree_compact)
+        generate_tree_compact(gen, out);
+    if (gen->options.tree_extract)
+        generate_tree_extract(gen, out);
+    if (gen->options.tree_edit)
+        generate_tree_editing(gen, out);
+    if (gen->options.tree_export)
+        generate_tree_exporters(gen, out);
+    if (gen->options.tree_save)
+        generate_tree_persistence(gen, out);
+    if (gen->options.intern_identifiers) {
+        output_line(out, "const char *owl_tree_identifier_text(struct owl_tree *tree, uint32_t id, size_t *length) {");
+        output_line(out, "    if (id >= tree->number_of_identifiers) {");
+        output_line(out, "        *length = 0;");
+        output_line(out, "        return 0;");
+        output_line(out, "    }");
+        output_line(out, "    *length = (size_t)tree->identifiers[id].length;");
+        output_line(out, "    return tree->string + tree->identifiers[id].start;");
+        output_line(out, "}");
+        output_line(out, "uint32_t owl_tree_identifier_count(struct owl_tree *tree) {");
+        output_line(out, "    return tree->number_of_identifiers;");
+        output_line(out, "}");
+    }
     output_line(out, "void owl_tree_destroy(struct owl_tree *tree) {");
     output_line(out, "    if (!tree)");
     output_line(out, "        return;");
+    if (gen->options.compact_refs) {
+        output_line(out, "    if (owl_current_tree == tree)");
+        output_line(out, "        owl_current_tree = 0;");
+    }
     output_line(out, "    if (tree->owns_string)");
     output_line(out, "        free((void *)tree->string);");
-    output_line(out, "    free(tree->parse_tree);");
+    if (gen->options.tree_index)
+        output_line(out, "    destroy_tree_index(tree);");
+    if (gen->options.tree_edit)
+        output_line(out, "    destroy_edit_links(tree);");
+    output_line(out, "    free_tree_storage(tree);");
+    output_line(out, "    free(tree->line_starts);");
+    if (gen->options.intern_identifiers) {
+        output_line(out, "    free(tree->identifiers);");
+        output_line(out, "    free(tree->identifier_table);");
+    }
+    if (gen->options.share_subtrees)
+        output_line(out, "    free(tree->shared_nodes);");
+    if (gen->grammar->number_of_lazy_rules > 0) {
+        output_line(out, "    free(tree->lazy_matches);");
+        output_line(out, "    free_token_runs(&tree->token_runs);");
+    }
     output_line(out, "    free(tree);");
     output_line(out, "}");
     output_line(out, "static bool fill_run_states(struct owl_token_run *run, struct fill_run_continuation *cont, uint16_t *failing_index) {");
@@ -1004,6 +1991,23 @@ void generate(struct generator *gen)
     output_line(out, "}");
     generate_action_table(gen, out);
     generate_keyword_reader(gen, out);
+    output_line(out, "static uint32_t root_rule_lookup(void *context) {");
+    if (gen->grammar->number_of_entry_rules > 0 ||
+     gen->grammar->number_of_lazy_rules > 0)
+        output_line(out, "    struct owl_tree *tree = context;");
+    if (gen->grammar->number_of_lazy_rules > 0) {
+        output_line(out, "    if (tree->building_rule)");
+        output_line(out, "        return tree->building_rule - 1;");
+    }
+    if (gen->grammar->number_of_entry_rules > 0)
+        output_line(out, "    return tree->root_rule;");
+    else
+        output_line(out, "    return %%root-rule-index;");
+    output_line(out, "}");
+    output_line(out, "static bool skip_rule_lookup(uint32_t rule, void *context) {");
+    output_line(out, "    struct owl_tree *tree = context;");
+    output_line(out, "    return tree->skipped_rules[rule];");
+    output_line(out, "}");
     output_line(out, "static uint32_t rule_lookup(uint32_t parent, uint32_t slot, void *context) {");
     output_line(out, "    switch (parent) {");
     for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
@@ -1062,64 +2066,2790 @@ void generate(struct generator *gen)
     output_line(out, "    default: return;");
     output_line(out, "    }");
     output_line(out, "}");
-    output_line(out, "static size_t number_of_slots_lookup(uint32_t rule, void *context) {");
-    output_line(out, "    switch (rule) {");
-    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
-        set_unsigned_number_substitution(out, "rule-index", i);
-        set_unsigned_number_substitution(out, "number-of-slots",
-         gen->grammar->rules[i].number_of_slots);
-        output_line(out, "    case %%rule-index: return %%number-of-slots;");
+    output_line(out, "static size_t number_of_slots_lookup(uint32_t rule, void *context) {");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
+        set_unsigned_number_substitution(out, "rule-index", i);
+        set_unsigned_number_substitution(out, "number-of-slots",
+         gen->grammar->rules[i].number_of_slots);
+        output_line(out, "    case %%rule-index: return %%number-of-slots;");
+    }
+    output_line(out, "    default: return 0;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "static void left_right_operand_slots_lookup(uint32_t rule, uint32_t *left, uint32_t *right, uint32_t *operand, void *context) {");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        set_unsigned_number_substitution(out, "rule-index", i);
+        set_unsigned_number_substitution(out, "left-slot",
+         rule->left_slot_index);
+        set_unsigned_number_substitution(out, "right-slot",
+         rule->right_slot_index);
+        set_unsigned_number_substitution(out, "operand-slot",
+         rule->operand_slot_index);
+        output_line(out, "    case %%rule-index:");
+        output_line(out, "        *left = %%left-slot;");
+        output_line(out, "        *right = %%right-slot;");
+        output_line(out, "        *operand = %%operand-slot;");
+        output_line(out, "        break;");
+    }
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "#endif");
+    output_line(out, "");
+    output_destroy(out);
+}
+
+static void generate_fields_for_token_rule(struct generator_output *out,
+ struct rule *rule, const char *string)
+{
+    if (rule_is_named(rule, "identifier")) {
+        set_literal_substitution(out, "type", "const char *");
+        set_literal_substitution(out, "field", "identifier");
+        output_string(out, string);
+        set_literal_substitution(out, "type", "size_t ");
+        set_literal_substitution(out, "field", "length");
+        output_string(out, string);
+    } else if (rule_is_named(rule, "number")) {
+        set_literal_substitution(out, "type", "double ");
+        set_literal_substitution(out, "field", "number");
+        output_string(out, string);
+    } else if (rule_is_named(rule, "string")) {
+        set_literal_substitution(out, "type", "const char *");
+        set_literal_substitution(out, "field", "string");
+        output_string(out, string);
+        set_literal_substitution(out, "type", "size_t ");
+        set_literal_substitution(out, "field", "length");
+        output_string(out, string);
+    } else
+        abort();
+}
+
+static void generate_field_accessors(struct generator *gen,
+ struct generator_output *out, bool definitions)
+{
+    const uint32_t word = 8;
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        set_unsigned_number_substitution(out, "rule-index", i);
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        // Rule nodes start with the next sibling, the start location, and the
+        // length (unless ranges are omitted).  Token nodes start with the next
+        // sibling and the offset of the token data, which itself starts with a
+        // link to the previous token of the same type, the start location, and
+        // the length.
+        if (definitions) {
+            output_line(out, "struct source_range parsed_%%rule_range(struct owl_ref ref) {");
+            output_line(out, "    if (ref.empty || ref._type != %%rule-index)");
+            output_line(out, "        return (struct source_range){0};");
+            if (!rule_has_range(gen, rule)) {
+                output_line(out, "    return (struct source_range){ OWL_RANGE_UNAVAILABLE, OWL_RANGE_UNAVAILABLE };");
+                output_line(out, "}");
+            } else {
+                set_unsigned_number_substitution(out, "field-offset", word);
+                output_line(out, "    size_t offset = ref._offset + %%field-offset;");
+                if (rule->is_token)
+                    output_line(out, "    offset = read_tree(&offset, %%ref-tree) + %%field-offset;");
+                output_line(out, "    size_t start = read_tree(&offset, %%ref-tree);");
+                output_line(out, "    return (struct source_range){ start, start + read_tree(&offset, %%ref-tree) };");
+                output_line(out, "}");
+            }
+        } else
+            output_line(out, "struct source_range parsed_%%rule_range(struct owl_ref);");
+        if (rule->is_token)
+            continue;
+        uint32_t field = gen->options.omit_ranges ? 1 : 3;
+        if (rule->number_of_choices > 0) {
+            set_unsigned_number_substitution(out, "field-offset", word * field);
+            if (definitions) {
+                output_line(out, "enum parsed_type parsed_%%rule_type(struct owl_ref ref) {");
+                output_line(out, "    if (ref.empty || ref._type != %%rule-index)");
+                output_line(out, "        return (enum parsed_type)0;");
+                output_line(out, "    size_t offset = ref._offset + %%field-offset;");
+                output_line(out, "    return (enum parsed_type)read_tree(&offset, %%ref-tree);");
+                output_line(out, "}");
+            } else
+                output_line(out, "enum parsed_type parsed_%%rule_type(struct owl_ref);");
+            field++;
+        }
+        for (uint32_t j = 0; j < rule->number_of_slots; ++j, ++field) {
+            struct slot slot = rule->slots[j];
+            set_substitution(out, "referenced-slot", slot.name,
+             slot.name_length, LOWERCASE_WITH_UNDERSCORES);
+            set_unsigned_number_substitution(out, "referenced-slot-type",
+             slot.rule_index);
+            set_unsigned_number_substitution(out, "field-offset", word * field);
+            if (!definitions) {
+                output_line(out, "struct owl_ref parsed_%%rule_field_%%referenced-slot(struct owl_ref);");
+                continue;
+            }
+            output_line(out, "struct owl_ref parsed_%%rule_field_%%referenced-slot(struct owl_ref ref) {");
+            output_line(out, "    struct owl_ref result = {");
+            if (!gen->options.compact_refs)
+                output_line(out, "        ._tree = ref._tree,");
+            output_line(out, "        ._type = %%referenced-slot-type,");
+            output_line(out, "        .empty = true,");
+            output_line(out, "    };");
+            output_line(out, "    if (ref.empty || ref._type != %%rule-index)");
+            output_line(out, "        return result;");
+            if (rule_is_lazy(gen, i)) {
+                output_line(out, "    if (%%ref-tree->lazy_matches_left > 0)");
+                output_line(out, "        build_lazy_match_at(%%ref-tree, ref._offset);");
+            }
+            output_line(out, "    size_t offset = ref._offset + %%field-offset;");
+            output_line(out, "    result._offset = read_tree(&offset, %%ref-tree);");
+            output_line(out, "    result.empty = result._offset == 0;");
+            output_line(out, "    return result;");
+            output_line(out, "}");
+        }
+    }
+}
+
+static void generate_node_readers(struct generator *gen,
+ struct generator_output *out)
+{
+    uint32_t n = gen->grammar->number_of_rules;
+    output_line(out, "static bool has_choices_lookup(uint32_t rule) {");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < n; ++i) {
+        if (gen->grammar->rules[i].number_of_choices == 0)
+            continue;
+        set_unsigned_number_substitution(out, "rule-index", i);
+        output_line(out, "    case %%rule-index:");
+    }
+    output_line(out, "        return true;");
+    output_line(out, "    default:");
+    output_line(out, "        return false;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "// Reads the offsets of each slot of a node into `slots` (which has room for");
+    output_line(out, "// MAX_NUMBER_OF_SLOTS entries) and returns the number of slots.");
+    output_line(out, "static uint32_t read_node_slots(struct owl_tree *tree, size_t offset, uint32_t rule, size_t *slots) {");
+    output_line(out, "    uint32_t number_of_slots = (uint32_t)number_of_slots_lookup(rule, 0);");
+    output_line(out, "    if (number_of_slots == 0)");
+    output_line(out, "        return 0;");
+    output_line(out, "    read_tree(&offset, tree);");
+    if (!gen->options.omit_ranges) {
+        output_line(out, "    read_tree(&offset, tree);");
+        output_line(out, "    read_tree(&offset, tree);");
+    }
+    output_line(out, "    if (has_choices_lookup(rule))");
+    output_line(out, "        read_tree(&offset, tree);");
+    output_line(out, "    for (uint32_t i = 0; i < number_of_slots; ++i)");
+    output_line(out, "        slots[i] = read_tree(&offset, tree);");
+    output_line(out, "    return number_of_slots;");
+    output_line(out, "}");
+    if (gen->options.tree_index || gen->options.tree_edit) {
+        output_line(out, "// Returns the offset of a node's next sibling, or zero if there isn't one.");
+        output_line(out, "static size_t next_sibling_offset(struct owl_tree *tree, size_t offset) {");
+        output_line(out, "    size_t o = offset;");
+        output_line(out, "    size_t delta = read_tree(&o, tree);");
+        output_line(out, "    if (delta == 0)");
+        output_line(out, "        return 0;");
+        output_line(out, "    return tree->preorder ? offset + delta : offset - delta;");
+        output_line(out, "}");
+    }
+}
+
+static void generate_tree_index(struct generator *gen,
+ struct generator_output *out)
+{
+    set_unsigned_number_substitution(out, "number-of-rules",
+     gen->grammar->number_of_rules);
+    output_line(out, "struct index_node {");
+    output_line(out, "    size_t offset;");
+    output_line(out, "    size_t parent_offset;");
+    output_line(out, "    uint32_t rule;");
+    output_line(out, "    uint32_t parent_rule;");
+    output_line(out, "};");
+    output_line(out, "struct tree_index {");
+    output_line(out, "    // Every node in the tree, sorted by offset.");
+    output_line(out, "    struct index_node *nodes;");
+    output_line(out, "    size_t number_of_nodes;");
+    output_line(out, "    // The offsets of the nodes for each rule, sorted.  Rule r's nodes are");
+    output_line(out, "    // rule_offsets[rule_starts[r]] up to rule_offsets[rule_starts[r + 1]].");
+    output_line(out, "    size_t *rule_offsets;");
+    output_line(out, "    size_t rule_starts[%%number-of-rules + 1];");
+    output_line(out, "};");
+    output_line(out, "static void destroy_tree_index(struct owl_tree *tree) {");
+    output_line(out, "    if (!tree->index)");
+    output_line(out, "        return;");
+    output_line(out, "    free(tree->index->nodes);");
+    output_line(out, "    free(tree->index->rule_offsets);");
+    output_line(out, "    free(tree->index);");
+    output_line(out, "    tree->index = 0;");
+    output_line(out, "}");
+    output_line(out, "static int compare_index_nodes(const void *aa, const void *bb) {");
+    output_line(out, "    const struct index_node *a = aa;");
+    output_line(out, "    const struct index_node *b = bb;");
+    output_line(out, "    if (a->offset < b->offset)");
+    output_line(out, "        return -1;");
+    output_line(out, "    return a->offset > b->offset;");
+    output_line(out, "}");
+    output_line(out, "void owl_tree_build_index(struct owl_tree *tree) {");
+    output_line(out, "    check_for_error(tree);");
+    output_line(out, "    if (tree->index)");
+    output_line(out, "        return;");
+    if (gen->grammar->number_of_lazy_rules > 0)
+        output_line(out, "    build_lazy_matches(tree);");
+    output_line(out, "    struct tree_index *index = calloc(1, sizeof(struct tree_index));");
+    output_line(out, "    if (!index)");
+    output_line(out, "        abort();");
+    output_line(out, "    size_t nodes_capacity = 64;");
+    output_line(out, "    index->nodes = malloc(nodes_capacity * sizeof(struct index_node));");
+    output_line(out, "    // Each entry on the stack is the first node in a list of siblings.");
+    output_line(out, "    size_t stack_capacity = 16;");
+    output_line(out, "    size_t top = 0;");
+    output_line(out, "    struct index_node *stack = malloc(stack_capacity * sizeof(struct index_node));");
+    output_line(out, "    if (!index->nodes || !stack)");
+    output_line(out, "        abort();");
+    output_line(out, "    if (tree->root_offset != 0)");
+    output_line(out, "        stack[top++] = (struct index_node){ .offset = tree->root_offset, .rule = %%tree-root-rule };");
+    output_line(out, "    while (top > 0) {");
+    output_line(out, "        struct index_node list = stack[--top];");
+    output_line(out, "        for (size_t offset = list.offset; offset != 0;");
+    output_line(out, "         offset = next_sibling_offset(tree, offset)) {");
+    output_line(out, "            if (index->number_of_nodes >= nodes_capacity) {");
+    output_line(out, "                nodes_capacity *= 2;");
+    output_line(out, "                struct index_node *nodes = realloc(index->nodes, nodes_capacity * sizeof(struct index_node));");
+    output_line(out, "                if (!nodes)");
+    output_line(out, "                    abort();");
+    output_line(out, "                index->nodes = nodes;");
+    output_line(out, "            }");
+    output_line(out, "            struct index_node node = list;");
+    output_line(out, "            node.offset = offset;");
+    output_line(out, "            index->nodes[index->number_of_nodes++] = node;");
+    output_line(out, "            index->rule_starts[node.rule + 1]++;");
+    output_line(out, "            size_t slots[MAX_NUMBER_OF_SLOTS];");
+    output_line(out, "            uint32_t number_of_slots = read_node_slots(tree, offset, node.rule, slots);");
+    output_line(out, "            if (top + number_of_slots > stack_capacity) {");
+    output_line(out, "                stack_capacity = (stack_capacity + number_of_slots) * 2;");
+    output_line(out, "                struct index_node *new_stack = realloc(stack, stack_capacity * sizeof(struct index_node));");
+    output_line(out, "                if (!new_stack)");
+    output_line(out, "                    abort();");
+    output_line(out, "                stack = new_stack;");
+    output_line(out, "            }");
+    output_line(out, "            for (uint32_t i = 0; i < number_of_slots; ++i) {");
+    output_line(out, "                if (slots[i] == 0)");
+    output_line(out, "                    continue;");
+    output_line(out, "                stack[top++] = (struct index_node){");
+    output_line(out, "                    .offset = slots[i],");
+    output_line(out, "                    .parent_offset = offset,");
+    output_line(out, "                    .rule = rule_lookup(node.rule, i, 0),");
+    output_line(out, "                    .parent_rule = node.rule,");
+    output_line(out, "                };");
+    output_line(out, "            }");
+    output_line(out, "            // Only the root has no siblings to follow.");
+    output_line(out, "            if (list.parent_offset == 0)");
+    output_line(out, "                break;");
+    output_line(out, "        }");
+    output_line(out, "    }");
+    output_line(out, "    free(stack);");
+    output_line(out, "    qsort(index->nodes, index->number_of_nodes, sizeof(struct index_node), compare_index_nodes);");
+    output_line(out, "    for (uint32_t i = 0; i < %%number-of-rules; ++i)");
+    output_line(out, "        index->rule_starts[i + 1] += index->rule_starts[i];");
+    output_line(out, "    index->rule_offsets = malloc((index->number_of_nodes + 1) * sizeof(size_t));");
+    output_line(out, "    if (!index->rule_offsets)");
+    output_line(out, "        abort();");
+    output_line(out, "    size_t next[%%number-of-rules];");
+    output_line(out, "    memcpy(next, index->rule_starts, sizeof(next));");
+    output_line(out, "    for (size_t i = 0; i < index->number_of_nodes; ++i)");
+    output_line(out, "        index->rule_offsets[next[index->nodes[i].rule]++] = index->nodes[i].offset;");
+    output_line(out, "    tree->index = index;");
+    output_line(out, "}");
+    output_line(out, "struct owl_ref owl_parent(struct owl_ref ref) {");
+    output_line(out, "    struct owl_ref parent = ref;");
+    output_line(out, "    parent.empty = true;");
+    output_line(out, "    if (ref.empty)");
+    output_line(out, "        return parent;");
+    output_line(out, "    owl_tree_build_index(%%ref-tree);");
+    output_line(out, "    struct tree_index *index = %%ref-tree->index;");
+    output_line(out, "    size_t low = 0;");
+    output_line(out, "    size_t high = index->number_of_nodes;");
+    output_line(out, "    while (low < high) {");
+    output_line(out, "        size_t mid = low + (high - low) / 2;");
+    output_line(out, "        if (index->nodes[mid].offset < ref._offset)");
+    output_line(out, "            low = mid + 1;");
+    output_line(out, "        else");
+    output_line(out, "            high = mid;");
+    output_line(out, "    }");
+    output_line(out, "    if (low == index->number_of_nodes || index->nodes[low].offset != ref._offset ||");
+    output_line(out, "     index->nodes[low].parent_offset == 0)");
+    output_line(out, "        return parent;");
+    output_line(out, "    parent._offset = index->nodes[low].parent_offset;");
+    output_line(out, "    parent._type = index->nodes[low].parent_rule;");
+    output_line(out, "    parent.empty = false;");
+    output_line(out, "    return parent;");
+    output_line(out, "}");
+    output_line(out, "size_t owl_rule_count(struct owl_tree *tree, enum owl_rule rule) {");
+    output_line(out, "    owl_tree_build_index(tree);");
+    output_line(out, "    if ((uint32_t)rule >= %%number-of-rules)");
+    output_line(out, "        return 0;");
+    output_line(out, "    return tree->index->rule_starts[rule + 1] - tree->index->rule_starts[rule];");
+    output_line(out, "}");
+    output_line(out, "struct owl_ref owl_rule_nth(struct owl_tree *tree, enum owl_rule rule, size_t i) {");
+    output_line(out, "    size_t count = owl_rule_count(tree, rule);");
+    if (gen->options.compact_refs)
+        output_line(out, "    owl_current_tree = tree;");
+    output_line(out, "    return (struct owl_ref){");
+    if (!gen->options.compact_refs)
+        output_line(out, "        ._tree = tree,");
+    output_line(out, "        ._offset = i < count ? tree->index->rule_offsets[tree->index->rule_starts[rule] + i] : 0,");
+    output_line(out, "        ._type = rule,");
+    output_line(out, "        .empty = i >= count,");
+    output_line(out, "    };");
+    output_line(out, "}");
+}
+
+static void generate_tree_storage(struct generator *gen,
+ struct generator_output *out)
+{
+    output_line(out, "static void free_tree_storage(struct owl_tree *tree) {");
+    if (gen->options.tree_save) {
+        output_line(out, "#ifdef OWL_TREE_SAVE_AND_LOAD");
+        output_line(out, "    if (tree->mapping) {");
+        output_line(out, "        munmap(tree->mapping, tree->mapping_size);");
+        if (gen->options.segmented_tree)
+            output_line(out, "        free(tree->segments);");
+        output_line(out, "        return;");
+        output_line(out, "    }");
+        output_line(out, "#endif");
+    }
+    if (gen->options.segmented_tree) {
+        output_line(out, "    for (size_t i = 0; i < tree->number_of_segments; ++i) {");
+        output_line(out, "        if (tree->segments[i].owns_bytes)");
+        output_line(out, "            free(tree->segments[i].bytes);");
+        output_line(out, "    }");
+        output_line(out, "    free(tree->segments);");
+    } else
+        output_line(out, "    free(tree->parse_tree);");
+    output_line(out, "}");
+    if (!needs_tree_copier(gen) && gen->grammar->number_of_lazy_rules == 0)
+        return;
+    // Padded entries have a fixed width, so they can be patched once the
+    // offsets they refer to are known.
+    output_line(out, "static void patch_tree(struct owl_tree *tree, size_t offset, uint64_t value, size_t width) {");
+    if (gen->options.segmented_tree)
+        output_line(out, "    uint8_t *bytes = tree_bytes(tree, offset);");
+    else
+        output_line(out, "    uint8_t *bytes = tree->parse_tree + offset;");
+    if (gen->options.fixed_layout) {
+        output_line(out, "    (void)width;");
+        output_line(out, "    memcpy(bytes, &value, sizeof(value));");
+    } else {
+        output_line(out, "    for (size_t j = 0; j + 1 < width; ++j) {");
+        output_line(out, "        bytes[j] = 0x80 | (value & 0x7f);");
+        output_line(out, "        value >>= 7;");
+        output_line(out, "    }");
+        output_line(out, "    bytes[width - 1] = value & 0x7f;");
+    }
+    output_line(out, "}");
+    output_line(out, "static void write_tree_padded(struct owl_tree *tree, uint64_t value, size_t width) {");
+    output_line(out, "    patch_tree(tree, tree->next_offset, value, width);");
+    output_line(out, "    tree->next_offset += width;");
+    output_line(out, "}");
+}
+
+// Compacting and extracting copy trees in document order, and so do edits
+// which copy a replacement from another tree.  (Compacting does nothing with
+// shared subtrees.)
+static bool needs_tree_copier(struct generator *gen)
+{
+    return (gen->options.tree_compact && !gen->options.share_subtrees) ||
+     gen->options.tree_extract || gen->options.tree_edit;
+}
+
+// These functions build every lazy match before reading the tree.
+static bool reads_whole_tree(struct generator *gen)
+{
+    return gen->options.tree_index || gen->options.tree_save ||
+     needs_tree_copier(gen);
+}
+
+static void generate_tree_copier(struct generator *gen,
+ struct generator_output *out)
+{
+    output_line(out, "static size_t copy_string_contents(struct owl_tree *dest, struct owl_tree *source, size_t offset, size_t length) {");
+    output_line(out, "    void *p = allocate_string_contents(length, dest);");
+    if (gen->options.segmented_tree) {
+        output_line(out, "    memcpy(p, tree_bytes(source, offset), length);");
+        output_line(out, "    return dest->string_contents_offset;");
+    } else {
+        output_line(out, "    memcpy(p, source->parse_tree + offset, length);");
+        output_line(out, "    return (uint8_t *)p - dest->parse_tree;");
+    }
+    output_line(out, "}");
+    output_line(out, "struct copy_tree_frame {");
+    output_line(out, "    // The node's offset in the source tree.");
+    output_line(out, "    size_t offset;");
+    output_line(out, "    uint32_t rule;");
+    output_line(out, "    // Where to store the node's new offset: either one of its parent's slot");
+    output_line(out, "    // entries or its previous sibling's 'next offset' entry.  Zero for the root.");
+    output_line(out, "    size_t patch_offset;");
+    output_line(out, "    bool is_next_link;");
+    output_line(out, "};");
+    output_line(out, "struct copy_tree_text {");
+    output_line(out, "    // Subtracted from each offset into the text as it's copied.");
+    output_line(out, "    size_t base;");
+    output_line(out, "    // Set to the range of text covered by the copied matches (before");
+    output_line(out, "    // subtracting the base).");
+    output_line(out, "    size_t start;");
+    output_line(out, "    size_t end;");
+    if (gen->options.intern_identifiers) {
+        output_line(out, "    // Interns each identifier again in dest, rather than keeping its id.");
+        output_line(out, "    bool intern;");
+    }
+    output_line(out, "};");
+    output_line(out, "static void copy_tree_text_range(struct copy_tree_text *text, size_t start, size_t length) {");
+    output_line(out, "    if (start < text->start)");
+    output_line(out, "        text->start = start;");
+    output_line(out, "    if (start + length > text->end)");
+    output_line(out, "        text->end = start + length;");
+    output_line(out, "}");
+    output_line(out, "// Copies the tree rooted at root_offset from source to the end of dest in");
+    output_line(out, "// document order, with each node followed by its children and forward links");
+    output_line(out, "// between siblings.  Siblings of the root itself aren't copied.  Links are");
+    output_line(out, "// written with a fixed width so they can be patched later.");
+    output_line(out, "static size_t copy_tree_preorder(struct owl_tree *dest, struct owl_tree *source, size_t root_offset, uint32_t root_rule, size_t width, struct copy_tree_text *text) {");
+    output_line(out, "    size_t capacity = 16;");
+    output_line(out, "    size_t top = 0;");
+    output_line(out, "    struct copy_tree_frame *stack = malloc(capacity * sizeof(struct copy_tree_frame));");
+    output_line(out, "    if (!stack)");
+    output_line(out, "        abort();");
+    output_line(out, "    stack[top++] = (struct copy_tree_frame){ .offset = root_offset, .rule = root_rule };");
+    output_line(out, "    size_t new_root_offset = 0;");
+    output_line(out, "    text->start = SIZE_MAX;");
+    output_line(out, "    text->end = 0;");
+    output_line(out, "    while (top > 0) {");
+    output_line(out, "        struct copy_tree_frame frame = stack[--top];");
+    output_line(out, "        if (top + MAX_NUMBER_OF_SLOTS + 1 > capacity) {");
+    output_line(out, "            capacity = (capacity + MAX_NUMBER_OF_SLOTS + 1) * 2;");
+    output_line(out, "            struct copy_tree_frame *new_stack = realloc(stack, capacity * sizeof(struct copy_tree_frame));");
+    output_line(out, "            if (!new_stack)");
+    output_line(out, "                abort();");
+    output_line(out, "            stack = new_stack;");
+    output_line(out, "        }");
+    output_line(out, "        size_t offset = frame.offset;");
+    output_line(out, "        size_t delta = read_tree(&offset, source);");
+    output_line(out, "        // The next sibling is copied after this node's children, so push it first.");
+    output_line(out, "        size_t sibling_index = top;");
+    output_line(out, "        bool has_next_sibling = delta != 0 && frame.patch_offset != 0;");
+    output_line(out, "        if (has_next_sibling) {");
+    output_line(out, "            stack[top++] = (struct copy_tree_frame){");
+    output_line(out, "                .offset = source->preorder ? frame.offset + delta : frame.offset - delta,");
+    output_line(out, "                .rule = frame.rule,");
+    output_line(out, "                .is_next_link = true,");
+    output_line(out, "            };");
+    output_line(out, "        }");
+    output_line(out, "        size_t node = 0;");
+    output_line(out, "        switch (frame.rule) {");
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        if (rule->is_token && !rule_is_named(rule, "identifier") &&
+         !rule_is_named(rule, "number") && !rule_is_named(rule, "string"))
+            continue;
+        set_unsigned_number_substitution(out, "rule-index", i);
+        output_line(out, "        case %%rule-index: {");
+        if (rule->is_token) {
+            // Token data is stored right after the node that refers to it.
+            output_line(out, "            size_t token_offset = read_tree(&offset, source);");
+            output_line(out, "            read_tree(&token_offset, source);");
+            output_line(out, "            size_t start_location = read_tree(&token_offset, source);");
+            output_line(out, "            size_t length = read_tree(&token_offset, source);");
+            output_line(out, "            copy_tree_text_range(text, start_location, length);");
+            if (rule_is_named(rule, "number"))
+                output_line(out, "            uint64_t number = read_tree(&token_offset, source);");
+            else if (rule_is_named(rule, "identifier") &&
+             gen->options.intern_identifiers) {
+                output_line(out, "            uint64_t id = read_tree(&token_offset, source);");
+                output_line(out, "            if (text->intern)");
+                output_line(out, "                id = intern_identifier(dest, start_location - text->base, length);");
+            } else if (rule_is_named(rule, "string")) {
+                output_line(out, "            size_t string_offset = read_tree(&token_offset, source);");
+                output_line(out, "            size_t string_length = 0;");
+                output_line(out, "            if (string_offset) {");
+                output_line(out, "                string_length = read_tree(&token_offset, source);");
+                output_line(out, "                string_offset = copy_string_contents(dest, source, string_offset, string_length);");
+                output_line(out, "            }");
+            }
+            output_line(out, "            reserve_tree(dest, 7 * RESERVATION_AMOUNT);");
+            output_line(out, "            node = dest->next_offset;");
+            output_line(out, "            write_tree_padded(dest, 0, width);");
+            output_line(out, "            write_tree_padded(dest, node + 2 * width, width);");
+            output_line(out, "            write_tree(dest, 0);");
+            output_line(out, "            write_tree(dest, start_location - text->base);");
+            output_line(out, "            write_tree(dest, length);");
+            if (rule_is_named(rule, "number"))
+                output_line(out, "            write_tree(dest, number);");
+            else if (rule_is_named(rule, "identifier") &&
+             gen->options.intern_identifiers)
+                output_line(out, "            write_tree(dest, id);");
+            else if (rule_is_named(rule, "string")) {
+                output_line(out, "            write_tree(dest, string_offset);");
+                output_line(out, "            if (string_offset)");
+                output_line(out, "                write_tree(dest, string_length);");
+            }
+            output_line(out, "            break;");
+            output_line(out, "        }");
+            continue;
+        }
+        uint32_t entries = 1 + (gen->options.omit_ranges ? 0 : 2) +
+         (rule->number_of_choices > 0 ? 1 : 0) + rule->number_of_slots +
+         (gen->options.subtree_hashes ? 1 : 0);
+        set_unsigned_number_substitution(out, "entries", entries);
+        output_line(out, "            reserve_tree(dest, %%entries * RESERVATION_AMOUNT);");
+        output_line(out, "            node = dest->next_offset;");
+        output_line(out, "            write_tree_padded(dest, 0, width);");
+        if (!gen->options.omit_ranges) {
+            output_line(out, "            size_t start_location = read_tree(&offset, source);");
+            output_line(out, "            size_t length = read_tree(&offset, source);");
+            output_line(out, "            copy_tree_text_range(text, start_location, length);");
+            output_line(out, "            write_tree(dest, start_location - text->base);");
+            output_line(out, "            write_tree(dest, length);");
+        }
+        if (rule->number_of_choices > 0)
+            output_line(out, "            write_tree(dest, read_tree(&offset, source));");
+        if (rule->number_of_slots == 0) {
+            if (gen->options.subtree_hashes)
+                output_line(out, "            write_tree(dest, read_tree(&offset, source));");
+            output_line(out, "            break;");
+            output_line(out, "        }");
+            continue;
+        }
+        set_unsigned_number_substitution(out, "number-of-slots",
+         rule->number_of_slots);
+        output_line(out, "            size_t slots[%%number-of-slots];");
+        output_line(out, "            size_t slot_entries[%%number-of-slots];");
+        output_line(out, "            for (int i = 0; i < %%number-of-slots; ++i) {");
+        output_line(out, "                slots[i] = read_tree(&offset, source);");
+        output_line(out, "                slot_entries[i] = dest->next_offset;");
+        output_line(out, "                write_tree_padded(dest, 0, width);");
+        output_line(out, "            }");
+        if (gen->options.subtree_hashes)
+            output_line(out, "            write_tree(dest, read_tree(&offset, source));");
+        for (uint32_t j = rule->number_of_slots; j > 0; --j) {
+            set_unsigned_number_substitution(out, "slot-index", j - 1);
+            set_unsigned_number_substitution(out, "slot-rule-index",
+             rule->slots[j - 1].rule_index);
+            output_line(out, "            if (slots[%%slot-index]) {");
+            output_line(out, "                stack[top++] = (struct copy_tree_frame){");
+            output_line(out, "                    .offset = slots[%%slot-index],");
+            output_line(out, "                    .rule = %%slot-rule-index,");
+            output_line(out, "                    .patch_offset = slot_entries[%%slot-index],");
+            output_line(out, "                };");
+            output_line(out, "            }");
+        }
+        output_line(out, "            break;");
+        output_line(out, "        }");
+    }
+    output_line(out, "        default:");
+    output_line(out, "            abort();");
+    output_line(out, "        }");
+    output_line(out, "        if (has_next_sibling)");
+    output_line(out, "            stack[sibling_index].patch_offset = node;");
+    output_line(out, "        if (frame.patch_offset == 0)");
+    output_line(out, "            new_root_offset = node;");
+    output_line(out, "        else if (frame.is_next_link)");
+    output_line(out, "            patch_tree(dest, frame.patch_offset, node - frame.patch_offset, width);");
+    output_line(out, "        else");
+    output_line(out, "            patch_tree(dest, frame.patch_offset, node, width);");
+    output_line(out, "    }");
+    output_line(out, "    free(stack);");
+    output_line(out, "    if (text->start > text->end)");
+    output_line(out, "        text->start = text->end;");
+    output_line(out, "    return new_root_offset;");
+    output_line(out, "}");
+    // Edits copy at full width, so only compacting and extracting pick a
+    // width.
+    if ((!gen->options.tree_compact || gen->options.share_subtrees) &&
+     !gen->options.tree_extract)
+        return;
+    output_line(out, "// Returns the width to use for links when copying from source.");
+    if (gen->options.compact_refs) {
+        output_line(out, "// Returns zero if the copy of the whole tree might not fit in 32-bit");
+        output_line(out, "// offsets.");
+    }
+    output_line(out, "static size_t copy_tree_width(struct owl_tree *source) {");
+    if (gen->options.share_subtrees) {
+        // A shared subtree is copied once for each of its parents, so the
+        // copy isn't bounded by the size of the source.
+        output_line(out, "    (void)source;");
+        output_line(out, "    return RESERVATION_AMOUNT;");
+        output_line(out, "}");
+    } else {
+        if (!gen->options.fixed_layout || gen->options.compact_refs) {
+            output_line(out, "    // The new tree has no more entries or string bytes than the old tree has");
+            output_line(out, "    // bytes, and no entry is larger than RESERVATION_AMOUNT, so this bounds");
+            output_line(out, "    // every offset in the new tree.");
+            output_line(out, "    size_t bound = source->next_offset * RESERVATION_AMOUNT;");
+            if (gen->options.segmented_tree) {
+                output_line(out, "    // Skipping to a new segment wastes less than the record that didn't fit.");
+                output_line(out, "    bound = bound * 2 + SEGMENT_SIZE;");
+            }
+        } else
+            output_line(out, "    (void)source;");
+        if (gen->options.compact_refs) {
+            output_line(out, "    if (bound > UINT32_MAX)");
+            output_line(out, "        return 0;");
+        }
+        if (gen->options.fixed_layout)
+            output_line(out, "    return RESERVATION_AMOUNT;");
+        else {
+            output_line(out, "    size_t width = 1;");
+            output_line(out, "    while (width < RESERVATION_AMOUNT && (bound >> (7 * width)) != 0)");
+            output_line(out, "        width++;");
+            output_line(out, "    return width;");
+        }
+        output_line(out, "}");
+    }
+}
+
+static void generate_tree_compact(struct generator *gen,
+ struct generator_output *out)
+{
+    if (gen->options.tree_edit)
+        output_line(out, "static void destroy_edit_links(struct owl_tree *tree);");
+    output_line(out, "void owl_tree_compact(struct owl_tree *tree) {");
+    if (gen->options.share_subtrees) {
+        // Copying a shared subtree once for each of its parents would undo
+        // the sharing.
+        output_line(out, "    (void)tree;");
+        output_line(out, "}");
+        return;
+    }
+    if (gen->options.tree_edit) {
+        output_line(out, "    if (tree->error != ERROR_NONE || tree->root_offset == 0 ||");
+        output_line(out, "     (tree->preorder && !tree->edited))");
+    } else
+        output_line(out, "    if (tree->error != ERROR_NONE || tree->root_offset == 0 || tree->preorder)");
+    output_line(out, "        return;");
+    if (gen->grammar->number_of_lazy_rules > 0)
+        output_line(out, "    build_lazy_matches(tree);");
+    output_line(out, "    size_t width = copy_tree_width(tree);");
+    if (gen->options.compact_refs) {
+        output_line(out, "    if (width == 0)");
+        output_line(out, "        return;");
+    }
+    if (gen->options.tree_index)
+        output_line(out, "    destroy_tree_index(tree);");
+    output_line(out, "    struct owl_tree source = *tree;");
+    if (gen->options.tree_save)
+        output_line(out, "    tree->mapping = 0;");
+    if (gen->options.segmented_tree) {
+        output_line(out, "    tree->segments = 0;");
+        output_line(out, "    tree->number_of_segments = 0;");
+        output_line(out, "    tree->segments_capacity = 0;");
+    } else {
+        output_line(out, "    tree->parse_tree = 0;");
+        output_line(out, "    tree->parse_tree_size = 0;");
+    }
+    output_line(out, "    tree->next_offset = %%first-tree-offset;");
+    output_line(out, "    struct copy_tree_text text = {0};");
+    output_line(out, "    tree->root_offset = copy_tree_preorder(tree, &source, source.root_offset, %%tree-root-rule, width, &text);");
+    output_line(out, "    tree->preorder = true;");
+    if (gen->options.tree_edit) {
+        output_line(out, "    tree->edited = false;");
+        output_line(out, "    tree->generation++;");
+        output_line(out, "    destroy_edit_links(tree);");
+    }
+    output_line(out, "    free_tree_storage(&source);");
+    output_line(out, "}");
+}
+
+static void generate_tree_extract(struct generator *gen,
+ struct generator_output *out)
+{
+    // The first copy keeps offsets into the source's text.  If the text is
+    // copied, only the range covered by the subtree is kept, so the tree is
+    // copied again with its offsets rebased.
+    output_line(out, "struct owl_tree *owl_tree_extract(struct owl_ref ref, bool copy_text) {");
+    output_line(out, "    struct owl_tree *tree = owl_tree_create_empty();");
+    output_line(out, "    if (!tree)");
+    output_line(out, "        abort();");
+    output_line(out, "    tree->string = \"\";");
+    output_line(out, "    tree->root_rule = ref._type;");
+    output_line(out, "    tree->preorder = true;");
+    output_line(out, "    size_t width = 0;");
+    output_line(out, "    struct copy_tree_text text = {0};");
+    if (gen->options.intern_identifiers)
+        output_line(out, "    text.intern = true;");
+    output_line(out, "    if (!ref.empty) {");
+    output_line(out, "        struct owl_tree *source = %%ref-tree;");
+    if (gen->grammar->number_of_lazy_rules > 0)
+        output_line(out, "        build_lazy_matches(source);");
+    output_line(out, "        width = copy_tree_width(source);");
+    if (gen->options.compact_refs) {
+        output_line(out, "        if (width == 0)");
+        output_line(out, "            width = RESERVATION_AMOUNT;");
+    }
+    output_line(out, "        tree->string = source->string;");
+    output_line(out, "        tree->next_offset = %%first-tree-offset;");
+    output_line(out, "        tree->root_offset = copy_tree_preorder(tree, source, ref._offset, ref._type, width, &text);");
+    if (gen->options.compact_refs) {
+        output_line(out, "        if (tree->next_offset > UINT32_MAX) {");
+        output_line(out, "            owl_tree_destroy(tree);");
+        output_line(out, "            return owl_tree_create_with_error(ERROR_INPUT_TOO_LARGE);");
+        output_line(out, "        }");
+    }
+    output_line(out, "    }");
+    output_line(out, "    if (!copy_text)");
+    output_line(out, "        return tree;");
+    output_line(out, "    size_t length = text.end - text.start;");
+    output_line(out, "    char *string = malloc(length + 1);");
+    output_line(out, "    if (!string)");
+    output_line(out, "        abort();");
+    output_line(out, "    memcpy(string, tree->string + text.start, length);");
+    output_line(out, "    string[length] = '\\0';");
+    output_line(out, "    if (text.start > 0) {");
+    output_line(out, "        struct owl_tree *rebased = owl_tree_create_empty();");
+    output_line(out, "        if (!rebased)");
+    output_line(out, "            abort();");
+    output_line(out, "        rebased->string = string;");
+    output_line(out, "        rebased->root_rule = ref._type;");
+    output_line(out, "        rebased->preorder = true;");
+    output_line(out, "        rebased->next_offset = %%first-tree-offset;");
+    output_line(out, "        text.base = text.start;");
+    output_line(out, "        rebased->root_offset = copy_tree_preorder(rebased, tree, tree->root_offset, ref._type, width, &text);");
+    output_line(out, "        owl_tree_destroy(tree);");
+    output_line(out, "        tree = rebased;");
+    output_line(out, "    }");
+    output_line(out, "    tree->string = string;");
+    output_line(out, "    tree->owns_string = true;");
+    output_line(out, "    return tree;");
+    output_line(out, "}");
+}
+
+static void generate_tree_editing(struct generator *gen,
+ struct generator_output *out)
+{
+    output_line(out, "// Writes a copy of the node at `offset` to the end of the tree, with a padded");
+    output_line(out, "// next sibling link to be patched later.  If the node has a slot `slot`, the");
+    output_line(out, "// copy's slot refers to `value` instead.");
+    output_line(out, "static size_t copy_edited_node(struct owl_tree *tree, size_t offset, uint32_t rule, uint32_t slot, size_t value) {");
+    output_line(out, "    read_tree(&offset, tree);");
+    output_line(out, "    size_t node = 0;");
+    output_line(out, "    switch (rule) {");
+    bool has_tokens = false;
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
+        if (!gen->grammar->rules[i].is_token)
+            continue;
+        set_unsigned_number_substitution(out, "rule-index", i);
+        output_line(out, "    case %%rule-index:");
+        has_tokens = true;
+    }
+    if (has_tokens) {
+        // The copy shares the token's data.
+        output_line(out, "        reserve_tree(tree, 2 * RESERVATION_AMOUNT);");
+        output_line(out, "        node = tree->next_offset;");
+        output_line(out, "        write_tree_padded(tree, 0, RESERVATION_AMOUNT);");
+        output_line(out, "        write_tree(tree, read_tree(&offset, tree));");
+        output_line(out, "        break;");
+    }
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        if (rule->is_token)
+            continue;
+        set_unsigned_number_substitution(out, "rule-index", i);
+        uint32_t entries = 1 + (gen->options.omit_ranges ? 0 : 2) +
+         (rule->number_of_choices > 0 ? 1 : 0) + rule->number_of_slots +
+         (gen->options.subtree_hashes ? 1 : 0);
+        set_unsigned_number_substitution(out, "entries", entries);
+        output_line(out, "    case %%rule-index: {");
+        output_line(out, "        reserve_tree(tree, %%entries * RESERVATION_AMOUNT);");
+        output_line(out, "        node = tree->next_offset;");
+        output_line(out, "        write_tree_padded(tree, 0, RESERVATION_AMOUNT);");
+        if (!gen->options.omit_ranges) {
+            output_line(out, "        write_tree(tree, read_tree(&offset, tree));");
+            output_line(out, "        write_tree(tree, read_tree(&offset, tree));");
+        }
+        if (gen->options.subtree_hashes)
+            output_line(out, "        uint64_t type = 0;");
+        if (rule->number_of_choices > 0) {
+            if (gen->options.subtree_hashes) {
+                output_line(out, "        type = read_tree(&offset, tree);");
+                output_line(out, "        write_tree(tree, type);");
+            } else
+                output_line(out, "        write_tree(tree, read_tree(&offset, tree));");
+        }
+        if (rule->number_of_slots == 0) {
+            output_line(out, "        (void)slot;");
+            output_line(out, "        (void)value;");
+            if (gen->options.subtree_hashes) {
+                output_line(out, "        (void)type;");
+                output_line(out, "        write_tree(tree, read_tree(&offset, tree));");
+            }
+            output_line(out, "        break;");
+            output_line(out, "    }");
+            continue;
+        }
+        set_unsigned_number_substitution(out, "number-of-slots",
+         rule->number_of_slots);
+        output_line(out, "        size_t slots[%%number-of-slots];");
+        output_line(out, "        for (uint32_t i = 0; i < %%number-of-slots; ++i) {");
+        output_line(out, "            slots[i] = read_tree(&offset, tree);");
+        output_line(out, "            if (i == slot)");
+        output_line(out, "                slots[i] = value;");
+        output_line(out, "            write_tree(tree, slots[i]);");
+        output_line(out, "        }");
+        if (gen->options.subtree_hashes) {
+            output_line(out, "        if (slot < %%number-of-slots)");
+            output_line(out, "            write_tree(tree, hash_node(tree, rule, type, slots));");
+            output_line(out, "        else");
+            output_line(out, "            write_tree(tree, read_tree(&offset, tree));");
+        }
+        output_line(out, "        break;");
+        output_line(out, "    }");
+    }
+    output_line(out, "    default:");
+    output_line(out, "        abort();");
+    output_line(out, "    }");
+    output_line(out, "    return node;");
+    output_line(out, "}");
+    output_line(out, "// A list being copied during an edit.");
+    output_line(out, "struct edit_list {");
+    output_line(out, "    size_t first;");
+    output_line(out, "    size_t last;");
+    output_line(out, "    // The width of the last node's next sibling link.");
+    output_line(out, "    size_t last_width;");
+    output_line(out, "};");
+    output_line(out, "static void append_to_edit_list(struct owl_tree *tree, struct edit_list *list, size_t node, size_t width) {");
+    output_line(out, "    if (list->last)");
+    output_line(out, "        patch_tree(tree, list->last, node - list->last, list->last_width);");
+    output_line(out, "    else");
+    output_line(out, "        list->first = node;");
+    output_line(out, "    list->last = node;");
+    output_line(out, "    list->last_width = width;");
+    output_line(out, "}");
+    // Only replacements from other trees bring their own text, and compact refs
+    // can't refer to those.
+    if (!gen->options.compact_refs) {
+        output_line(out, "// Appends `text` to the tree's text, returning the offset it starts at.");
+        output_line(out, "static size_t append_edit_text(struct owl_tree *tree, const char *text) {");
+        output_line(out, "    size_t length = strlen(tree->string);");
+        output_line(out, "    size_t text_length = strlen(text);");
+        output_line(out, "    char *string = malloc(length + text_length + 1);");
+        output_line(out, "    if (!string)");
+        output_line(out, "        abort();");
+        output_line(out, "    memcpy(string, tree->string, length);");
+        output_line(out, "    memcpy(string + length, text, text_length + 1);");
+        output_line(out, "    if (tree->owns_string)");
+        output_line(out, "        free((void *)tree->string);");
+        output_line(out, "    tree->string = string;");
+        output_line(out, "    tree->owns_string = true;");
+        output_line(out, "    free(tree->line_starts);");
+        output_line(out, "    tree->line_starts = 0;");
+        output_line(out, "    tree->number_of_lines = 0;");
+        output_line(out, "    return length;");
+        output_line(out, "}");
+    }
+    output_line(out, "// A node in the current version and the node that leads to it: the node's");
+    output_line(out, "// previous sibling, or its parent if it's the first node in its list.");
+    output_line(out, "struct edit_link {");
+    output_line(out, "    size_t offset;");
+    output_line(out, "    size_t previous;");
+    output_line(out, "    uint32_t rule;");
+    output_line(out, "    // The parent's slot containing the node, or UINT32_MAX if `previous` is a");
+    output_line(out, "    // sibling.");
+    output_line(out, "    uint32_t slot;");
+    output_line(out, "};");
+    output_line(out, "struct edit_links {");
+    output_line(out, "    // Sorted by offset.  Nodes from earlier versions keep their links, which");
+    output_line(out, "    // lead back to an earlier root.");
+    output_line(out, "    struct edit_link *nodes;");
+    output_line(out, "    size_t number_of_nodes;");
+    output_line(out, "    size_t capacity;");
+    output_line(out, "};");
+    output_line(out, "static void destroy_edit_links(struct owl_tree *tree) {");
+    output_line(out, "    if (!tree->edit_links)");
+    output_line(out, "        return;");
+    output_line(out, "    free(tree->edit_links->nodes);");
+    output_line(out, "    free(tree->edit_links);");
+    output_line(out, "    tree->edit_links = 0;");
+    output_line(out, "}");
+    output_line(out, "static int compare_edit_links(const void *aa, const void *bb) {");
+    output_line(out, "    const struct edit_link *a = aa;");
+    output_line(out, "    const struct edit_link *b = bb;");
+    output_line(out, "    if (a->offset < b->offset)");
+    output_line(out, "        return -1;");
+    output_line(out, "    return a->offset > b->offset;");
+    output_line(out, "}");
+    output_line(out, "// Searches the first `count` links for the node at `offset`.");
+    output_line(out, "static struct edit_link *find_edit_link(struct edit_links *links, size_t count, size_t offset) {");
+    output_line(out, "    size_t low = 0;");
+    output_line(out, "    size_t high = count;");
+    output_line(out, "    while (low < high) {");
+    output_line(out, "        size_t mid = low + (high - low) / 2;");
+    output_line(out, "        if (links->nodes[mid].offset < offset)");
+    output_line(out, "            low = mid + 1;");
+    output_line(out, "        else");
+    output_line(out, "            high = mid;");
+    output_line(out, "    }");
+    output_line(out, "    if (low == count || links->nodes[low].offset != offset)");
+    output_line(out, "        return 0;");
+    output_line(out, "    return &links->nodes[low];");
+    output_line(out, "}");
+    output_line(out, "// Adds links for the current version's nodes at or after `start` (the nodes");
+    output_line(out, "// written by the last edit, or every node if `start` is zero).  The older");
+    output_line(out, "// nodes they lead to are relinked, and the walk stops there: everything past");
+    output_line(out, "// them is unchanged.");
+    output_line(out, "static void link_edited_nodes(struct owl_tree *tree, size_t start) {");
+    output_line(out, "    if (!tree->edit_links) {");
+    output_line(out, "        tree->edit_links = calloc(1, sizeof(struct edit_links));");
+    output_line(out, "        if (!tree->edit_links)");
+    output_line(out, "            abort();");
+    output_line(out, "    }");
+    output_line(out, "    struct edit_links *links = tree->edit_links;");
+    output_line(out, "    size_t old_count = links->number_of_nodes;");
+    output_line(out, "    // Each entry on the stack is the first node in a list.");
+    output_line(out, "    size_t stack_capacity = 16;");
+    output_line(out, "    size_t top = 0;");
+    output_line(out, "    struct edit_link *stack = malloc(stack_capacity * sizeof(struct edit_link));");
+    output_line(out, "    if (!stack)");
+    output_line(out, "        abort();");
+    output_line(out, "    if (tree->root_offset != 0) {");
+    output_line(out, "        stack[top++] = (struct edit_link){");
+    output_line(out, "            .offset = tree->root_offset,");
+    output_line(out, "            .rule = %%tree-root-rule,");
+    output_line(out, "            .slot = UINT32_MAX,");
+    output_line(out, "        };");
+    output_line(out, "    }");
+    output_line(out, "    while (top > 0) {");
+    output_line(out, "        struct edit_link node = stack[--top];");
+    output_line(out, "        while (node.offset != 0) {");
+    output_line(out, "            if (node.offset < start) {");
+    output_line(out, "                struct edit_link *old = find_edit_link(links, old_count, node.offset);");
+    output_line(out, "                if (old) {");
+    output_line(out, "                    old->previous = node.previous;");
+    output_line(out, "                    old->slot = node.slot;");
+    output_line(out, "                }");
+    output_line(out, "                break;");
+    output_line(out, "            }");
+    output_line(out, "            if (links->number_of_nodes >= links->capacity) {");
+    output_line(out, "                links->capacity = (links->capacity + 16) * 2;");
+    output_line(out, "                struct edit_link *nodes = realloc(links->nodes, links->capacity * sizeof(struct edit_link));");
+    output_line(out, "                if (!nodes)");
+    output_line(out, "                    abort();");
+    output_line(out, "                links->nodes = nodes;");
+    output_line(out, "            }");
+    output_line(out, "            links->nodes[links->number_of_nodes++] = node;");
+    output_line(out, "            size_t slots[MAX_NUMBER_OF_SLOTS];");
+    output_line(out, "            uint32_t number_of_slots = read_node_slots(tree, node.offset, node.rule, slots);");
+    output_line(out, "            if (top + number_of_slots > stack_capacity) {");
+    output_line(out, "                stack_capacity = (stack_capacity + number_of_slots) * 2;");
+    output_line(out, "                struct edit_link *new_stack = realloc(stack, stack_capacity * sizeof(struct edit_link));");
+    output_line(out, "                if (!new_stack)");
+    output_line(out, "                    abort();");
+    output_line(out, "                stack = new_stack;");
+    output_line(out, "            }");
+    output_line(out, "            for (uint32_t i = 0; i < number_of_slots; ++i) {");
+    output_line(out, "                if (slots[i] == 0)");
+    output_line(out, "                    continue;");
+    output_line(out, "                stack[top++] = (struct edit_link){");
+    output_line(out, "                    .offset = slots[i],");
+    output_line(out, "                    .previous = node.offset,");
+    output_line(out, "                    .rule = rule_lookup(node.rule, i, 0),");
+    output_line(out, "                    .slot = i,");
+    output_line(out, "                };");
+    output_line(out, "            }");
+    output_line(out, "            // Only the root has no siblings to follow.");
+    output_line(out, "            if (node.previous == 0)");
+    output_line(out, "                break;");
+    output_line(out, "            node = (struct edit_link){");
+    output_line(out, "                .offset = next_sibling_offset(tree, node.offset),");
+    output_line(out, "                .previous = node.offset,");
+    output_line(out, "                .rule = node.rule,");
+    output_line(out, "                .slot = UINT32_MAX,");
+    output_line(out, "            };");
+    output_line(out, "        }");
+    output_line(out, "    }");
+    output_line(out, "    free(stack);");
+    output_line(out, "    qsort(links->nodes + old_count, links->number_of_nodes - old_count, sizeof(struct edit_link), compare_edit_links);");
+    output_line(out, "}");
+    output_line(out, "struct edit_frame {");
+    output_line(out, "    // The first node in the list containing this node.");
+    output_line(out, "    size_t list;");
+    output_line(out, "    size_t offset;");
+    output_line(out, "    uint32_t rule;");
+    output_line(out, "    // The slot containing the next frame's list.");
+    output_line(out, "    uint32_t slot;");
+    output_line(out, "};");
+    output_line(out, "// Follows the links back from the node at `offset` to the root, leaving the");
+    output_line(out, "// path to it (starting at the root) in `*path`.  Returns the length of the");
+    output_line(out, "// path, or zero if the node isn't part of the current version.");
+    output_line(out, "static size_t find_edit_path(struct owl_tree *tree, size_t offset, uint32_t rule, struct edit_frame **path) {");
+    output_line(out, "    if (!tree->edit_links)");
+    output_line(out, "        link_edited_nodes(tree, 0);");
+    output_line(out, "    struct edit_links *links = tree->edit_links;");
+    output_line(out, "    struct edit_link *node = find_edit_link(links, links->number_of_nodes, offset);");
+    output_line(out, "    if (!node || node->rule != rule)");
+    output_line(out, "        return 0;");
+    output_line(out, "    size_t capacity = 16;");
+    output_line(out, "    size_t depth = 0;");
+    output_line(out, "    struct edit_frame *frames = malloc(capacity * sizeof(struct edit_frame));");
+    output_line(out, "    if (!frames)");
+    output_line(out, "        abort();");
+    output_line(out, "    struct edit_frame frame = { offset, offset, rule, UINT32_MAX };");
+    output_line(out, "    while (node) {");
+    output_line(out, "        // Walk back to the first node in the list.");
+    output_line(out, "        while (node && node->slot == UINT32_MAX && node->previous != 0) {");
+    output_line(out, "            frame.list = node->previous;");
+    output_line(out, "            node = find_edit_link(links, links->number_of_nodes, node->previous);");
+    output_line(out, "        }");
+    output_line(out, "        if (!node)");
+    output_line(out, "            break;");
+    output_line(out, "        if (depth >= capacity) {");
+    output_line(out, "            capacity *= 2;");
+    output_line(out, "            struct edit_frame *new_frames = realloc(frames, capacity * sizeof(struct edit_frame));");
+    output_line(out, "            if (!new_frames)");
+    output_line(out, "                abort();");
+    output_line(out, "            frames = new_frames;");
+    output_line(out, "        }");
+    output_line(out, "        frames[depth++] = frame;");
+    output_line(out, "        if (node->previous == 0)");
+    output_line(out, "            break;");
+    output_line(out, "        uint32_t slot = node->slot;");
+    output_line(out, "        node = find_edit_link(links, links->number_of_nodes, node->previous);");
+    output_line(out, "        if (node)");
+    output_line(out, "            frame = (struct edit_frame){ node->offset, node->offset, node->rule, slot };");
+    output_line(out, "    }");
+    output_line(out, "    // Links from earlier versions lead back to an earlier root.");
+    output_line(out, "    if (!node || frame.list != tree->root_offset) {");
+    output_line(out, "        free(frames);");
+    output_line(out, "        return 0;");
+    output_line(out, "    }");
+    output_line(out, "    for (size_t i = 0; i < depth / 2; ++i) {");
+    output_line(out, "        struct edit_frame swap = frames[i];");
+    output_line(out, "        frames[i] = frames[depth - 1 - i];");
+    output_line(out, "        frames[depth - 1 - i] = swap;");
+    output_line(out, "    }");
+    output_line(out, "    *path = frames;");
+    output_line(out, "    return depth;");
+    output_line(out, "}");
+    if (gen->options.compact_refs)
+        set_literal_substitution(out, "replacement-tree", "owl_current_tree");
+    else
+        set_literal_substitution(out, "replacement-tree", "replacement._tree");
+    output_line(out, "bool owl_tree_edit_replace(struct owl_ref ref, struct owl_ref replacement) {");
+    output_line(out, "    if (ref.empty)");
+    output_line(out, "        return false;");
+    output_line(out, "    struct owl_tree *tree = %%ref-tree;");
+    output_line(out, "    check_for_error(tree);");
+    if (gen->options.tree_save)
+        output_line(out, "    if (!tree->preorder || tree->mapping)");
+    else
+        output_line(out, "    if (!tree->preorder)");
+    output_line(out, "        return false;");
+    output_line(out, "    if (!replacement.empty && replacement._type != ref._type)");
+    output_line(out, "        return false;");
+    output_line(out, "    struct edit_frame *path;");
+    output_line(out, "    size_t depth = find_edit_path(tree, ref._offset, ref._type, &path);");
+    output_line(out, "    if (depth == 0)");
+    output_line(out, "        return false;");
+    if (gen->options.tree_index)
+        output_line(out, "    destroy_tree_index(tree);");
+    output_line(out, "    struct owl_snapshot snapshot = owl_tree_snapshot(tree);");
+    output_line(out, "    // The new list for the frame below the current one.");
+    output_line(out, "    size_t child = 0;");
+    output_line(out, "    for (size_t i = depth; i-- > 0;) {");
+    output_line(out, "        struct edit_frame *frame = &path[i];");
+    output_line(out, "        struct edit_list list = {0};");
+    output_line(out, "        size_t offset = frame->list;");
+    output_line(out, "        for (; offset != frame->offset; offset = next_sibling_offset(tree, offset)) {");
+    output_line(out, "            size_t node = copy_edited_node(tree, offset, frame->rule, UINT32_MAX, 0);");
+    output_line(out, "            append_to_edit_list(tree, &list, node, RESERVATION_AMOUNT);");
+    output_line(out, "        }");
+    output_line(out, "        if (i + 1 < depth) {");
+    output_line(out, "            size_t node = copy_edited_node(tree, offset, frame->rule, frame->slot, child);");
+    output_line(out, "            append_to_edit_list(tree, &list, node, RESERVATION_AMOUNT);");
+    output_line(out, "        } else if (replacement.empty) {");
+    output_line(out, "            // Nothing takes the match's place.");
+    // The whole replacement is copied, so no match appears twice in the
+    // current version (and each node has one link back to the root).  Its
+    // links are copied at full width so its next sibling link can reach back
+    // to the shared tail.
+    output_line(out, "        } else {");
+    output_line(out, "            struct owl_tree *source = %%replacement-tree;");
+    if (gen->grammar->number_of_lazy_rules > 0)
+        output_line(out, "            build_lazy_matches(source);");
+    output_line(out, "            struct copy_tree_text text = {0};");
+    if (!gen->options.compact_refs) {
+        // The replacement's tokens refer to its tree's text, so that text is
+        // added to this tree's text first.
+        if (gen->options.intern_identifiers) {
+            output_line(out, "            if (source != tree) {");
+            output_line(out, "                text.base = (size_t)0 - append_edit_text(tree, source->string);");
+            output_line(out, "                text.intern = true;");
+            output_line(out, "            }");
+        } else {
+            output_line(out, "            if (source != tree)");
+            output_line(out, "                text.base = (size_t)0 - append_edit_text(tree, source->string);");
+        }
+    }
+    output_line(out, "            size_t node = copy_tree_preorder(tree, source, replacement._offset, frame->rule, RESERVATION_AMOUNT, &text);");
+    output_line(out, "            append_to_edit_list(tree, &list, node, RESERVATION_AMOUNT);");
+    output_line(out, "        }");
+    output_line(out, "        // The rest of the list is shared.  The link back to it wraps around,");
+    output_line(out, "        // which is why edited nodes have full-width links.");
+    output_line(out, "        size_t tail = i > 0 ? next_sibling_offset(tree, frame->offset) : 0;");
+    output_line(out, "        if (list.last && tail)");
+    output_line(out, "            patch_tree(tree, list.last, tail - list.last, list.last_width);");
+    output_line(out, "        child = list.first ? list.first : tail;");
+    output_line(out, "    }");
+    output_line(out, "    free(path);");
+    if (gen->options.compact_refs) {
+        output_line(out, "    if (tree->next_offset > UINT32_MAX) {");
+        output_line(out, "        owl_tree_rollback(tree, snapshot);");
+        output_line(out, "        return false;");
+        output_line(out, "    }");
+    }
+    output_line(out, "    tree->root_offset = child;");
+    output_line(out, "    tree->edited = true;");
+    output_line(out, "    link_edited_nodes(tree, snapshot._next_offset);");
+    output_line(out, "    return true;");
+    output_line(out, "}");
+    output_line(out, "struct owl_snapshot owl_tree_snapshot(struct owl_tree *tree) {");
+    output_line(out, "    check_for_error(tree);");
+    output_line(out, "    return (struct owl_snapshot){");
+    output_line(out, "        ._root_offset = tree->root_offset,");
+    output_line(out, "        ._next_offset = tree->next_offset,");
+    output_line(out, "        ._generation = tree->generation,");
+    output_line(out, "    };");
+    output_line(out, "}");
+    output_line(out, "bool owl_tree_rollback(struct owl_tree *tree, struct owl_snapshot snapshot) {");
+    output_line(out, "    check_for_error(tree);");
+    output_line(out, "    // Compacting moves every node, and rolling back discards the nodes after");
+    output_line(out, "    // the snapshot.");
+    output_line(out, "    if (snapshot._generation != tree->generation || snapshot._next_offset > tree->next_offset)");
+    output_line(out, "        return false;");
+    if (gen->options.tree_index)
+        output_line(out, "    destroy_tree_index(tree);");
+    output_line(out, "    destroy_edit_links(tree);");
+    output_line(out, "    tree->root_offset = snapshot._root_offset;");
+    output_line(out, "    tree->next_offset = snapshot._next_offset;");
+    output_line(out, "    return true;");
+    output_line(out, "}");
+}
+
+static void generate_walker_types(struct generator *gen,
+ struct generator_output *out)
+{
+    output_line(out, "// An unpacked match of any rule.  Read the field named after the rule.");
+    output_line(out, "union owl_match {");
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "    struct parsed_%%rule %%rule;");
+    }
+    output_line(out, "};");
+    output_line(out, "");
+    output_line(out, "// An owl_walker visits every match in the tree, depth first, keeping its");
+    output_line(out, "// stack on the heap so trees of any depth can be walked.  Each match is");
+    output_line(out, "// entered before the matches inside it (field by field) and left after them.");
+    output_line(out, "struct owl_walker;");
+    output_line(out, "enum owl_walk_direction {");
+    output_line(out, "    WALK_ENTER,");
+    output_line(out, "    WALK_LEAVE,");
+    output_line(out, "};");
+    output_line(out, "struct owl_walk_event {");
+    output_line(out, "    enum owl_walk_direction direction;");
+    output_line(out, "    enum owl_rule rule;");
+    output_line(out, "    struct owl_ref ref;");
+    output_line(out, "    // The number of matches containing this one.");
+    output_line(out, "    size_t depth;");
+    output_line(out, "    // The match, unpacked once when it's entered.  Only valid until the next");
+    output_line(out, "    // call to owl_walker_next().");
+    output_line(out, "    const union owl_match *match;");
+    output_line(out, "};");
+}
+
+static void generate_tree_walker(struct generator *gen,
+ struct generator_output *out)
+{
+    uint32_t n = gen->grammar->number_of_rules;
+    // Printing and exporting use the walker too, so without --walker it's
+    // generated as static functions.
+    if (!gen->options.walker)
+        generate_walker_types(gen, out);
+    output_line(out, "struct walker_frame {");
+    output_line(out, "    struct owl_ref ref;");
+    output_line(out, "    union owl_match match;");
+    output_line(out, "    size_t next_delta;");
+    output_line(out, "    // The number of fields started so far, and the next match to enter in");
+    output_line(out, "    // the current field.");
+    output_line(out, "    uint32_t slot;");
+    output_line(out, "    struct owl_ref child;");
+    output_line(out, "    bool entered;");
+    output_line(out, "    bool skip;");
+    output_line(out, "};");
+    output_line(out, "struct owl_walker {");
+    output_line(out, "    struct owl_tree *tree;");
+    output_line(out, "    struct walker_frame *frames;");
+    output_line(out, "    size_t depth;");
+    output_line(out, "    size_t capacity;");
+    output_line(out, "};");
+    output_line(out, "static void read_match(struct owl_ref ref, union owl_match *match, size_t *next_delta) {");
+    output_line(out, "    switch (ref._type) {");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        set_unsigned_number_substitution(out, "rule-index", i);
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "    case %%rule-index:");
+        output_line(out, "        match->%%rule = read_parsed_%%rule(ref, next_delta);");
+        output_line(out, "        break;");
+    }
+    output_line(out, "    default:");
+    output_line(out, "        *next_delta = 0;");
+    output_line(out, "        break;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "// Stores the first ref in a field of a match, returning false if the rule");
+    output_line(out, "// doesn't have that many fields.");
+    output_line(out, "static bool match_slot(uint32_t rule, const union owl_match *match, uint32_t slot, struct owl_ref *ref) {");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        if (rule->number_of_slots == 0)
+            continue;
+        set_unsigned_number_substitution(out, "rule-index", i);
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "    case %%rule-index:");
+        output_line(out, "        switch (slot) {");
+        for (uint32_t j = 0; j < rule->number_of_slots; ++j) {
+            set_unsigned_number_substitution(out, "slot-index", j);
+            set_substitution(out, "slot-name", rule->slots[j].name,
+             rule->slots[j].name_length, LOWERCASE_WITH_UNDERSCORES);
+            output_line(out, "        case %%slot-index: *ref = match->%%rule.%%slot-name; return true;");
+        }
+        output_line(out, "        default: return false;");
+        output_line(out, "        }");
+    }
+    output_line(out, "    default:");
+    output_line(out, "        return false;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "static void push_walker_frame(struct owl_walker *walker, struct owl_ref ref) {");
+    output_line(out, "    if (walker->depth >= walker->capacity) {");
+    output_line(out, "        size_t capacity = walker->capacity ? walker->capacity * 2 : 16;");
+    output_line(out, "        struct walker_frame *frames = realloc(walker->frames, capacity * sizeof(struct walker_frame));");
+    output_line(out, "        if (!frames)");
+    output_line(out, "            abort();");
+    output_line(out, "        walker->frames = frames;");
+    output_line(out, "        walker->capacity = capacity;");
+    output_line(out, "    }");
+    output_line(out, "    walker->frames[walker->depth++] = (struct walker_frame){ .ref = ref };");
+    output_line(out, "}");
+    if (!gen->options.walker)
+        output_string(out, "static ");
+    output_line(out, "struct owl_walker *owl_walker_create(struct owl_tree *tree) {");
+    output_line(out, "    struct owl_walker *walker = calloc(1, sizeof(struct owl_walker));");
+    output_line(out, "    if (!walker)");
+    output_line(out, "        abort();");
+    output_line(out, "    walker->tree = tree;");
+    output_line(out, "    struct owl_ref root = owl_tree_root_ref(tree);");
+    output_line(out, "    if (!root.empty)");
+    output_line(out, "        push_walker_frame(walker, root);");
+    output_line(out, "    return walker;");
+    output_line(out, "}");
+    if (!gen->options.walker)
+        output_string(out, "static ");
+    output_line(out, "bool owl_walker_next(struct owl_walker *walker, struct owl_walk_event *event) {");
+    output_line(out, "    while (walker->depth > 0) {");
+    output_line(out, "        struct walker_frame *frame = &walker->frames[walker->depth - 1];");
+    output_line(out, "        if (!frame->entered) {");
+    output_line(out, "            frame->entered = true;");
+    output_line(out, "            frame->child.empty = true;");
+    output_line(out, "            read_match(frame->ref, &frame->match, &frame->next_delta);");
+    output_line(out, "            *event = (struct owl_walk_event){");
+    output_line(out, "                .direction = WALK_ENTER,");
+    output_line(out, "                .rule = (enum owl_rule)frame->ref._type,");
+    output_line(out, "                .ref = frame->ref,");
+    output_line(out, "                .depth = walker->depth - 1,");
+    output_line(out, "                .match = &frame->match,");
+    output_line(out, "            };");
+    output_line(out, "            return true;");
+    output_line(out, "        }");
+    output_line(out, "        while (!frame->skip && frame->child.empty &&");
+    output_line(out, "         match_slot(frame->ref._type, &frame->match, frame->slot, &frame->child))");
+    output_line(out, "            frame->slot++;");
+    output_line(out, "        if (!frame->skip && !frame->child.empty) {");
+    output_line(out, "            push_walker_frame(walker, frame->child);");
+    output_line(out, "            continue;");
+    output_line(out, "        }");
+    output_line(out, "        *event = (struct owl_walk_event){");
+    output_line(out, "            .direction = WALK_LEAVE,");
+    output_line(out, "            .rule = (enum owl_rule)frame->ref._type,");
+    output_line(out, "            .ref = frame->ref,");
+    output_line(out, "            .depth = walker->depth - 1,");
+    output_line(out, "            .match = &frame->match,");
+    output_line(out, "        };");
+    output_line(out, "        // The frame stays in memory (holding the match) until the next push.");
+    output_line(out, "        walker->depth--;");
+    output_line(out, "        if (walker->depth > 0) {");
+    output_line(out, "            struct walker_frame *parent = &walker->frames[walker->depth - 1];");
+    output_line(out, "            parent->child = frame->ref;");
+    output_line(out, "            parent->child._offset = walker->tree->preorder ?");
+    output_line(out, "             frame->ref._offset + frame->next_delta : frame->ref._offset - frame->next_delta;");
+    output_line(out, "            parent->child.empty = frame->next_delta == 0;");
+    output_line(out, "        }");
+    output_line(out, "        return true;");
+    output_line(out, "    }");
+    output_line(out, "    return false;");
+    output_line(out, "}");
+    if (!gen->options.walker)
+        output_string(out, "static ");
+    output_line(out, "void owl_walker_destroy(struct owl_walker *walker) {");
+    output_line(out, "    if (!walker)");
+    output_line(out, "        return;");
+    output_line(out, "    free(walker->frames);");
+    output_line(out, "    free(walker);");
+    output_line(out, "}");
+    if (gen->options.walker) {
+        output_line(out, "void owl_walker_skip_children(struct owl_walker *walker) {");
+        output_line(out, "    if (walker->depth > 0)");
+        output_line(out, "        walker->frames[walker->depth - 1].skip = true;");
+        output_line(out, "}");
+        output_line(out, "void owl_walk(struct owl_tree *tree, const struct owl_visitor *visitor, void *context) {");
+        output_line(out, "    struct owl_walker *walker = owl_walker_create(tree);");
+        output_line(out, "    struct owl_walk_event event;");
+        output_line(out, "    while (owl_walker_next(walker, &event)) {");
+        output_line(out, "        switch (event.rule) {");
+        for (uint32_t i = 0; i < n; ++i) {
+            struct rule *rule = &gen->grammar->rules[i];
+            set_substitution(out, "rule", rule->name, rule->name_length,
+             LOWERCASE_WITH_UNDERSCORES);
+            set_substitution(out, "rule-enum", rule->name, rule->name_length,
+             UPPERCASE_WITH_UNDERSCORES);
+            output_line(out, "        case RULE_%%rule-enum:");
+            output_line(out, "            if (event.direction == WALK_ENTER) {");
+            output_line(out, "                if (visitor->enter_%%rule && !visitor->enter_%%rule(context, event.ref, &event.match->%%rule))");
+            output_line(out, "                    owl_walker_skip_children(walker);");
+            output_line(out, "            } else if (visitor->leave_%%rule)");
+            output_line(out, "                visitor->leave_%%rule(context, event.ref, &event.match->%%rule);");
+            output_line(out, "            break;");
+        }
+        output_line(out, "        }");
+        output_line(out, "    }");
+        output_line(out, "    owl_walker_destroy(walker);");
+        output_line(out, "}");
+    }
+
+    // Printing uses the walker too, so deep trees don't overflow the stack.
+    output_line(out, "static const char *slot_name_lookup(uint32_t rule, uint32_t slot) {");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        if (rule->number_of_slots == 0)
+            continue;
+        set_unsigned_number_substitution(out, "rule-index", i);
+        output_line(out, "    case %%rule-index:");
+        output_line(out, "        switch (slot) {");
+        for (uint32_t j = 0; j < rule->number_of_slots; ++j) {
+            set_unsigned_number_substitution(out, "slot-index", j);
+            set_substitution(out, "slot-name", rule->slots[j].name,
+             rule->slots[j].name_length, LOWERCASE_WITH_UNDERSCORES);
+            output_line(out, "        case %%slot-index: return \"%%slot-name\";");
+        }
+        output_line(out, "        default: return \"\";");
+        output_line(out, "        }");
+    }
+    output_line(out, "    default:");
+    output_line(out, "        return \"\";");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "static void print_match(uint32_t rule, const union owl_match *match, const char *slot_name, size_t indent) {");
+    output_line(out, "    for (size_t i = 0; i < indent; ++i) printf(\"  \");");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        set_unsigned_number_substitution(out, "rule-index", i);
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "    case %%rule-index: {");
+        output_line(out, "        const struct parsed_%%rule *it = &match->%%rule;");
+        output_line(out, "        printf(\"%%rule\");");
+        output_line(out, "        if (slot_name && strcmp(\"%%rule\", slot_name))");
+        output_line(out, "            printf(\"@%s\", slot_name);");
+        if (rule->number_of_choices > 0) {
+            output_line(out, "        switch (it->type) {");
+            for (uint32_t j = 0; j < rule->number_of_choices; ++j) {
+                set_substitution(out, "choice-name", rule->choices[j].name,
+                 rule->choices[j].name_length, UPPERCASE_WITH_UNDERSCORES);
+                output_line(out, "        case PARSED_%%choice-name:");
+                output_line(out, "            printf(\" : %%choice-name\");");
+                output_line(out, "            break;");
+            }
+            output_line(out, "        default:");
+            output_line(out, "            break;");
+            output_line(out, "        }");
+        }
+        if (rule->is_token) {
+            if (rule_is_named(rule, "identifier"))
+                output_line(out, "        printf(\" - %.*s\", (int)it->length, it->identifier);");
+            else if (rule_is_named(rule, "number"))
+                output_line(out, "        printf(\" - %f\", it->number);");
+            else if (rule_is_named(rule, "string"))
+                output_line(out, "        printf(\" - %.*s\", (int)it->length, it->string);");
+        }
+        if (!rule_has_range(gen, rule)) {
+            if (rule->number_of_choices == 0 && !rule->is_token)
+                output_line(out, "        (void)it;");
+            output_line(out, "        printf(\"\\n\");");
+        } else
+            output_line(out, "        printf(\" (%zu - %zu)\\n\", (size_t)it->range.start, (size_t)it->range.end);");
+        output_line(out, "        break;");
+        output_line(out, "    }");
+    }
+    output_line(out, "    default:");
+    output_line(out, "        break;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "void owl_tree_print(struct owl_tree *tree) {");
+    output_line(out, "    struct owl_walker *walker = owl_walker_create(tree);");
+    output_line(out, "    struct owl_walk_event event;");
+    output_line(out, "    while (owl_walker_next(walker, &event)) {");
+    output_line(out, "        if (event.direction != WALK_ENTER)");
+    output_line(out, "            continue;");
+    output_line(out, "        const char *slot_name = 0;");
+    output_line(out, "        if (event.depth > 0) {");
+    output_line(out, "            struct walker_frame *parent = &walker->frames[event.depth - 1];");
+    output_line(out, "            slot_name = slot_name_lookup(parent->ref._type, parent->slot - 1);");
+    output_line(out, "        }");
+    output_line(out, "        print_match(event.rule, event.match, slot_name, event.depth);");
+    output_line(out, "    }");
+    output_line(out, "    owl_walker_destroy(walker);");
+    output_line(out, "}");
+}
+
+static void generate_tree_exporters(struct generator *gen,
+ struct generator_output *out)
+{
+    uint32_t n = gen->grammar->number_of_rules;
+    output_line(out, "#define EXPORT_BUFFER_SIZE 65536");
+    output_line(out, "struct export_writer {");
+    output_line(out, "    FILE *file;");
+    output_line(out, "    size_t length;");
+    output_line(out, "    bool failed;");
+    output_line(out, "    char buffer[EXPORT_BUFFER_SIZE];");
+    output_line(out, "};");
+    output_line(out, "static void flush_writer(struct export_writer *w) {");
+    output_line(out, "    if (w->length > 0 && fwrite(w->buffer, 1, w->length, w->file) != w->length)");
+    output_line(out, "        w->failed = true;");
+    output_line(out, "    w->length = 0;");
+    output_line(out, "}");
+    output_line(out, "static void write_bytes(struct export_writer *w, const char *bytes, size_t length) {");
+    output_line(out, "    if (length > EXPORT_BUFFER_SIZE - w->length) {");
+    output_line(out, "        flush_writer(w);");
+    output_line(out, "        if (length > EXPORT_BUFFER_SIZE) {");
+    output_line(out, "            if (fwrite(bytes, 1, length, w->file) != length)");
+    output_line(out, "                w->failed = true;");
+    output_line(out, "            return;");
+    output_line(out, "        }");
+    output_line(out, "    }");
+    output_line(out, "    memcpy(w->buffer + w->length, bytes, length);");
+    output_line(out, "    w->length += length;");
+    output_line(out, "}");
+    output_line(out, "static void write_byte(struct export_writer *w, char c) {");
+    output_line(out, "    if (w->length == EXPORT_BUFFER_SIZE)");
+    output_line(out, "        flush_writer(w);");
+    output_line(out, "    w->buffer[w->length++] = c;");
+    output_line(out, "}");
+    output_line(out, "static void write_string(struct export_writer *w, const char *string) {");
+    output_line(out, "    write_bytes(w, string, strlen(string));");
+    output_line(out, "}");
+    output_line(out, "static void write_decimal(struct export_writer *w, uint64_t value) {");
+    output_line(out, "    char digits[20];");
+    output_line(out, "    size_t i = sizeof(digits);");
+    output_line(out, "    do {");
+    output_line(out, "        digits[--i] = '0' + value % 10;");
+    output_line(out, "        value /= 10;");
+    output_line(out, "    } while (value > 0);");
+    output_line(out, "    write_bytes(w, digits + i, sizeof(digits) - i);");
+    output_line(out, "}");
+    output_line(out, "static void write_json_number(struct export_writer *w, double number) {");
+    output_line(out, "    // Integers (the common case) skip printf.");
+    output_line(out, "    if (number >= -9007199254740992.0 && number <= 9007199254740992.0 &&");
+    output_line(out, "     number == (double)(int64_t)number) {");
+    output_line(out, "        if (number < 0) {");
+    output_line(out, "            write_byte(w, '-');");
+    output_line(out, "            number = -number;");
+    output_line(out, "        }");
+    output_line(out, "        write_decimal(w, (uint64_t)number);");
+    output_line(out, "        return;");
+    output_line(out, "    }");
+    output_line(out, "    // JSON can't represent infinities or NaN.");
+    output_line(out, "    if (number != number || number - number != 0) {");
+    output_line(out, "        write_string(w, \"null\");");
+    output_line(out, "        return;");
+    output_line(out, "    }");
+    output_line(out, "    char digits[32];");
+    output_line(out, "    int length = snprintf(digits, sizeof(digits), \"%.17g\", number);");
+    output_line(out, "    write_bytes(w, digits, (size_t)length);");
+    output_line(out, "}");
+    output_line(out, "static void write_json_string(struct export_writer *w, const char *string, size_t length) {");
+    output_line(out, "    static const char hex[] = \"0123456789abcdef\";");
+    output_line(out, "    write_byte(w, '\"');");
+    output_line(out, "    size_t run = 0;");
+    output_line(out, "    for (size_t i = 0; i < length; ++i) {");
+    output_line(out, "        unsigned char c = (unsigned char)string[i];");
+    output_line(out, "        if (c >= 0x20 && c != '\"' && c != '\\\\')");
+    output_line(out, "            continue;");
+    output_line(out, "        // Copy everything up to this character in one go.");
+    output_line(out, "        write_bytes(w, string + run, i - run);");
+    output_line(out, "        run = i + 1;");
+    output_line(out, "        switch (c) {");
+    output_line(out, "        case '\"': write_bytes(w, \"\\\\\\\"\", 2); break;");
+    output_line(out, "        case '\\\\': write_bytes(w, \"\\\\\\\\\", 2); break;");
+    output_line(out, "        case '\\n': write_bytes(w, \"\\\\n\", 2); break;");
+    output_line(out, "        case '\\r': write_bytes(w, \"\\\\r\", 2); break;");
+    output_line(out, "        case '\\t': write_bytes(w, \"\\\\t\", 2); break;");
+    output_line(out, "        default: {");
+    output_line(out, "            char escape[6] = { '\\\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };");
+    output_line(out, "            write_bytes(w, escape, sizeof(escape));");
+    output_line(out, "            break;");
+    output_line(out, "        }");
+    output_line(out, "        }");
+    output_line(out, "    }");
+    output_line(out, "    write_bytes(w, string + run, length - run);");
+    output_line(out, "    write_byte(w, '\"');");
+    output_line(out, "}");
+    output_line(out, "static void write_json_match(struct export_writer *w, uint32_t rule, const union owl_match *match) {");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        set_unsigned_number_substitution(out, "rule-index", i);
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "    case %%rule-index: {");
+        output_line(out, "        const struct parsed_%%rule *it = &match->%%rule;");
+        output_line(out, "        write_string(w, \"{\\\"rule\\\":\\\"%%rule\\\"\");");
+        if (rule->number_of_choices > 0) {
+            output_line(out, "        switch (it->type) {");
+            for (uint32_t j = 0; j < rule->number_of_choices; ++j) {
+                set_substitution(out, "choice-name", rule->choices[j].name,
+                 rule->choices[j].name_length, UPPERCASE_WITH_UNDERSCORES);
+                output_line(out, "        case PARSED_%%choice-name:");
+                output_line(out, "            write_string(w, \",\\\"type\\\":\\\"%%choice-name\\\"\");");
+                output_line(out, "            break;");
+            }
+            output_line(out, "        default:");
+            output_line(out, "            break;");
+            output_line(out, "        }");
+        }
+        if (!rule_has_range(gen, rule)) {
+            if (rule->number_of_choices == 0 && !rule->is_token)
+                output_line(out, "        (void)it;");
+        } else {
+            output_line(out, "        write_string(w, \",\\\"range\\\":[\");");
+            output_line(out, "        write_decimal(w, it->range.start);");
+            output_line(out, "        write_byte(w, ',');");
+            output_line(out, "        write_decimal(w, it->range.end);");
+            output_line(out, "        write_byte(w, ']');");
+        }
+        if (rule->is_token) {
+            if (rule_is_named(rule, "identifier")) {
+                output_line(out, "        write_string(w, \",\\\"identifier\\\":\");");
+                output_line(out, "        write_json_string(w, it->identifier, it->length);");
+            } else if (rule_is_named(rule, "number")) {
+                output_line(out, "        write_string(w, \",\\\"number\\\":\");");
+                output_line(out, "        write_json_number(w, it->number);");
+            } else if (rule_is_named(rule, "string")) {
+                output_line(out, "        write_string(w, \",\\\"string\\\":\");");
+                output_line(out, "        write_json_string(w, it->string, it->length);");
+            }
+        }
+        if (rule->number_of_slots > 0)
+            output_line(out, "        write_string(w, \",\\\"fields\\\":{\");");
+        output_line(out, "        break;");
+        output_line(out, "    }");
+    }
+    output_line(out, "    default:");
+    output_line(out, "        break;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "// Tracks which fields of a match have been written so far.");
+    output_line(out, "struct json_fields_written {");
+    output_line(out, "    uint32_t rule;");
+    output_line(out, "    uint32_t fields;");
+    output_line(out, "    bool has_element;");
+    output_line(out, "};");
+    output_line(out, "static void write_json_fields_until(struct export_writer *w, struct json_fields_written *written, uint32_t fields) {");
+    output_line(out, "    while (written->fields < fields) {");
+    output_line(out, "        if (written->fields > 0)");
+    output_line(out, "            write_bytes(w, \"],\", 2);");
+    output_line(out, "        write_byte(w, '\"');");
+    output_line(out, "        write_string(w, slot_name_lookup(written->rule, written->fields));");
+    output_line(out, "        write_bytes(w, \"\\\":[\", 3);");
+    output_line(out, "        written->fields++;");
+    output_line(out, "        written->has_element = false;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "bool owl_tree_write_json(struct owl_tree *tree, FILE *file) {");
+    output_line(out, "    struct export_writer *w = malloc(sizeof(struct export_writer));");
+    output_line(out, "    if (!w)");
+    output_line(out, "        abort();");
+    output_line(out, "    w->file = file;");
+    output_line(out, "    w->length = 0;");
+    output_line(out, "    w->failed = false;");
+    output_line(out, "    size_t capacity = 16;");
+    output_line(out, "    struct json_fields_written *written = malloc(capacity * sizeof(struct json_fields_written));");
+    output_line(out, "    if (!written)");
+    output_line(out, "        abort();");
+    output_line(out, "    struct owl_walker *walker = owl_walker_create(tree);");
+    output_line(out, "    if (walker->depth == 0)");
+    output_line(out, "        write_string(w, \"null\");");
+    output_line(out, "    struct owl_walk_event event;");
+    output_line(out, "    while (owl_walker_next(walker, &event)) {");
+    output_line(out, "        uint32_t number_of_slots = (uint32_t)number_of_slots_lookup(event.rule, 0);");
+    output_line(out, "        if (event.direction == WALK_LEAVE) {");
+    output_line(out, "            if (number_of_slots > 0) {");
+    output_line(out, "                write_json_fields_until(w, &written[event.depth], number_of_slots);");
+    output_line(out, "                write_bytes(w, \"]}\", 2);");
+    output_line(out, "            }");
+    output_line(out, "            write_byte(w, '}');");
+    output_line(out, "            continue;");
+    output_line(out, "        }");
+    output_line(out, "        if (event.depth > 0) {");
+    output_line(out, "            struct json_fields_written *parent = &written[event.depth - 1];");
+    output_line(out, "            write_json_fields_until(w, parent, walker->frames[event.depth - 1].slot);");
+    output_line(out, "            if (parent->has_element)");
+    output_line(out, "                write_byte(w, ',');");
+    output_line(out, "            parent->has_element = true;");
+    output_line(out, "        }");
+    output_line(out, "        if (event.depth >= capacity) {");
+    output_line(out, "            capacity *= 2;");
+    output_line(out, "            struct json_fields_written *new_written = realloc(written, capacity * sizeof(struct json_fields_written));");
+    output_line(out, "            if (!new_written)");
+    output_line(out, "                abort();");
+    output_line(out, "            written = new_written;");
+    output_line(out, "        }");
+    output_line(out, "        written[event.depth] = (struct json_fields_written){ .rule = event.rule };");
+    output_line(out, "        write_json_match(w, event.rule, event.match);");
+    output_line(out, "    }");
+    output_line(out, "    write_byte(w, '\\n');");
+    output_line(out, "    owl_walker_destroy(walker);");
+    output_line(out, "    free(written);");
+    output_line(out, "    flush_writer(w);");
+    output_line(out, "    bool ok = !w->failed;");
+    output_line(out, "    free(w);");
+    output_line(out, "    return ok;");
+    output_line(out, "}");
+
+    // See the "exporting" section of doc/generated-parser.md for a
+    // description of the binary format.
+    output_line(out, "static void write_varint(struct export_writer *w, uint64_t value) {");
+    output_line(out, "    char bytes[10];");
+    output_line(out, "    size_t i = 0;");
+    output_line(out, "    while (value >> 7 != 0) {");
+    output_line(out, "        bytes[i++] = (char)(0x80 | (value & 0x7f));");
+    output_line(out, "        value >>= 7;");
+    output_line(out, "    }");
+    output_line(out, "    bytes[i++] = (char)value;");
+    output_line(out, "    write_bytes(w, bytes, i);");
+    output_line(out, "}");
+    output_line(out, "static void write_binary_match(struct export_writer *w, uint32_t rule, const union owl_match *match) {");
+    output_line(out, "    write_varint(w, rule);");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        set_unsigned_number_substitution(out, "rule-index", i);
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "    case %%rule-index: {");
+        output_line(out, "        const struct parsed_%%rule *it = &match->%%rule;");
+        if (rule->number_of_choices > 0)
+            output_line(out, "        write_varint(w, (uint64_t)it->type);");
+        if (rule_has_range(gen, rule)) {
+            output_line(out, "        write_varint(w, it->range.start);");
+            output_line(out, "        write_varint(w, it->range.end - it->range.start);");
+        } else if (rule->number_of_choices == 0 &&
+         rule->number_of_slots == 0)
+            output_line(out, "        (void)it;");
+        if (rule->is_token) {
+            if (rule_is_named(rule, "identifier")) {
+                output_line(out, "        write_varint(w, it->length);");
+                output_line(out, "        write_bytes(w, it->identifier, it->length);");
+            } else if (rule_is_named(rule, "number")) {
+                output_line(out, "        uint64_t bits;");
+                output_line(out, "        memcpy(&bits, &it->number, sizeof(bits));");
+                output_line(out, "        char bytes[8];");
+                output_line(out, "        for (int i = 0; i < 8; ++i)");
+                output_line(out, "            bytes[i] = (char)(bits >> (8 * i));");
+                output_line(out, "        write_bytes(w, bytes, sizeof(bytes));");
+            } else if (rule_is_named(rule, "string")) {
+                output_line(out, "        write_varint(w, it->length);");
+                output_line(out, "        write_bytes(w, it->string, it->length);");
+            }
+        }
+        for (uint32_t j = 0; j < rule->number_of_slots; ++j) {
+            set_substitution(out, "slot-name", rule->slots[j].name,
+             rule->slots[j].name_length, LOWERCASE_WITH_UNDERSCORES);
+            output_line(out, "        write_varint(w, owl_count(it->%%slot-name));");
+        }
+        output_line(out, "        break;");
+        output_line(out, "    }");
+    }
+    output_line(out, "    default:");
+    output_line(out, "        break;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    set_unsigned_number_substitution(out, "binary-flags",
+     (gen->options.omit_ranges ? 1 : 0) |
+     (gen->options.share_subtrees ? 2 : 0));
+    output_line(out, "bool owl_tree_write_binary(struct owl_tree *tree, FILE *file) {");
+    output_line(out, "    struct export_writer *w = malloc(sizeof(struct export_writer));");
+    output_line(out, "    if (!w)");
+    output_line(out, "        abort();");
+    output_line(out, "    w->file = file;");
+    output_line(out, "    w->length = 0;");
+    output_line(out, "    w->failed = false;");
+    output_line(out, "    struct owl_walker *walker = owl_walker_create(tree);");
+    output_line(out, "    write_bytes(w, \"OWLB\", 4);");
+    output_line(out, "    write_varint(w, 1);");
+    output_line(out, "    write_varint(w, %%binary-flags);");
+    output_line(out, "    write_varint(w, walker->depth > 0);");
+    output_line(out, "    struct owl_walk_event event;");
+    output_line(out, "    while (owl_walker_next(walker, &event)) {");
+    output_line(out, "        if (event.direction == WALK_ENTER)");
+    output_line(out, "            write_binary_match(w, event.rule, event.match);");
+    output_line(out, "    }");
+    output_line(out, "    owl_walker_destroy(walker);");
+    output_line(out, "    flush_writer(w);");
+    output_line(out, "    bool ok = !w->failed;");
+    output_line(out, "    free(w);");
+    output_line(out, "    return ok;");
+    output_line(out, "}");
+}
+
+static uint64_t fingerprint_bytes(uint64_t hash, const void *bytes, size_t length)
+{
+    // FNV-1a.
+    const unsigned char *b = bytes;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= b[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash;
+}
+
+// Hashes everything that affects how trees are encoded, so saved trees are
+// only loaded by compatible parsers.  Options which only add functions don't
+// change the encoding, so they're left out.
+static uint64_t grammar_fingerprint(struct generator *gen)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    const bool encoding[] = {
+        gen->options.fixed_layout,
+        gen->options.compact_refs,
+        gen->options.omit_ranges,
+        gen->options.segmented_tree,
+        gen->options.intern_identifiers,
+        gen->options.subtree_hashes,
+    };
+    hash = fingerprint_bytes(hash, encoding, sizeof(encoding));
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        hash = fingerprint_bytes(hash, rule->name, rule->name_length + 1);
+        hash = fingerprint_bytes(hash, &rule->is_token, sizeof(rule->is_token));
+        for (uint32_t j = 0; j < rule->number_of_choices; ++j) {
+            hash = fingerprint_bytes(hash, rule->choices[j].name,
+             rule->choices[j].name_length + 1);
+        }
+        for (uint32_t j = 0; j < rule->number_of_slots; ++j) {
+            hash = fingerprint_bytes(hash, rule->slots[j].name,
+             rule->slots[j].name_length + 1);
+            hash = fingerprint_bytes(hash, &rule->slots[j].rule_index,
+             sizeof(rule->slots[j].rule_index));
+        }
+    }
+    return hash;
+}
+
+static void generate_tree_persistence(struct generator *gen,
+ struct generator_output *out)
+{
+    char fingerprint[32];
+    snprintf(fingerprint, sizeof(fingerprint), "UINT64_C(0x%016llx)",
+     (unsigned long long)grammar_fingerprint(gen));
+    set_literal_substitution(out, "grammar-fingerprint", fingerprint);
+    output_line(out, "#ifdef OWL_TREE_SAVE_AND_LOAD");
+    output_line(out, "#define SAVED_TREE_MAGIC UINT64_C(0x31454552544c574f)");
+    output_line(out, "#define SAVED_TREE_FINGERPRINT %%grammar-fingerprint");
+    output_line(out, "// Saved trees start with this header, followed by the tree's bytes.  The");
+    output_line(out, "// magic number also catches files saved with a different byte order.");
+    output_line(out, "struct saved_tree_header {");
+    output_line(out, "    uint64_t magic;");
+    output_line(out, "    uint64_t fingerprint;");
+    output_line(out, "    uint64_t string_length;");
+    output_line(out, "    uint64_t root_offset;");
+    output_line(out, "    uint64_t root_rule;");
+    output_line(out, "    uint64_t next_offset;");
+    output_line(out, "    uint64_t data_length;");
+    output_line(out, "    uint64_t preorder;");
+    output_line(out, "    // The identifiers (if they're interned) follow the tree's bytes.");
+    output_line(out, "    uint64_t number_of_identifiers;");
+    output_line(out, "};");
+    output_line(out, "static bool write_all(int fd, const void *bytes, size_t length) {");
+    output_line(out, "    const char *p = bytes;");
+    output_line(out, "    while (length > 0) {");
+    output_line(out, "        ssize_t written = write(fd, p, length);");
+    output_line(out, "        if (written <= 0)");
+    output_line(out, "            return false;");
+    output_line(out, "        p += written;");
+    output_line(out, "        length -= (size_t)written;");
+    output_line(out, "    }");
+    output_line(out, "    return true;");
+    output_line(out, "}");
+    output_line(out, "bool owl_tree_save(struct owl_tree *tree, int fd) {");
+    output_line(out, "    if (tree->error != ERROR_NONE)");
+    output_line(out, "        return false;");
+    if (gen->grammar->number_of_lazy_rules > 0)
+        output_line(out, "    build_lazy_matches(tree);");
+    if (gen->options.segmented_tree) {
+        output_line(out, "    // Whole segments are saved so reads near the end stay in bounds.");
+        output_line(out, "    size_t data_length = tree->number_of_segments << SEGMENT_SHIFT;");
+    } else {
+        output_line(out, "    // Pad the end so reads near it stay in bounds (see read_tree) and so");
+        output_line(out, "    // the identifiers after it are aligned.");
+        output_line(out, "    size_t data_length = (tree->next_offset + RESERVATION_AMOUNT + 7) & ~(size_t)7;");
+    }
+    output_line(out, "    struct saved_tree_header header = {");
+    output_line(out, "        .magic = SAVED_TREE_MAGIC,");
+    output_line(out, "        .fingerprint = SAVED_TREE_FINGERPRINT,");
+    output_line(out, "        .string_length = strlen(tree->string),");
+    output_line(out, "        .root_offset = tree->root_offset,");
+    output_line(out, "        .root_rule = %%tree-root-rule,");
+    output_line(out, "        .next_offset = tree->next_offset,");
+    output_line(out, "        .data_length = data_length,");
+    output_line(out, "        .preorder = tree->preorder,");
+    if (gen->options.intern_identifiers)
+        output_line(out, "        .number_of_identifiers = tree->number_of_identifiers,");
+    output_line(out, "    };");
+    output_line(out, "    if (!write_all(fd, &header, sizeof(header)))");
+    output_line(out, "        return false;");
+    if (gen->options.segmented_tree) {
+        output_line(out, "    for (size_t i = 0; i < tree->number_of_segments; ++i) {");
+        output_line(out, "        if (!write_all(fd, tree->segments[i].bytes, SEGMENT_SIZE))");
+        output_line(out, "            return false;");
+        output_line(out, "    }");
+    } else {
+        output_line(out, "    static const uint8_t padding[RESERVATION_AMOUNT + 8];");
+        output_line(out, "    if (!write_all(fd, tree->parse_tree, tree->next_offset) ||");
+        output_line(out, "     !write_all(fd, padding, data_length - tree->next_offset))");
+        output_line(out, "        return false;");
+    }
+    if (gen->options.intern_identifiers) {
+        output_line(out, "    return write_all(fd, tree->identifiers,");
+        output_line(out, "     tree->number_of_identifiers * sizeof(struct interned_identifier));");
+    } else
+        output_line(out, "    return true;");
+    output_line(out, "}");
+    output_line(out, "struct owl_tree *owl_tree_load_mmap(const char *path, const char *string) {");
+    output_line(out, "    int fd = open(path, O_RDONLY);");
+    output_line(out, "    if (fd < 0)");
+    output_line(out, "        return owl_tree_create_with_error(ERROR_INVALID_FILE);");
+    output_line(out, "    struct stat st;");
+    output_line(out, "    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct saved_tree_header)) {");
+    output_line(out, "        close(fd);");
+    output_line(out, "        return owl_tree_create_with_error(ERROR_INVALID_FILE);");
+    output_line(out, "    }");
+    output_line(out, "    size_t size = (size_t)st.st_size;");
+    output_line(out, "    void *mapping = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);");
+    output_line(out, "    close(fd);");
+    output_line(out, "    if (mapping == MAP_FAILED)");
+    output_line(out, "        return owl_tree_create_with_error(ERROR_INVALID_FILE);");
+    output_line(out, "    struct saved_tree_header header;");
+    output_line(out, "    memcpy(&header, mapping, sizeof(header));");
+    output_line(out, "    if (header.magic != SAVED_TREE_MAGIC ||");
+    output_line(out, "     header.fingerprint != SAVED_TREE_FINGERPRINT ||");
+    output_line(out, "     header.string_length != strlen(string) ||");
+    output_line(out, "     header.root_rule >= %%number-of-rules ||");
+    if (gen->options.intern_identifiers) {
+        output_line(out, "     header.data_length > size - sizeof(header) ||");
+        output_line(out, "     header.number_of_identifiers > UINT32_MAX ||");
+        output_line(out, "     size - sizeof(header) - header.data_length !=");
+        output_line(out, "      header.number_of_identifiers * sizeof(struct interned_identifier) ||");
+    } else {
+        output_line(out, "     header.number_of_identifiers != 0 ||");
+        output_line(out, "     header.data_length != size - sizeof(header) ||");
+    }
+    output_line(out, "     header.next_offset > header.data_length ||");
+    if (gen->options.segmented_tree)
+        output_line(out, "     (header.data_length & SEGMENT_MASK) != 0 ||");
+    output_line(out, "     header.root_offset >= header.next_offset) {");
+    output_line(out, "        munmap(mapping, size);");
+    output_line(out, "        return owl_tree_create_with_error(ERROR_INVALID_FILE);");
+    output_line(out, "    }");
+    output_line(out, "    struct owl_tree *tree = owl_tree_create_empty();");
+    output_line(out, "    if (!tree)");
+    output_line(out, "        abort();");
+    output_line(out, "    tree->string = string;");
+    output_line(out, "    tree->mapping = mapping;");
+    output_line(out, "    tree->mapping_size = size;");
+    output_line(out, "    tree->root_offset = header.root_offset;");
+    output_line(out, "    tree->root_rule = (uint32_t)header.root_rule;");
+    output_line(out, "    tree->next_offset = header.next_offset;");
+    output_line(out, "    tree->preorder = header.preorder != 0;");
+    output_line(out, "    uint8_t *bytes = (uint8_t *)mapping + sizeof(header);");
+    if (gen->options.segmented_tree) {
+        output_line(out, "    size_t count = header.data_length >> SEGMENT_SHIFT;");
+        output_line(out, "    tree->segments = malloc((count ? count : 1) * sizeof(struct tree_segment));");
+        output_line(out, "    if (!tree->segments)");
+        output_line(out, "        abort();");
+        output_line(out, "    for (size_t i = 0; i < count; ++i)");
+        output_line(out, "        tree->segments[i] = (struct tree_segment){ .bytes = bytes + (i << SEGMENT_SHIFT) };");
+        output_line(out, "    tree->number_of_segments = count;");
+        output_line(out, "    tree->segments_capacity = count;");
+    } else {
+        output_line(out, "    // The mapping is read-only; nothing writes to a finished tree.");
+        output_line(out, "    tree->parse_tree = bytes;");
+        output_line(out, "    tree->parse_tree_size = header.data_length;");
+    }
+    if (gen->options.intern_identifiers) {
+        output_line(out, "    // Copy the identifiers out of the mapping so they outlive it if the");
+        output_line(out, "    // tree is compacted.");
+        output_line(out, "    size_t identifiers_size = header.number_of_identifiers * sizeof(struct interned_identifier);");
+        output_line(out, "    tree->identifiers = malloc(identifiers_size ? identifiers_size : 1);");
+        output_line(out, "    if (!tree->identifiers)");
+        output_line(out, "        abort();");
+        output_line(out, "    memcpy(tree->identifiers, bytes + header.data_length, identifiers_size);");
+        output_line(out, "    tree->number_of_identifiers = (uint32_t)header.number_of_identifiers;");
+        output_line(out, "    tree->identifiers_capacity = tree->number_of_identifiers;");
+    }
+    output_line(out, "    return tree;");
+    output_line(out, "}");
+    generate_loaded_tree_validation(gen, out);
+    output_line(out, "#endif");
+}
+
+static void generate_loaded_tree_validation(struct generator *gen,
+ struct generator_output *out)
+{
+    output_line(out, "struct validate_tree_frame {");
+    output_line(out, "    size_t offset;");
+    output_line(out, "    uint32_t rule;");
+    output_line(out, "    // Set for the frame that marks the end of a node's children and siblings.");
+    output_line(out, "    bool leaving;");
+    output_line(out, "};");
+    output_line(out, "#define VALIDATE_IN_PROGRESS 0x80000000u");
+    output_line(out, "static bool valid_text_range(size_t string_length, uint64_t start, uint64_t length) {");
+    output_line(out, "    return start <= string_length && length <= string_length - start;");
+    output_line(out, "}");
+    output_line(out, "// Each node is checked once and must be reached as the same rule each time.");
+    output_line(out, "// A node that leads back to itself would make traversals loop forever, so");
+    output_line(out, "// that's an error too.");
+    output_line(out, "bool owl_tree_load_validate(struct owl_tree *tree) {");
+    output_line(out, "    if (tree->error != ERROR_NONE)");
+    output_line(out, "        return false;");
+    output_line(out, "    size_t string_length = strlen(tree->string);");
+    if (gen->options.intern_identifiers) {
+        output_line(out, "    for (uint32_t i = 0; i < tree->number_of_identifiers; ++i) {");
+        output_line(out, "        if (!valid_text_range(string_length, tree->identifiers[i].start, tree->identifiers[i].length))");
+        output_line(out, "            return false;");
+        output_line(out, "    }");
+    }
+    output_line(out, "    size_t end = tree->next_offset;");
+    bool has_strings = false;
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
+        if (rule_is_named(&gen->grammar->rules[i], "string"))
+            has_strings = true;
+    }
+    if (has_strings && gen->options.segmented_tree)
+        output_line(out, "    size_t data_length = tree->number_of_segments << SEGMENT_SHIFT;");
+    else if (has_strings)
+        output_line(out, "    size_t data_length = tree->parse_tree_size;");
+    output_line(out, "    // The rule each node was reached as plus one (so zero means unvisited),");
+    output_line(out, "    // with VALIDATE_IN_PROGRESS set until everything after it is checked.");
+    output_line(out, "    uint32_t *visited = calloc(end, sizeof(uint32_t));");
+    output_line(out, "    size_t capacity = 16;");
+    output_line(out, "    size_t top = 0;");
+    output_line(out, "    struct validate_tree_frame *stack = malloc(capacity * sizeof(struct validate_tree_frame));");
+    output_line(out, "    if (!visited || !stack)");
+    output_line(out, "        abort();");
+    output_line(out, "    stack[top++] = (struct validate_tree_frame){ tree->root_offset, tree->root_rule, false };");
+    output_line(out, "    bool valid = true;");
+    output_line(out, "    while (valid && top > 0) {");
+    output_line(out, "        struct validate_tree_frame frame = stack[--top];");
+    output_line(out, "        if (frame.leaving) {");
+    output_line(out, "            visited[frame.offset] &= ~VALIDATE_IN_PROGRESS;");
+    output_line(out, "            continue;");
+    output_line(out, "        }");
+    output_line(out, "        if (frame.offset < %%first-tree-offset || frame.offset >= end) {");
+    output_line(out, "            valid = false;");
+    output_line(out, "            break;");
+    output_line(out, "        }");
+    output_line(out, "        if (visited[frame.offset] == frame.rule + 1)");
+    output_line(out, "            continue;");
+    output_line(out, "        if (visited[frame.offset] != 0) {");
+    output_line(out, "            valid = false;");
+    output_line(out, "            break;");
+    output_line(out, "        }");
+    output_line(out, "        visited[frame.offset] = (frame.rule + 1) | VALIDATE_IN_PROGRESS;");
+    output_line(out, "        if (top + MAX_NUMBER_OF_SLOTS + 2 > capacity) {");
+    output_line(out, "            capacity = (capacity + MAX_NUMBER_OF_SLOTS + 2) * 2;");
+    output_line(out, "            struct validate_tree_frame *new_stack = realloc(stack, capacity * sizeof(struct validate_tree_frame));");
+    output_line(out, "            if (!new_stack)");
+    output_line(out, "                abort();");
+    output_line(out, "            stack = new_stack;");
+    output_line(out, "        }");
+    output_line(out, "        stack[top++] = (struct validate_tree_frame){ frame.offset, frame.rule, true };");
+    output_line(out, "        size_t offset = frame.offset;");
+    output_line(out, "        uint64_t delta = read_tree(&offset, tree);");
+    output_line(out, "        if (delta != 0) {");
+    if (gen->options.tree_edit) {
+        // Edited nodes link back to the siblings they share by wrapping
+        // around, so any preorder link is allowed here; the offset it leads
+        // to is checked when its frame is popped.
+        output_line(out, "            if (!tree->preorder && delta > frame.offset) {");
+    } else
+        output_line(out, "            if (tree->preorder ? delta >= end - frame.offset : delta > frame.offset) {");
+    output_line(out, "                valid = false;");
+    output_line(out, "                break;");
+    output_line(out, "            }");
+    output_line(out, "            stack[top++] = (struct validate_tree_frame){");
+    output_line(out, "                tree->preorder ? frame.offset + delta : frame.offset - delta,");
+    output_line(out, "                frame.rule,");
+    output_line(out, "                false,");
+    output_line(out, "            };");
+    output_line(out, "        }");
+    output_line(out, "        switch (frame.rule) {");
+    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        set_unsigned_number_substitution(out, "rule-index", i);
+        output_line(out, "        case %%rule-index: {");
+        if (rule->is_token) {
+            output_line(out, "            size_t token_offset = read_tree(&offset, tree);");
+            output_line(out, "            if (token_offset < %%first-tree-offset || token_offset >= end) {");
+            output_line(out, "                valid = false;");
+            output_line(out, "                break;");
+            output_line(out, "            }");
+            output_line(out, "            read_tree(&token_offset, tree);");
+            output_line(out, "            uint64_t start = read_tree(&token_offset, tree);");
+            output_line(out, "            uint64_t length = read_tree(&token_offset, tree);");
+            output_line(out, "            valid = valid_text_range(string_length, start, length);");
+            if (rule_is_named(rule, "identifier") &&
+             gen->options.intern_identifiers)
+                output_line(out, "            valid = valid && read_tree(&token_offset, tree) < tree->number_of_identifiers;");
+            else if (rule_is_named(rule, "string")) {
+                // Strings without escapes are read from between the quotes.
+                output_line(out, "            uint64_t string_offset = read_tree(&token_offset, tree);");
+                output_line(out, "            if (string_offset == 0)");
+                output_line(out, "                valid = valid && length >= 2;");
+                output_line(out, "            else {");
+                output_line(out, "                uint64_t contents_length = read_tree(&token_offset, tree);");
+                output_line(out, "                valid = valid && string_offset < data_length &&");
+                output_line(out, "                 contents_length <= data_length - string_offset;");
+                output_line(out, "            }");
+            }
+            output_line(out, "            break;");
+            output_line(out, "        }");
+            continue;
+        }
+        if (!gen->options.omit_ranges) {
+            output_line(out, "            uint64_t start = read_tree(&offset, tree);");
+            output_line(out, "            uint64_t length = read_tree(&offset, tree);");
+            output_line(out, "            valid = valid_text_range(string_length, start, length);");
+        }
+        if (rule->number_of_choices > 0) {
+            output_line(out, "            switch (read_tree(&offset, tree)) {");
+            for (uint32_t j = 0; j < rule->number_of_choices; ++j) {
+                set_substitution(out, "choice-name", rule->choices[j].name,
+                 rule->choices[j].name_length, UPPERCASE_WITH_UNDERSCORES);
+                output_line(out, "            case PARSED_%%choice-name:");
+            }
+            output_line(out, "                break;");
+            output_line(out, "            default:");
+            output_line(out, "                valid = false;");
+            output_line(out, "                break;");
+            output_line(out, "            }");
+        }
+        if (rule->number_of_slots > 0)
+            output_line(out, "            size_t slot;");
+        for (uint32_t j = 0; j < rule->number_of_slots; ++j) {
+            set_unsigned_number_substitution(out, "slot-rule-index",
+             rule->slots[j].rule_index);
+            output_line(out, "            slot = read_tree(&offset, tree);");
+            output_line(out, "            if (slot != 0)");
+            output_line(out, "                stack[top++] = (struct validate_tree_frame){ slot, %%slot-rule-index, false };");
+        }
+        output_line(out, "            break;");
+        output_line(out, "        }");
+    }
+    output_line(out, "        default:");
+    output_line(out, "            valid = false;");
+    output_line(out, "            break;");
+    output_line(out, "        }");
+    output_line(out, "    }");
+    output_line(out, "    free(visited);");
+    output_line(out, "    free(stack);");
+    output_line(out, "    return valid;");
+    output_line(out, "}");
+}
+
+static void generate_tokenize(struct generator_output *out)
+{
+    output_line(out, "// Reports the tokens in `text`, returning the offset where the last call to");
+    output_line(out, "// the tokenizer started.  Token ranges are relative to `base`.");
+    output_line(out, "static size_t report_tokens(struct owl_tree *tree, struct owl_default_tokenizer *tokenizer, size_t base, void (*callback)(void *context, const struct owl_token *token), void *context) {");
+    output_line(out, "    struct owl_token_run *run = 0;");
+    output_line(out, "    while (true) {");
+    output_line(out, "        size_t offset = tokenizer->offset - tokenizer->whitespace;");
+    output_line(out, "        if (!owl_default_tokenizer_advance(tokenizer, &run))");
+    output_line(out, "            return offset;");
+    output_line(out, "        uint16_t length_offset = 0;");
+    output_line(out, "        for (uint16_t i = 0; i < run->number_of_tokens; ++i) {");
+    output_line(out, "            uint32_t token = run->tokens[i];");
+    output_line(out, "            if (token == %%bracket-symbol-token)");
+    output_line(out, "                continue;");
+    output_line(out, "            size_t length = read_token_run_length(run, &length_offset);");
+    output_line(out, "            offset += read_token_run_length(run, &length_offset);");
+    output_line(out, "            struct owl_token t = {");
+    output_line(out, "                .token_class = TOKEN_CLASS_KEYWORD,");
+    output_line(out, "                .keyword = token,");
+    output_line(out, "                .range.start = base + offset,");
+    output_line(out, "                .range.end = base + offset + length,");
+    output_line(out, "            };");
+    output_line(out, "            if (token == %%identifier-token)");
+    output_line(out, "                t.token_class = TOKEN_CLASS_IDENTIFIER;");
+    output_line(out, "            else if (token == %%number-token)");
+    output_line(out, "                t.token_class = TOKEN_CLASS_NUMBER;");
+    output_line(out, "            else if (token == %%string-token)");
+    output_line(out, "                t.token_class = TOKEN_CLASS_STRING;");
+    output_line(out, "            if (t.token_class != TOKEN_CLASS_KEYWORD)");
+    output_line(out, "                t.keyword = 0;");
+    output_line(out, "            callback(context, &t);");
+    output_line(out, "            offset += length;");
+    output_line(out, "        }");
+    output_line(out, "        free(run);");
+    output_line(out, "        run = 0;");
+    output_line(out, "        // Unescaped strings are only needed while the run is being tokenized.");
+    output_line(out, "        tree->next_offset = %%first-tree-offset;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "size_t owl_tokenize(const char *text, size_t length, void (*callback)(void *context, const struct owl_token *token), void *context) {");
+    output_line(out, "    // The tokenizer stops at a null byte, so it reads from a terminated copy.");
+    output_line(out, "    char *string = malloc(length + 1);");
+    output_line(out, "    struct owl_tree *tree = owl_tree_create_empty();");
+    output_line(out, "    if (!string || !tree)");
+    output_line(out, "        abort();");
+    output_line(out, "    memcpy(string, text, length);");
+    output_line(out, "    string[length] = '\\0';");
+    output_line(out, "    tree->string = string;");
+    output_line(out, "    tree->tokens_only = true;");
+    output_line(out, "    tree->next_offset = %%first-tree-offset;");
+    output_line(out, "    struct owl_default_tokenizer tokenizer = {");
+    output_line(out, "        .text = string,");
+    output_line(out, "        .info = tree,");
+    output_line(out, "    };");
+    output_line(out, "    size_t run_start = report_tokens(tree, &tokenizer, 0, callback, context);");
+    output_line(out, "    size_t end = tokenizer.offset;");
+    output_line(out, "    if (end < length) {");
+    output_line(out, "        // The tokenizer drops the tokens it read in the same run as the invalid");
+    output_line(out, "        // token, so tokenize the text before it again on its own.");
+    output_line(out, "        string[end] = '\\0';");
+    output_line(out, "        struct owl_default_tokenizer retokenizer = {");
+    output_line(out, "            .text = string + run_start,");
+    output_line(out, "            .info = tree,");
+    output_line(out, "        };");
+    output_line(out, "        report_tokens(tree, &retokenizer, run_start, callback, context);");
+    output_line(out, "    }");
+    output_line(out, "    owl_tree_destroy(tree);");
+    output_line(out, "    free(string);");
+    output_line(out, "    return end;");
+    output_line(out, "}");
+}
+
+static void generate_identifier_interning(struct generator_output *out)
+{
+    output_line(out, "static uint64_t hash_identifier(const char *text, size_t length) {");
+    output_line(out, "    uint64_t hash = UINT64_C(0xcbf29ce484222325);");
+    output_line(out, "    for (size_t i = 0; i < length; ++i) {");
+    output_line(out, "        hash ^= (unsigned char)text[i];");
+    output_line(out, "        hash *= UINT64_C(0x100000001b3);");
+    output_line(out, "    }");
+    output_line(out, "    return hash;");
+    output_line(out, "}");
+    output_line(out, "// The table holds id + 1 for each identifier, with 0 marking empty slots.");
+    output_line(out, "static void grow_identifier_table(struct owl_tree *tree) {");
+    output_line(out, "    size_t size = tree->identifier_table_size ? tree->identifier_table_size * 2 : 256;");
+    output_line(out, "    uint32_t *table = calloc(size, sizeof(uint32_t));");
+    output_line(out, "    if (!table)");
+    output_line(out, "        abort();");
+    output_line(out, "    for (uint32_t id = 0; id < tree->number_of_identifiers; ++id) {");
+    output_line(out, "        struct interned_identifier *identifier = &tree->identifiers[id];");
+    output_line(out, "        size_t i = hash_identifier(tree->string + identifier->start,");
+    output_line(out, "         (size_t)identifier->length) & (size - 1);");
+    output_line(out, "        while (table[i])");
+    output_line(out, "            i = (i + 1) & (size - 1);");
+    output_line(out, "        table[i] = id + 1;");
+    output_line(out, "    }");
+    output_line(out, "    free(tree->identifier_table);");
+    output_line(out, "    tree->identifier_table = table;");
+    output_line(out, "    tree->identifier_table_size = size;");
+    output_line(out, "}");
+    output_line(out, "static uint32_t intern_identifier(struct owl_tree *tree, size_t offset, size_t length) {");
+    output_line(out, "    if ((size_t)tree->number_of_identifiers * 2 >= tree->identifier_table_size)");
+    output_line(out, "        grow_identifier_table(tree);");
+    output_line(out, "    const char *text = tree->string + offset;");
+    output_line(out, "    size_t mask = tree->identifier_table_size - 1;");
+    output_line(out, "    size_t i = hash_identifier(text, length) & mask;");
+    output_line(out, "    while (tree->identifier_table[i]) {");
+    output_line(out, "        uint32_t id = tree->identifier_table[i] - 1;");
+    output_line(out, "        struct interned_identifier *identifier = &tree->identifiers[id];");
+    output_line(out, "        if (identifier->length == length &&");
+    output_line(out, "         !memcmp(tree->string + identifier->start, text, length))");
+    output_line(out, "            return id;");
+    output_line(out, "        i = (i + 1) & mask;");
+    output_line(out, "    }");
+    output_line(out, "    if (tree->number_of_identifiers >= tree->identifiers_capacity) {");
+    output_line(out, "        if (tree->identifiers_capacity > UINT32_MAX / 2)");
+    output_line(out, "            abort();");
+    output_line(out, "        uint32_t capacity = tree->identifiers_capacity ? tree->identifiers_capacity * 2 : 64;");
+    output_line(out, "        struct interned_identifier *identifiers = realloc(tree->identifiers,");
+    output_line(out, "         capacity * sizeof(struct interned_identifier));");
+    output_line(out, "        if (!identifiers)");
+    output_line(out, "            abort();");
+    output_line(out, "        tree->identifiers = identifiers;");
+    output_line(out, "        tree->identifiers_capacity = capacity;");
+    output_line(out, "    }");
+    output_line(out, "    uint32_t id = tree->number_of_identifiers++;");
+    output_line(out, "    tree->identifiers[id] = (struct interned_identifier){");
+    output_line(out, "        .start = offset,");
+    output_line(out, "        .length = length,");
+    output_line(out, "    };");
+    output_line(out, "    tree->identifier_table[i] = id + 1;");
+    output_line(out, "    return id;");
+    output_line(out, "}");
+}
+
+// Nodes are written bottom-up, so a node's children and next sibling have
+// already been shared by the time it's finished.  Two nodes are the same if
+// they have the same rule, next sibling, and remaining bytes.  Tokens are
+// compared by their text instead, since each token has its own data.
+static void generate_subtree_sharing(struct generator *gen,
+ struct generator_output *out)
+{
+    output_line(out, "static uint64_t hash_shared_node(uint32_t rule, size_t next_sibling, const uint8_t *bytes, size_t length) {");
+    output_line(out, "    uint64_t hash = UINT64_C(0xcbf29ce484222325);");
+    output_line(out, "    uint64_t words[2] = { rule, next_sibling };");
+    output_line(out, "    const uint8_t *w = (const uint8_t *)words;");
+    output_line(out, "    for (size_t i = 0; i < sizeof(words); ++i) {");
+    output_line(out, "        hash ^= w[i];");
+    output_line(out, "        hash *= UINT64_C(0x100000001b3);");
+    output_line(out, "    }");
+    output_line(out, "    for (size_t i = 0; i < length; ++i) {");
+    output_line(out, "        hash ^= bytes[i];");
+    output_line(out, "        hash *= UINT64_C(0x100000001b3);");
+    output_line(out, "    }");
+    output_line(out, "    return hash;");
+    output_line(out, "}");
+    output_line(out, "// Returns the bytes a node is compared by and their length, and stores the");
+    output_line(out, "// node's next sibling.  (A node's bytes run to the end of the tree, so the");
+    output_line(out, "// length is only right for the last node written.)");
+    output_line(out, "static const uint8_t *shared_node_key(struct owl_tree *tree, size_t offset, bool is_token, size_t *next_sibling, size_t *length) {");
+    output_line(out, "    size_t o = offset;");
+    output_line(out, "    size_t delta = read_tree(&o, tree);");
+    output_line(out, "    *next_sibling = delta ? offset - delta : 0;");
+    output_line(out, "    if (is_token) {");
+    output_line(out, "        size_t token_offset = read_tree(&o, tree);");
+    output_line(out, "        read_tree(&token_offset, tree);");
+    output_line(out, "        size_t start = read_tree(&token_offset, tree);");
+    output_line(out, "        *length = read_tree(&token_offset, tree);");
+    output_line(out, "        return (const uint8_t *)tree->string + start;");
+    output_line(out, "    }");
+    output_line(out, "    *length = tree->next_offset - o;");
+    if (gen->options.segmented_tree)
+        output_line(out, "    return tree_bytes(tree, o);");
+    else
+        output_line(out, "    return tree->parse_tree + o;");
+    output_line(out, "}");
+    output_line(out, "static void grow_shared_nodes(struct owl_tree *tree) {");
+    output_line(out, "    size_t size = tree->shared_nodes_size ? tree->shared_nodes_size * 2 : 256;");
+    output_line(out, "    struct shared_node *table = calloc(size, sizeof(struct shared_node));");
+    output_line(out, "    if (!table)");
+    output_line(out, "        abort();");
+    output_line(out, "    for (size_t j = 0; j < tree->shared_nodes_size; ++j) {");
+    output_line(out, "        struct shared_node node = tree->shared_nodes[j];");
+    output_line(out, "        if (!node.offset)");
+    output_line(out, "            continue;");
+    output_line(out, "        size_t i = node.hash & (size - 1);");
+    output_line(out, "        while (table[i].offset)");
+    output_line(out, "            i = (i + 1) & (size - 1);");
+    output_line(out, "        table[i] = node;");
+    output_line(out, "    }");
+    output_line(out, "    free(tree->shared_nodes);");
+    output_line(out, "    tree->shared_nodes = table;");
+    output_line(out, "    tree->shared_nodes_size = size;");
+    output_line(out, "}");
+    output_line(out, "// Called with a node that was just written at the end of the tree.  If an");
+    output_line(out, "// identical node was written earlier, this removes the new one and returns");
+    output_line(out, "// the old one's offset.");
+    output_line(out, "static size_t share_node(struct owl_tree *tree, uint32_t rule, size_t offset, bool is_token) {");
+    output_line(out, "    size_t next_sibling;");
+    output_line(out, "    size_t length;");
+    output_line(out, "    const uint8_t *key = shared_node_key(tree, offset, is_token, &next_sibling, &length);");
+    output_line(out, "    uint64_t hash = hash_shared_node(rule, next_sibling, key, length);");
+    output_line(out, "    if (tree->number_of_shared_nodes * 2 >= tree->shared_nodes_size)");
+    output_line(out, "        grow_shared_nodes(tree);");
+    output_line(out, "    size_t mask = tree->shared_nodes_size - 1;");
+    output_line(out, "    size_t i = hash & mask;");
+    output_line(out, "    while (tree->shared_nodes[i].offset) {");
+    output_line(out, "        struct shared_node *node = &tree->shared_nodes[i];");
+    output_line(out, "        if (node->hash == hash && node->rule == rule && node->length == length) {");
+    output_line(out, "            size_t other_sibling;");
+    output_line(out, "            size_t other_length;");
+    output_line(out, "            const uint8_t *other = shared_node_key(tree, node->offset, is_token, &other_sibling, &other_length);");
+    output_line(out, "            if (other_sibling == next_sibling && !memcmp(other, key, length)) {");
+    output_line(out, "                tree->next_offset = offset;");
+    output_line(out, "                return node->offset;");
+    output_line(out, "            }");
+    output_line(out, "        }");
+    output_line(out, "        i = (i + 1) & mask;");
+    output_line(out, "    }");
+    output_line(out, "    tree->shared_nodes[i] = (struct shared_node){");
+    output_line(out, "        .offset = offset,");
+    output_line(out, "        .hash = hash,");
+    output_line(out, "        .rule = rule,");
+    output_line(out, "        .length = length,");
+    output_line(out, "    };");
+    output_line(out, "    tree->number_of_shared_nodes++;");
+    output_line(out, "    return offset;");
+    output_line(out, "}");
+}
+
+// Each node's hash is stored after its fields.  A field's hash covers every
+// match in it, so the hash of a list depends on its order.  Tokens aren't
+// stored with a hash; theirs is computed from their text.
+static void generate_subtree_hashes(struct generator *gen,
+ struct generator_output *out)
+{
+    uint32_t n = gen->grammar->number_of_rules;
+    output_line(out, "static uint64_t hash_word(uint64_t hash, uint64_t word) {");
+    output_line(out, "    for (int i = 0; i < 8; ++i) {");
+    output_line(out, "        hash ^= (word >> (8 * i)) & 0xff;");
+    output_line(out, "        hash *= UINT64_C(0x100000001b3);");
+    output_line(out, "    }");
+    output_line(out, "    return hash;");
+    output_line(out, "}");
+    output_line(out, "static uint64_t read_match_hash(struct owl_tree *tree, size_t offset, uint32_t rule) {");
+    output_line(out, "    uint64_t hash = hash_word(UINT64_C(0xcbf29ce484222325), rule);");
+    output_line(out, "    int entries = 0;");
+    output_line(out, "    switch (rule) {");
+    bool has_tokens = false;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (!gen->grammar->rules[i].is_token)
+            continue;
+        set_unsigned_number_substitution(out, "rule-index", i);
+        output_line(out, "    case %%rule-index:");
+        has_tokens = true;
+    }
+    if (has_tokens) {
+        output_line(out, "    {");
+        output_line(out, "        read_tree(&offset, tree);");
+        output_line(out, "        offset = read_tree(&offset, tree);");
+        output_line(out, "        read_tree(&offset, tree);");
+        output_line(out, "        size_t start = read_tree(&offset, tree);");
+        output_line(out, "        size_t length = read_tree(&offset, tree);");
+        output_line(out, "        for (size_t i = 0; i < length; ++i) {");
+        output_line(out, "            hash ^= (unsigned char)tree->string[start + i];");
+        output_line(out, "            hash *= UINT64_C(0x100000001b3);");
+        output_line(out, "        }");
+        output_line(out, "        return hash;");
+        output_line(out, "    }");
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        if (rule->is_token)
+            continue;
+        set_unsigned_number_substitution(out, "rule-index", i);
+        output_line(out, "    case %%rule-index:");
+        uint32_t entries = 1 + (gen->options.omit_ranges ? 0 : 2) +
+         (rule->number_of_choices > 0 ? 1 : 0) + rule->number_of_slots;
+        set_unsigned_number_substitution(out, "entries", entries);
+        output_line(out, "        entries = %%entries;");
+        output_line(out, "        break;");
+    }
+    output_line(out, "    default:");
+    output_line(out, "        return 0;");
+    output_line(out, "    }");
+    output_line(out, "    for (int i = 0; i < entries; ++i)");
+    output_line(out, "        read_tree(&offset, tree);");
+    output_line(out, "    return read_tree(&offset, tree);");
+    output_line(out, "}");
+    output_line(out, "static uint64_t hash_field(struct owl_tree *tree, uint64_t hash, size_t offset, uint32_t rule) {");
+    output_line(out, "    while (offset != 0) {");
+    output_line(out, "        hash = hash_word(hash, read_match_hash(tree, offset, rule));");
+    output_line(out, "        size_t o = offset;");
+    output_line(out, "        size_t delta = read_tree(&o, tree);");
+    output_line(out, "        if (delta == 0)");
+    output_line(out, "            break;");
+    output_line(out, "        offset = tree->preorder ? offset + delta : offset - delta;");
+    output_line(out, "    }");
+    output_line(out, "    // Separate this field from the next one.");
+    output_line(out, "    return hash_word(hash, 0);");
+    output_line(out, "}");
+    output_line(out, "// `type` is the node's parsed_type, or zero if its rule has no options.");
+    output_line(out, "static uint64_t hash_node(struct owl_tree *tree, uint32_t rule, uint64_t type, size_t *slots) {");
+    output_line(out, "    uint64_t hash = hash_word(hash_word(UINT64_C(0xcbf29ce484222325), rule), type);");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        if (rule->is_token || rule->number_of_slots == 0)
+            continue;
+        set_unsigned_number_substitution(out, "rule-index", i);
+        output_line(out, "    case %%rule-index:");
+        for (uint32_t j = 0; j < rule->number_of_slots; ++j) {
+            set_unsigned_number_substitution(out, "slot-index", j);
+            set_unsigned_number_substitution(out, "slot-rule-index",
+             rule->slots[j].rule_index);
+            output_line(out, "        hash = hash_field(tree, hash, slots[%%slot-index], %%slot-rule-index);");
+        }
+        output_line(out, "        break;");
+    }
+    output_line(out, "    default:");
+    output_line(out, "        break;");
+    output_line(out, "    }");
+    output_line(out, "    return hash;");
+    output_line(out, "}");
+    output_line(out, "uint64_t owl_ref_hash(struct owl_ref ref) {");
+    output_line(out, "    if (ref.empty)");
+    output_line(out, "        return 0;");
+    output_line(out, "    return read_match_hash(%%ref-tree, ref._offset, ref._type);");
+    output_line(out, "}");
+}
+
+// Compact ranges can't hold offsets past 4 GB, so longer strings are rejected
+// before they're tokenized.  memchr stops at the first match, so this reads no
+// further than the end of the string.
+static void generate_string_length_check(struct generator_output *out)
+{
+    output_line(out, "    if (SIZE_MAX > UINT32_MAX && !memchr(string, '\\0', (size_t)UINT32_MAX + 1)) {");
+    output_line(out, "        tree->error = ERROR_INPUT_TOO_LARGE;");
+    output_line(out, "        tree->error_range.start = 0;");
+    output_line(out, "        tree->error_range.end = 0;");
+    output_line(out, "        return;");
+    output_line(out, "    }");
+}
+
+static void generate_parse_string(struct generator *gen,
+ struct generator_output *out)
+{
+    output_line(out, "static void parse_string(struct owl_tree *tree, const char *string) {");
+    output_line(out, "    tree->string = string;");
+    if (gen->options.compact_refs)
+        generate_string_length_check(out);
+    output_line(out, "    tree->next_offset = %%first-tree-offset;");
+    output_line(out, "    struct owl_default_tokenizer tokenizer = {");
+    output_line(out, "        .text = string,");
+    output_line(out, "        .info = tree,");
+    output_line(out, "    };");
+    output_line(out, "    struct owl_token_run *token_run = 0;");
+    output_line(out, "    struct fill_run_continuation c = {");
+    output_line(out, "        .capacity = 8,");
+    output_line(out, "        .top_index = 0,");
+    output_line(out, "    };");
+    output_line(out, "    c.stack = calloc(c.capacity, sizeof(struct fill_run_state));");
+    output_line(out, "    c.stack[0].state = %%initial-state;");
+    output_line(out, "    c.stack[0].cont = &c;");
+    if (gen->options.parse_limits)
+        output_line(out, "    c.max_depth = max_nesting_depth(tree);");
+    output_line(out, "    uint16_t failing_index = 0;");
+    output_line(out, "    while (owl_default_tokenizer_advance(&tokenizer, &token_run)) {");
+    output_line(out, "        if (!fill_run_states(token_run, &c, &failing_index)) {");
+    output_line(out, "            free(c.stack);");
+    if (gen->options.parse_limits)
+        output_line(out, "            tree->error = c.error == 2 ? ERROR_LIMIT_EXCEEDED : ERROR_UNEXPECTED_TOKEN;");
+    else
+        output_line(out, "            tree->error = ERROR_UNEXPECTED_TOKEN;");
+    output_line(out, "            find_token_range(&tokenizer, token_run, failing_index, &tree->error_range.start, &tree->error_range.end);");
+    output_line(out, "            free_token_runs(&token_run);");
+    output_line(out, "            return;");
+    output_line(out, "        }");
+    output_line(out, "    }");
+    output_line(out, "    struct fill_run_state top = c.stack[c.top_index];");
+    output_line(out, "    free(c.stack);");
+    if (gen->options.parse_limits) {
+        output_line(out, "    // The tokenizer stops early if it goes over a limit.");
+        output_line(out, "    if (tree->error) {");
+        output_line(out, "        free_token_runs(&token_run);");
+        output_line(out, "        return;");
+        output_line(out, "    }");
+    }
+    output_line(out, "    if (string[tokenizer.offset] != '\\0') {");
+    output_line(out, "        tree->error = ERROR_INVALID_TOKEN;");
+    output_line(out, "        estimate_next_token_range(&tokenizer, &tree->error_range.start, &tree->error_range.end);");
+    output_line(out, "        free_token_runs(&token_run);");
+    output_line(out, "        return;");
+    output_line(out, "    }");
+    generate_parse_result(gen, out);
+}
+
+// Checks that parsing ended in an accepting state and builds the tree.  This
+// finishes the function started by generate_parse_string.
+static void generate_parse_result(struct generator *gen,
+ struct generator_output *out)
+{
+    output_line(out, "    switch (top.state) {");
+    for (state_id i = 0; i < gen->deterministic->automaton.number_of_states; ++i) {
+        if (!gen->deterministic->automaton.states[i].accepting)
+            continue;
+        set_unsigned_number_substitution(out, "state-id", i);
+        output_line(out, "    case %%state-id:");
+    }
+    output_line(out, "        break;");
+    output_line(out, "    default:");
+    output_line(out, "        tree->error = ERROR_MORE_INPUT_NEEDED;");
+    output_line(out, "        find_end_range(&tokenizer, &tree->error_range.start, &tree->error_range.end);");
+    output_line(out, "        free_token_runs(&token_run);");
+    output_line(out, "        return;");
+    output_line(out, "    }");
+    /*
+    output_line(out, "    struct owl_token_run *run_to_print = token_run;");
+    output_line(out, "    while (run_to_print) {");
+    output_line(out, "        for (uint32_t i = 0; i < run_to_print->number_of_tokens; ++i) {");
+    output_line(out, "            printf(\"%u -> %u\\n\", run_to_print->tokens[i], run_to_print->states[i]);");
+    output_line(out, "        }");
+    output_line(out, "        printf(\"--\\n\");");
+    output_line(out, "        run_to_print = run_to_print->prev;");
+    output_line(out, "    }");
+     */
+    output_line(out, "    tree->root_offset = build_parse_tree(&tokenizer, token_run, tree);");
+    if (builder_can_stop(gen)) {
+        output_line(out, "    if (tree->error)");
+        output_line(out, "        return;");
+    }
+    if (gen->options.compact_refs) {
+        output_line(out, "    if (tree->next_offset > UINT32_MAX) {");
+        output_line(out, "        tree->error = ERROR_INPUT_TOO_LARGE;");
+        output_line(out, "        tree->error_range.start = 0;");
+        output_line(out, "        tree->error_range.end = 0;");
+        output_line(out, "    }");
+    }
+    output_line(out, "}");
+}
+
+// Parsing from an array of tokens fills the same token runs the built-in
+// tokenizer would, so the rest of the parser doesn't need to know where the
+// tokens came from.
+static void generate_parse_tokens(struct generator *gen,
+ struct generator_output *out)
+{
+    struct combined_grammar *combined = gen->combined;
+    set_unsigned_number_substitution(out, "number-of-keyword-tokens",
+     combined->number_of_keyword_tokens);
+    set_unsigned_number_substitution(out, "token-run-length",
+     TOKEN_RUN_LENGTH);
+    output_line(out, "static bool keyword_ends_bracket(uint32_t token) {");
+    output_line(out, "    switch (token) {");
+    bool any_end_tokens = false;
+    for (uint32_t i = 0; i < combined->number_of_keyword_tokens; ++i) {
+        if (combined->tokens[i].type != TOKEN_END)
+            continue;
+        set_unsigned_number_substitution(out, "token-index", i);
+        output_line(out, "    case %%token-index:");
+        any_end_tokens = true;
     }
-    output_line(out, "    default: return 0;");
+    if (any_end_tokens)
+        output_line(out, "        return true;");
+    output_line(out, "    default:");
+    output_line(out, "        return false;");
     output_line(out, "    }");
     output_line(out, "}");
-    output_line(out, "static void left_right_operand_slots_lookup(uint32_t rule, uint32_t *left, uint32_t *right, uint32_t *operand, void *context) {");
-    output_line(out, "    switch (rule) {");
-    for (uint32_t i = 0; i < gen->grammar->number_of_rules; ++i) {
-        struct rule *rule = &gen->grammar->rules[i];
-        set_unsigned_number_substitution(out, "rule-index", i);
-        set_unsigned_number_substitution(out, "left-slot",
-         rule->left_slot_index);
-        set_unsigned_number_substitution(out, "right-slot",
-         rule->right_slot_index);
-        set_unsigned_number_substitution(out, "operand-slot",
-         rule->operand_slot_index);
-        output_line(out, "    case %%rule-index:");
-        output_line(out, "        *left = %%left-slot;");
-        output_line(out, "        *right = %%right-slot;");
-        output_line(out, "        *operand = %%operand-slot;");
-        output_line(out, "        break;");
-    }
+    output_line(out, "uint32_t owl_keyword_number(const char *text, size_t length) {");
+    output_line(out, "    // The keyword reader looks past the end of a keyword to find longer ones.");
+    output_line(out, "    char *keyword = malloc(length + 1);");
+    output_line(out, "    if (!keyword)");
+    output_line(out, "        abort();");
+    output_line(out, "    memcpy(keyword, text, length);");
+    output_line(out, "    keyword[length] = '\\0';");
+    output_line(out, "    %%token-type token = 0;");
+    output_line(out, "    bool end_token = false;");
+    output_line(out, "    size_t keyword_length = read_keyword_token(&token, &end_token, keyword, 0);");
+    output_line(out, "    free(keyword);");
+    output_line(out, "    if (keyword_length == 0 || keyword_length != length || token == %%comment-token)");
+    output_line(out, "        return UINT32_MAX;");
+    output_line(out, "    return token;");
+    output_line(out, "}");
+    output_line(out, "struct input_token_array {");
+    output_line(out, "    const struct owl_input_token *tokens;");
+    output_line(out, "    size_t number_of_tokens;");
+    output_line(out, "    // The next token to read.  If reading stops before the last token, this");
+    output_line(out, "    // is the token which couldn't be read.");
+    output_line(out, "    size_t index;");
+    output_line(out, "};");
+    output_line(out, "static %%token-type input_token_id(const struct owl_input_token *t) {");
+    output_line(out, "    switch (t->token_class) {");
+    output_line(out, "    case TOKEN_CLASS_KEYWORD:");
+    output_line(out, "        return t->keyword < %%number-of-keyword-tokens ? t->keyword : UINT32_MAX;");
+    output_line(out, "    case TOKEN_CLASS_IDENTIFIER:");
+    output_line(out, "        return %%identifier-token;");
+    output_line(out, "    case TOKEN_CLASS_NUMBER:");
+    output_line(out, "        return %%number-token;");
+    output_line(out, "    case TOKEN_CLASS_STRING:");
+    output_line(out, "        return %%string-token;");
+    output_line(out, "    default:");
+    output_line(out, "        return UINT32_MAX;");
     output_line(out, "    }");
     output_line(out, "}");
-    output_line(out, "#endif");
-    output_line(out, "");
-    output_destroy(out);
+    output_line(out, "// Fills a run from the token array, like owl_default_tokenizer_advance().  The");
+    output_line(out, "// tokenizer's offset is set to the end of the last token read.");
+    output_line(out, "static bool read_input_tokens(struct owl_default_tokenizer *tokenizer, struct input_token_array *input, struct owl_token_run **previous_run) {");
+    output_line(out, "    if (input->index >= input->number_of_tokens)");
+    output_line(out, "        return false;");
+    output_line(out, "    struct owl_token_run *run = malloc(sizeof(struct owl_token_run));");
+    output_line(out, "    if (!run)");
+    output_line(out, "        abort();");
+    output_line(out, "    uint16_t number_of_tokens = 0;");
+    output_line(out, "    uint16_t lengths_size = 0;");
+    output_line(out, "    size_t offset = tokenizer->offset;");
+    output_line(out, "    while (number_of_tokens < %%token-run-length && input->index < input->number_of_tokens) {");
+    output_line(out, "        const struct owl_input_token *t = &input->tokens[input->index];");
+    output_line(out, "        %%token-type token = input_token_id(t);");
+    output_line(out, "        if (token == UINT32_MAX || t->range.start < offset || t->range.end < t->range.start)");
+    output_line(out, "            break;");
+    output_line(out, "        size_t length = t->range.end - t->range.start;");
+    output_line(out, "        if (token == %%string-token && !t->string && length < 2)");
+    output_line(out, "            break;");
+    output_line(out, "        bool end_token = keyword_ends_bracket(token);");
+    output_line(out, "        if (end_token && number_of_tokens + 1 >= %%token-run-length)");
+    output_line(out, "            break;");
+    output_line(out, "        if (!encode_token_length(run, &lengths_size, length, t->range.start - offset))");
+    output_line(out, "            break;");
+    output_line(out, "        if (token == %%identifier-token) {");
+    output_line(out, "            %%write-identifier-token(t->range.start, length, tokenizer->info);");
+    output_line(out, "        } else if (token == %%number-token) {");
+    output_line(out, "            %%write-number-token(t->range.start, length, t->number, tokenizer->info);");
+    output_line(out, "        } else if (token == %%string-token) {");
+    output_line(out, "            if (t->string) {");
+    output_line(out, "                char *string = allocate_string_contents(t->string_length, tokenizer->info);");
+    output_line(out, "                memcpy(string, t->string, t->string_length);");
+    output_line(out, "                %%write-string-token(t->range.start, length, string, t->string_length, true, tokenizer->info);");
+    output_line(out, "            } else");
+    output_line(out, "                %%write-string-token(t->range.start, length, tokenizer->text + t->range.start + 1, length - 2, false, tokenizer->info);");
+    output_line(out, "        }");
+    output_line(out, "        run->tokens[number_of_tokens++] = token;");
+    output_line(out, "        offset = t->range.end;");
+    output_line(out, "        input->index++;");
+    output_line(out, "        if (end_token)");
+    output_line(out, "            run->tokens[number_of_tokens++] = %%bracket-symbol-token;");
+    output_line(out, "    }");
+    output_line(out, "    if (number_of_tokens == 0) {");
+    output_line(out, "        free(run);");
+    output_line(out, "        return false;");
+    output_line(out, "    }");
+    output_line(out, "    tokenizer->offset = offset;");
+    output_line(out, "    tokenizer->whitespace = 0;");
+    output_line(out, "    run->prev = *previous_run;");
+    output_line(out, "    run->number_of_tokens = number_of_tokens;");
+    output_line(out, "    run->lengths_size = lengths_size;");
+    output_line(out, "    *previous_run = run;");
+    output_line(out, "    return true;");
+    output_line(out, "}");
+    output_line(out, "static void parse_tokens(struct owl_tree *tree, const struct owl_input_token *tokens, size_t n, const char *text) {");
+    output_line(out, "    tree->string = text;");
+    output_line(out, "    tree->next_offset = %%first-tree-offset;");
+    output_line(out, "    // The tokenizer isn't used to read tokens, but finding ranges and building");
+    output_line(out, "    // the tree both start from its position.");
+    output_line(out, "    struct owl_default_tokenizer tokenizer = {");
+    output_line(out, "        .text = text,");
+    output_line(out, "        .info = tree,");
+    output_line(out, "    };");
+    output_line(out, "    struct input_token_array input = {");
+    output_line(out, "        .tokens = tokens,");
+    output_line(out, "        .number_of_tokens = n,");
+    output_line(out, "    };");
+    output_line(out, "    struct owl_token_run *token_run = 0;");
+    output_line(out, "    struct fill_run_continuation c = {");
+    output_line(out, "        .capacity = 8,");
+    output_line(out, "        .top_index = 0,");
+    output_line(out, "    };");
+    output_line(out, "    c.stack = calloc(c.capacity, sizeof(struct fill_run_state));");
+    output_line(out, "    c.stack[0].state = %%initial-state;");
+    output_line(out, "    c.stack[0].cont = &c;");
+    output_line(out, "    uint16_t failing_index = 0;");
+    if (gen->options.parse_limits)
+        output_line(out, "    c.max_depth = max_nesting_depth(tree);");
+    output_line(out, "    while (read_input_tokens(&tokenizer, &input, &token_run)) {");
+    output_line(out, "        if (!fill_run_states(token_run, &c, &failing_index)) {");
+    output_line(out, "            free(c.stack);");
+    if (gen->options.parse_limits)
+        output_line(out, "            tree->error = c.error == 2 ? ERROR_LIMIT_EXCEEDED : ERROR_UNEXPECTED_TOKEN;");
+    else
+        output_line(out, "            tree->error = ERROR_UNEXPECTED_TOKEN;");
+    output_line(out, "            find_token_range(&tokenizer, token_run, failing_index, &tree->error_range.start, &tree->error_range.end);");
+    output_line(out, "            free_token_runs(&token_run);");
+    output_line(out, "            return;");
+    output_line(out, "        }");
+    output_line(out, "    }");
+    output_line(out, "    struct fill_run_state top = c.stack[c.top_index];");
+    output_line(out, "    free(c.stack);");
+    output_line(out, "    if (input.index < n) {");
+    output_line(out, "        tree->error = ERROR_INVALID_TOKEN;");
+    output_line(out, "        tree->error_range.start = tokens[input.index].range.start;");
+    output_line(out, "        tree->error_range.end = tokens[input.index].range.end;");
+    output_line(out, "        free_token_runs(&token_run);");
+    output_line(out, "        return;");
+    output_line(out, "    }");
+    generate_parse_result(gen, out);
+    output_line(out, "struct owl_tree *owl_tree_create_from_tokens(const struct owl_input_token *tokens, size_t n, const char *text) {");
+    output_line(out, "    struct owl_tree *tree = owl_tree_create_empty();");
+    output_line(out, "    parse_tokens(tree, tokens, n, text);");
+    output_line(out, "    return tree;");
+    output_line(out, "}");
 }
 
-static void generate_fields_for_token_rule(struct generator_output *out,
- struct rule *rule, const char *string)
+// Each entry point starts the automaton in the state following its entry token
+// (the root rule's entry point starts in the start state).
+static void generate_entry_points(struct generator *gen,
+ struct generator_output *out)
 {
-    if (rule_is_named(rule, "identifier")) {
-        set_literal_substitution(out, "type", "const char *");
-        set_literal_substitution(out, "field", "identifier");
-        output_string(out, string);
-        set_literal_substitution(out, "type", "size_t ");
-        set_literal_substitution(out, "field", "length");
-        output_string(out, string);
-    } else if (rule_is_named(rule, "number")) {
-        set_literal_substitution(out, "type", "double ");
-        set_literal_substitution(out, "field", "number");
-        output_string(out, string);
-    } else if (rule_is_named(rule, "string")) {
-        set_literal_substitution(out, "type", "const char *");
-        set_literal_substitution(out, "field", "string");
-        output_string(out, string);
-        set_literal_substitution(out, "type", "size_t ");
-        set_literal_substitution(out, "field", "length");
-        output_string(out, string);
-    } else
-        abort();
+    struct automaton *a = &gen->deterministic->automaton;
+    output_line(out, "struct entry_point {");
+    output_line(out, "    uint32_t rule;");
+    output_line(out, "    const char *name;");
+    output_line(out, "    // UINT32_MAX for the root rule, which doesn't have an entry token.");
+    output_line(out, "    %%token-type token;");
+    output_line(out, "    %%state-type state;");
+    output_line(out, "    bool expression;");
+    output_line(out, "};");
+    output_line(out, "static const struct entry_point entry_points[] = {");
+    for (uint32_t i = 0; i <= gen->grammar->number_of_entry_rules; ++i) {
+        uint32_t rule_index = gen->grammar->root_rule;
+        symbol_id token = UINT32_MAX;
+        state_id state = a->start_state;
+        if (i > 0) {
+            rule_index = gen->grammar->entry_rules[i - 1];
+            token = gen->combined->first_entry_token + i - 1;
+            struct state start = a->states[a->start_state];
+            for (uint32_t j = 0; j < start.number_of_transitions; ++j) {
+                if (start.transitions[j].symbol == token)
+                    state = start.transitions[j].target;
+            }
+        }
+        struct rule *rule = &gen->grammar->rules[rule_index];
+        set_unsigned_number_substitution(out, "rule-index", rule_index);
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        set_unsigned_number_substitution(out, "entry-token", token);
+        set_unsigned_number_substitution(out, "entry-state", state);
+        if (rule->number_of_choices > rule->first_operator_choice)
+            set_literal_substitution(out, "expression", "true");
+        else
+            set_literal_substitution(out, "expression", "false");
+        output_line(out, "    { %%rule-index, \"%%rule\", %%entry-token, %%entry-state, %%expression },");
+    }
+    output_line(out, "};");
+    output_line(out, "static const struct entry_point *entry_point_for_rule(uint32_t rule) {");
+    output_line(out, "    for (size_t i = 0; i < sizeof(entry_points) / sizeof(entry_points[0]); ++i) {");
+    output_line(out, "        if (entry_points[i].rule == rule)");
+    output_line(out, "            return &entry_points[i];");
+    output_line(out, "    }");
+    output_line(out, "    return 0;");
+    output_line(out, "}");
 }
 
 struct generated_token {
@@ -1261,33 +4991,6 @@ static void generate_keyword_reader(struct generator *gen,
     output_line(out, "}");
 }
 
-static void generate_reachability_mask_check(struct generator *gen,
- struct generator_output *out, struct bitset *r)
-{
-    uint32_t mask_width = reachability_mask_width(gen);
-    if (mask_width == 0)
-        return;
-    // Check if any of the end states we're expecting are still
-    // reachable.
-    output_string(out, "    if (");
-    for (uint32_t i = 0; i < mask_width; ++i) {
-        if (i > 0)
-            output_string(out, " && ");
-        set_unsigned_number_substitution(out, "mask-index", i);
-        uint64_t bits = r->bit_groups[i / 2];
-        if (i % 2)
-            bits >>= 32;
-        else
-            bits &= UINT32_MAX;
-        set_unsigned_number_substitution(out, "mask-bits", (uint32_t)bits);
-        output_string(out, "!(%%mask-bits & top->reachability_mask[%%mask-index])");
-    }
-    output_line(out, ") {");
-    output_line(out, "        top->cont->error = -1;");
-    output_line(out, "        return;");
-    output_line(out, "    }");
-}
-
 struct action_table_bucket_group {
     uint32_t index;
     uint32_t length;
@@ -1421,6 +5124,160 @@ static void decode_bit_range(struct generator_output *out, struct bit_range r,
     }
 }
 
+static bool rule_is_lazy(struct generator *gen, uint32_t rule_index)
+{
+    for (uint32_t i = 0; i < gen->grammar->number_of_lazy_rules; ++i) {
+        if (gen->grammar->lazy_rules[i] == rule_index)
+            return true;
+    }
+    return false;
+}
+
+static void generate_build_cursor(struct generator_output *out)
+{
+    output_line(out, "// A position in the token runs as the tree is built back to front.");
+    output_line(out, "struct build_cursor {");
+    output_line(out, "    struct owl_token_run *run;");
+    output_line(out, "    uint16_t tokens_left;");
+    output_line(out, "    uint16_t length_offset;");
+    output_line(out, "    size_t offset;");
+    output_line(out, "    size_t whitespace;");
+    output_line(out, "    uint32_t nfa_state;");
+    output_line(out, "};");
+}
+
+// Lazy matches are skipped over while the tree is built, leaving room for
+// their fields.  Reading one builds it from the saved cursor and fills the
+// fields in.
+static void generate_lazy_matches(struct generator *gen,
+ struct generator_output *out)
+{
+    uint32_t n = gen->grammar->number_of_rules;
+    output_line(out, "static void build_from_tokens(struct owl_tree *tree, struct construct_state *construct_state, struct build_cursor *c, bool in_bracket);");
+    output_line(out, "static bool is_lazy_rule(uint32_t rule) {");
+    output_line(out, "    switch (rule) {");
+    for (uint32_t i = 0; i < gen->grammar->number_of_lazy_rules; ++i) {
+        set_unsigned_number_substitution(out, "rule-index",
+         gen->grammar->lazy_rules[i]);
+        output_line(out, "    case %%rule-index:");
+    }
+    output_line(out, "        return true;");
+    output_line(out, "    default:");
+    output_line(out, "        return false;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "// Moves past the data the tokenizer wrote for a token inside a lazy match.");
+    output_line(out, "static void skip_token_data(struct owl_tree *tree, uint32_t token) {");
+    output_line(out, "    switch (token) {");
+    for (uint32_t i = gen->combined->number_of_keyword_tokens;
+     i < gen->combined->number_of_tokens; ++i) {
+        struct token *token = &gen->combined->tokens[i];
+        for (uint32_t j = 0; j < n; ++j) {
+            struct rule *rule = &gen->grammar->rules[j];
+            if (!rule->is_token || rule->name_length != token->length ||
+             memcmp(rule->name, token->string, token->length))
+                continue;
+            set_unsigned_number_substitution(out, "token-index", i);
+            set_unsigned_number_substitution(out, "rule-index", j);
+            output_line(out, "    case %%token-index:");
+            output_line(out, "        skip_token(%%rule-index, tree);");
+            output_line(out, "        break;");
+        }
+    }
+    output_line(out, "    default:");
+    output_line(out, "        break;");
+    output_line(out, "    }");
+    output_line(out, "}");
+    output_line(out, "// Called after a bracket symbol.  If it's the bracket of a lazy match, this");
+    output_line(out, "// saves the cursor so the match can be built later.");
+    output_line(out, "static bool begin_lazy_match(struct owl_tree *tree, struct construct_state *s, const struct build_cursor *c) {");
+    output_line(out, "    if (s->skipped_depth > 0 || !s->under_construction ||");
+    output_line(out, "     !is_lazy_rule(s->under_construction->rule))");
+    output_line(out, "        return false;");
+    output_line(out, "    if (tree->number_of_lazy_matches >= tree->lazy_matches_capacity) {");
+    output_line(out, "        size_t capacity = tree->lazy_matches_capacity ? tree->lazy_matches_capacity * 2 : 16;");
+    output_line(out, "        struct lazy_match *matches = realloc(tree->lazy_matches, capacity * sizeof(struct lazy_match));");
+    output_line(out, "        if (!matches)");
+    output_line(out, "            abort();");
+    output_line(out, "        tree->lazy_matches = matches;");
+    output_line(out, "        tree->lazy_matches_capacity = capacity;");
+    output_line(out, "    }");
+    output_line(out, "    struct lazy_match *match = &tree->lazy_matches[tree->number_of_lazy_matches++];");
+    output_line(out, "    match->rule = s->under_construction->rule;");
+    output_line(out, "    match->cursor = *c;");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        if (!rule->is_token)
+            continue;
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "    match->next_%%rule_token_offset = tree->next_%%rule_token_offset;");
+    }
+    output_line(out, "    tree->lazy_matches_left++;");
+    output_line(out, "    tree->lazy_match_pending = true;");
+    output_line(out, "    return true;");
+    output_line(out, "}");
+    output_line(out, "static void build_lazy_match(struct owl_tree *tree, size_t index) {");
+    output_line(out, "    struct lazy_match match = tree->lazy_matches[index];");
+    output_line(out, "    if (!match.cursor.run)");
+    output_line(out, "        return;");
+    output_line(out, "    tree->lazy_matches[index].cursor.run = 0;");
+    output_line(out, "    tree->lazy_matches_left--;");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        if (!rule->is_token)
+            continue;
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "    size_t saved_%%rule_token_offset = tree->next_%%rule_token_offset;");
+        output_line(out, "    tree->next_%%rule_token_offset = match.next_%%rule_token_offset;");
+    }
+    output_line(out, "    struct construct_state construct_state = { .info = tree };");
+    output_line(out, "    tree->building_rule = match.rule + 1;");
+    output_line(out, "    construct_begin(&construct_state, match.cursor.offset, CONSTRUCT_NORMAL_ROOT);");
+    output_line(out, "    tree->building_rule = 0;");
+    output_line(out, "    build_from_tokens(tree, &construct_state, &match.cursor, true);");
+    output_line(out, "    // Move the fields of the node we just built into the space left for them.");
+    output_line(out, "    size_t node = construct_finish(&construct_state, match.cursor.offset);");
+    output_line(out, "    size_t slots[MAX_NUMBER_OF_SLOTS];");
+    output_line(out, "    uint32_t number_of_slots = read_node_slots(tree, node, match.rule, slots);");
+    output_line(out, "    for (uint32_t i = 0; i < number_of_slots; ++i)");
+    output_line(out, "        patch_tree(tree, match.fields + i * RESERVATION_AMOUNT, slots[i], RESERVATION_AMOUNT);");
+    for (uint32_t i = 0; i < n; ++i) {
+        struct rule *rule = &gen->grammar->rules[i];
+        if (!rule->is_token)
+            continue;
+        set_substitution(out, "rule", rule->name, rule->name_length,
+         LOWERCASE_WITH_UNDERSCORES);
+        output_line(out, "    tree->next_%%rule_token_offset = saved_%%rule_token_offset;");
+    }
+    if (gen->options.compact_refs) {
+        output_line(out, "    if (tree->next_offset > UINT32_MAX)");
+        output_line(out, "        abort();");
+    }
+    output_line(out, "}");
+    output_line(out, "static void build_lazy_match_at(struct owl_tree *tree, size_t node) {");
+    output_line(out, "    size_t low = 0;");
+    output_line(out, "    size_t high = tree->number_of_lazy_matches;");
+    output_line(out, "    while (low < high) {");
+    output_line(out, "        size_t mid = low + (high - low) / 2;");
+    output_line(out, "        if (tree->lazy_matches[mid].node < node)");
+    output_line(out, "            low = mid + 1;");
+    output_line(out, "        else");
+    output_line(out, "            high = mid;");
+    output_line(out, "    }");
+    output_line(out, "    if (low < tree->number_of_lazy_matches && tree->lazy_matches[low].node == node)");
+    output_line(out, "        build_lazy_match(tree, low);");
+    output_line(out, "}");
+    if (!reads_whole_tree(gen))
+        return;
+    output_line(out, "static void build_lazy_matches(struct owl_tree *tree) {");
+    output_line(out, "    // Building a match can add more matches to the end of the list.");
+    output_line(out, "    for (size_t i = 0; tree->lazy_matches_left > 0 && i < tree->number_of_lazy_matches; ++i)");
+    output_line(out, "        build_lazy_match(tree, i);");
+    output_line(out, "}");
+}
+
 static void generate_action_table(struct generator *gen,
  struct generator_output *out)
 {
@@ -1599,7 +5456,7 @@ retry:
         output_string(out, "{");
         struct action_table_bucket *bucket = table_buckets[i];
         if (!bucket)
-            output_string(out, "0");
+            output_string(out, "{0}");
         for (; bucket; bucket = bucket->next) {
             output_string(out, "{");
             memset(bytes, 0, key_bytes + value_bytes);
@@ -1685,31 +5542,60 @@ retry:
     output_line(out, "        construct_action_apply(state, actions[i], offset);");
     output_line(out, "    }");
     output_line(out, "}");
-    output_line(out, "static size_t build_parse_tree(struct owl_default_tokenizer *tokenizer, struct owl_token_run *run, struct owl_tree *tree) {");
-    output_line(out, "    struct construct_state construct_state = { .info = tree };");
+    bool lazy = gen->grammar->number_of_lazy_rules > 0;
+    set_unsigned_number_substitution(out, "number-of-tokens",
+     gen->combined->number_of_tokens);
+    set_unsigned_number_substitution(out, "bracket-start-state",
+     gen->deterministic->bracket_automaton.start_state +
+     gen->deterministic->automaton.number_of_states);
+    set_unsigned_number_substitution(out, "final-nfa-state",
+     nfa_states[gen->combined->final_nfa_state]);
+    if (lazy)
+        generate_lazy_matches(gen, out);
+    else
+        generate_build_cursor(out);
+    // Builds the tree backwards from the cursor.  With in_bracket set, this
+    // stops at the start of the bracket the cursor is in.  Otherwise, it stops
+    // early if the tree grows past its size limit (with --parse-limits) or
+    // past 4 GB (with --compact-refs).
+    output_line(out, "static void build_from_tokens(struct owl_tree *tree, struct construct_state *construct_state, struct build_cursor *c, bool in_bracket) {");
     output_line(out, "    %%state-type *state_stack = 0;");
     output_line(out, "    uint32_t stack_depth = 0;");
     output_line(out, "    size_t stack_capacity = 0;");
-    output_line(out, "    size_t whitespace = tokenizer->whitespace;");
-    output_line(out, "    size_t offset = tokenizer->offset - whitespace;");
-    if (gen->combined->root_rule_is_expression)
-        output_line(out, "    construct_begin(&construct_state, offset, CONSTRUCT_EXPRESSION_ROOT);");
-    else
-        output_line(out, "    construct_begin(&construct_state, offset, CONSTRUCT_NORMAL_ROOT);");
-    set_unsigned_number_substitution(out, "final-nfa-state",
-     nfa_states[gen->combined->final_nfa_state]);
-    output_line(out, "    %%state-type nfa_state = %%final-nfa-state;");
-    output_line(out, "    while (run) {");
-    output_line(out, "        uint16_t length_offset = run->lengths_size - 1;");
-    output_line(out, "        uint16_t n = run->number_of_tokens;");
-    output_line(out, "        for (uint16_t i = n - 1; i < n; i--) {");
-    output_line(out, "            size_t end = offset;");
+    if (gen->options.parse_limits) {
+        output_line(out, "    size_t max_tree_bytes = SIZE_MAX;");
+        output_line(out, "    if (!in_bracket && tree->limits.max_tree_bytes)");
+        output_line(out, "        max_tree_bytes = tree->limits.max_tree_bytes;");
+    }
+    if (lazy) {
+        output_line(out, "    // The number of brackets we're inside in a lazy match, and the state to");
+        output_line(out, "    // resume from after it.");
+        output_line(out, "    uint32_t lazy_depth = 0;");
+        output_line(out, "    %%state-type lazy_resume_state = 0;");
+    } else if (!builder_can_stop(gen))
+        output_line(out, "    (void)tree;");
+    output_line(out, "    while (c->run) {");
+    output_line(out, "        struct owl_token_run *run = c->run;");
+    output_line(out, "        while (c->tokens_left > 0) {");
+    output_line(out, "            uint16_t i = --c->tokens_left;");
+    output_line(out, "            size_t end = c->offset;");
     output_line(out, "            size_t len = 0;");
-    output_line(out, "            struct action_table_entry entry = action_table_lookup(nfa_state, run->states[i], run->tokens[i]);");
-    set_unsigned_number_substitution(out, "number-of-tokens",
-     gen->combined->number_of_tokens);
+    if (lazy) {
+        output_line(out, "            if (lazy_depth > 0) {");
+        output_line(out, "                if (run->tokens[i] < %%number-of-tokens) {");
+        output_line(out, "                    len = decode_token_length(run, &c->length_offset, &c->offset);");
+        output_line(out, "                    skip_token_data(tree, run->tokens[i]);");
+        output_line(out, "                } else");
+        output_line(out, "                    lazy_depth++;");
+        output_line(out, "                if (run->states[i] == %%bracket-start-state && --lazy_depth == 0)");
+        output_line(out, "                    c->nfa_state = lazy_resume_state;");
+        output_line(out, "                c->whitespace = end - c->offset - len;");
+        output_line(out, "                continue;");
+        output_line(out, "            }");
+    }
+    output_line(out, "            struct action_table_entry entry = action_table_lookup(c->nfa_state, run->states[i], run->tokens[i]);");
     output_line(out, "            if (run->tokens[i] < %%number-of-tokens)");
-    output_line(out, "                len = decode_token_length(run, &length_offset, &offset);");
+    output_line(out, "                len = decode_token_length(run, &c->length_offset, &c->offset);");
     output_line(out, "            else {");
     output_line(out, "                if (stack_depth >= stack_capacity) {");
     output_line(out, "                    size_t new_capacity = (stack_capacity + 2) * 3 / 2;");
@@ -1723,27 +5609,146 @@ retry:
     output_line(out, "                }");
     output_line(out, "                state_stack[stack_depth++] = entry.push_nfa_state;");
     output_line(out, "            }");
-    output_line(out, "            apply_actions(&construct_state, entry.actions, end, end + whitespace);");
-    set_unsigned_number_substitution(out, "bracket-start-state",
-     gen->deterministic->bracket_automaton.start_state +
-     gen->deterministic->automaton.number_of_states);
+    output_line(out, "            apply_actions(construct_state, entry.actions, end, end + c->whitespace);");
+    if (gen->options.parse_limits) {
+        output_line(out, "            if (tree->next_offset > max_tree_bytes) {");
+        output_line(out, "                tree->error = ERROR_LIMIT_EXCEEDED;");
+        output_line(out, "                tree->error_range.start = 0;");
+        output_line(out, "                tree->error_range.end = 0;");
+        output_line(out, "                break;");
+        output_line(out, "            }");
+    }
+    if (gen->options.compact_refs) {
+        output_line(out, "            if (!in_bracket && tree->too_large) {");
+        output_line(out, "                tree->error = ERROR_INPUT_TOO_LARGE;");
+        output_line(out, "                tree->error_range.start = 0;");
+        output_line(out, "                tree->error_range.end = 0;");
+        output_line(out, "                break;");
+        output_line(out, "            }");
+    }
+    output_line(out, "            c->whitespace = end - c->offset - len;");
     output_line(out, "            if (run->states[i] == %%bracket-start-state) {");
-    output_line(out, "                if (stack_depth == 0)");
-    output_line(out, "                    abort();");
-    output_line(out, "                nfa_state = state_stack[--stack_depth];");
+    output_line(out, "                if (stack_depth == 0) {");
+    output_line(out, "                    if (!in_bracket)");
+    output_line(out, "                        abort();");
+    output_line(out, "                    free(state_stack);");
+    output_line(out, "                    return;");
+    output_line(out, "                }");
+    output_line(out, "                c->nfa_state = state_stack[--stack_depth];");
     output_line(out, "            } else");
-    output_line(out, "                nfa_state = entry.nfa_state;");
-    output_line(out, "            whitespace = end - offset - len;");
+    output_line(out, "                c->nfa_state = entry.nfa_state;");
+    if (lazy) {
+        output_line(out, "            if (run->tokens[i] >= %%number-of-tokens && begin_lazy_match(tree, construct_state, c)) {");
+        output_line(out, "                lazy_resume_state = state_stack[--stack_depth];");
+        output_line(out, "                lazy_depth = 1;");
+        output_line(out, "            }");
+    }
+    output_line(out, "        }");
+    if (builder_can_stop(gen)) {
+        output_line(out, "        if (tree->error)");
+        output_line(out, "            break;");
+    }
+    output_line(out, "        c->run = run->prev;");
+    output_line(out, "        if (c->run) {");
+    output_line(out, "            c->tokens_left = c->run->number_of_tokens;");
+    output_line(out, "            c->length_offset = c->run->lengths_size - 1;");
     output_line(out, "        }");
-    output_line(out, "        struct owl_token_run *old = run;");
-    output_line(out, "        run = run->prev;");
-    output_line(out, "        free(old);");
+    // Lazy matches need the runs later.
+    if (!lazy)
+        output_line(out, "        free(run);");
     output_line(out, "    }");
-    output_line(out, "    struct action_table_entry entry = action_table_lookup(nfa_state, UINT32_MAX, UINT32_MAX);");
-    output_line(out, "    apply_actions(&construct_state, entry.actions, offset, offset + whitespace);");
     output_line(out, "    free(state_stack);");
-    output_line(out, "    free_token_runs(&run);");
-    output_line(out, "    return construct_finish(&construct_state, offset);");
+    output_line(out, "}");
+    if (builder_can_stop(gen)) {
+        output_line(out, "// Frees the nodes of a tree whose building stopped partway through.");
+        output_line(out, "static void abandon_construction(struct construct_state *s) {");
+        output_line(out, "    while (s->current_expression) {");
+        output_line(out, "        struct construct_expression *expr = s->current_expression;");
+        output_line(out, "        s->current_expression = expr->parent;");
+        output_line(out, "        struct construct_node *lists[] = { expr->first_operator, expr->first_value };");
+        output_line(out, "        for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i) {");
+        output_line(out, "            while (lists[i]) {");
+        output_line(out, "                struct construct_node *node = lists[i];");
+        output_line(out, "                lists[i] = node->next;");
+        output_line(out, "                construct_node_free(s, node);");
+        output_line(out, "            }");
+        output_line(out, "        }");
+        output_line(out, "        construct_expression_free(s, expr);");
+        output_line(out, "    }");
+        output_line(out, "    while (s->under_construction) {");
+        output_line(out, "        struct construct_node *node = s->under_construction;");
+        output_line(out, "        s->under_construction = node->next;");
+        output_line(out, "        construct_node_free(s, node);");
+        output_line(out, "    }");
+        output_line(out, "    while (s->node_freelist) {");
+        output_line(out, "        struct construct_node *node = s->node_freelist;");
+        output_line(out, "        s->node_freelist = node->next;");
+        output_line(out, "        free(node->slots);");
+        output_line(out, "        free(node);");
+        output_line(out, "    }");
+        output_line(out, "    while (s->expression_freelist) {");
+        output_line(out, "        struct construct_expression *expr = s->expression_freelist;");
+        output_line(out, "        s->expression_freelist = expr->parent;");
+        output_line(out, "        free(expr);");
+        output_line(out, "    }");
+        output_line(out, "    free(s->skipped_rules);");
+        output_line(out, "}");
+    }
+    output_line(out, "static size_t build_parse_tree(struct owl_default_tokenizer *tokenizer, struct owl_token_run *run, struct owl_tree *tree) {");
+    output_line(out, "    struct construct_state construct_state = { .info = tree };");
+    output_line(out, "    struct build_cursor c = {");
+    output_line(out, "        .run = run,");
+    output_line(out, "        .tokens_left = run ? run->number_of_tokens : 0,");
+    output_line(out, "        .length_offset = run ? run->lengths_size - 1 : 0,");
+    output_line(out, "        .whitespace = tokenizer->whitespace,");
+    output_line(out, "        .offset = tokenizer->offset - tokenizer->whitespace,");
+    output_line(out, "        .nfa_state = %%final-nfa-state,");
+    output_line(out, "    };");
+    if (gen->grammar->number_of_entry_rules > 0) {
+        output_line(out, "    const struct entry_point *entry_point = entry_point_for_rule(tree->root_rule);");
+        output_line(out, "    construct_begin(&construct_state, c.offset, entry_point->expression ? CONSTRUCT_EXPRESSION_ROOT : CONSTRUCT_NORMAL_ROOT);");
+    } else if (gen->combined->root_rule_is_expression)
+        output_line(out, "    construct_begin(&construct_state, c.offset, CONSTRUCT_EXPRESSION_ROOT);");
+    else
+        output_line(out, "    construct_begin(&construct_state, c.offset, CONSTRUCT_NORMAL_ROOT);");
+    output_line(out, "    build_from_tokens(tree, &construct_state, &c, false);");
+    if (builder_can_stop(gen)) {
+        output_line(out, "    if (tree->error) {");
+        output_line(out, "        abandon_construction(&construct_state);");
+        if (lazy)
+            output_line(out, "        free_token_runs(&run);");
+        else
+            output_line(out, "        free_token_runs(&c.run);");
+        output_line(out, "        return 0;");
+        output_line(out, "    }");
+    }
+    if (lazy) {
+        output_line(out, "    if (tree->number_of_lazy_matches > 0)");
+        output_line(out, "        tree->token_runs = run;");
+        output_line(out, "    else");
+        output_line(out, "        free_token_runs(&run);");
+    }
+    if (gen->grammar->number_of_entry_rules > 0) {
+        set_unsigned_number_substitution(out, "start-state",
+         gen->deterministic->automaton.start_state);
+        output_line(out, "    if (entry_point->token != UINT32_MAX) {");
+        output_line(out, "        // Go back across the entry token to the start state.");
+        output_line(out, "        struct action_table_entry entry = action_table_lookup(c.nfa_state, %%start-state, entry_point->token);");
+        output_line(out, "        apply_actions(&construct_state, entry.actions, c.offset, c.offset + c.whitespace);");
+        output_line(out, "        c.nfa_state = entry.nfa_state;");
+        output_line(out, "    }");
+    }
+    output_line(out, "    struct action_table_entry entry = action_table_lookup(c.nfa_state, UINT32_MAX, UINT32_MAX);");
+    output_line(out, "    apply_actions(&construct_state, entry.actions, c.offset, c.offset + c.whitespace);");
+    if (gen->options.share_subtrees) {
+        output_line(out, "    size_t root = construct_finish(&construct_state, c.offset);");
+        output_line(out, "    free(tree->shared_nodes);");
+        output_line(out, "    tree->shared_nodes = 0;");
+        output_line(out, "    tree->shared_nodes_size = 0;");
+        output_line(out, "    tree->number_of_shared_nodes = 0;");
+        output_line(out, "    return root;");
+    } else
+        output_line(out, "    return construct_finish(&construct_state, c.offset);");
     output_line(out, "}");
     free(bucket_sizes);
     free(buckets);
@@ -1757,6 +5762,23 @@ static bool rule_is_named(struct rule *rule, const char *name)
      !memcmp(name, rule->name, rule->name_length);
 }
 
+// Rule ranges aren't stored with --omit-ranges.  Token ranges are, but with
+// --share-subtrees a token can be reached from matches at several places in
+// the text, so its stored range isn't reported.
+static bool rule_has_range(struct generator *gen, struct rule *rule)
+{
+    if (rule->is_token)
+        return !gen->options.share_subtrees;
+    return !gen->options.omit_ranges;
+}
+
+// Building stops partway through if the tree grows past its size limit, or
+// past the 4 GB that compact refs can address.
+static bool builder_can_stop(struct generator *gen)
+{
+    return gen->options.parse_limits || gen->options.compact_refs;
+}
+
 static bool token_is(struct token *token, const char *name)
 {
     return token->length == strlen(name) &&
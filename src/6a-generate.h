@@ -2,14 +2,59 @@
 #define _6A_GENERATE_H_
 
 #include "5-determinize.h"
+#include <stdbool.h>
 #include <stdlib.h>
 
+// These options change the code and tree encoding of the generated parser.
+// See doc/generated-parser.md for a description of each one.
+struct generator_options {
+    // Encode every tree field as an aligned 64-bit word instead of a varint.
+    bool fixed_layout;
+    // Use 32-bit offsets in refs and source ranges, and leave the tree pointer
+    // out of refs.
+    bool compact_refs;
+    // Don't store source ranges for rules (tokens still have their ranges).
+    bool omit_ranges;
+    // Store the tree in fixed-size segments instead of one growing buffer.
+    bool segmented_tree;
+    // Give each distinct identifier a numeric id while tokenizing.
+    bool intern_identifiers;
+    // Write each distinct subtree once, turning the tree into a DAG.
+    bool share_subtrees;
+    // Store a structural hash with each node for owl_ref_hash().
+    bool subtree_hashes;
+    // Generate owl_tree_compact().
+    bool tree_compact;
+    // Generate owl_tree_build_index(), owl_parent(), and the owl_rule_...()
+    // functions.
+    bool tree_index;
+    // Generate the owl_walker functions and owl_walk().
+    bool walker;
+    // Generate owl_tree_write_json() and owl_tree_write_binary().
+    bool tree_export;
+    // Generate owl_tree_save() and owl_tree_load_mmap().
+    bool tree_save;
+    // Generate owl_tokenize().
+    bool tokenize;
+    // Generate owl_tree_extract().
+    bool tree_extract;
+    // Generate owl_tree_edit_replace(), owl_tree_snapshot(), and
+    // owl_tree_rollback().
+    bool tree_edit;
+    // Generate owl_tree_create_from_tokens() and owl_keyword_number().
+    bool from_tokens;
+    // Generate owl_tree_create_from_string_with_limits().
+    bool parse_limits;
+};
+
 struct generator {
     void (*output)(const char *, size_t);
 
     struct grammar *grammar;
     struct combined_grammar *combined;
     struct deterministic_grammar *deterministic;
+
+    struct generator_options options;
 };
 
 void generate(struct generator *);
@@ -17,6 +17,10 @@ static struct terminal_info get_terminal_info(int fileno);
 static FILE *fopen_or_error(const char *filename, const char *mode);
 static char *read_string(FILE *file);
 static void write_to_output(const char *string, size_t len);
+static bool report_ambiguity(struct grammar *grammar,
+ struct combined_grammar *combined);
+static uint32_t find_rule(struct grammar *grammar, const char *name);
+static bool is_single_bracket(struct rule *rule);
 
 static const char *version_string = "owl.v1";
 
@@ -34,11 +38,22 @@ int main(int argc, char *argv[])
     char *input_string = 0;
     bool compile = false;
     bool test_format = false;
+    struct generator_options generator_options = {0};
+    // The last generator option we saw, for error reporting.
+    const char *generator_option = 0;
+    const char **entry_rule_names = 0;
+    uint32_t entry_rule_names_allocated_bytes = 0;
+    uint32_t number_of_entry_rule_names = 0;
+    const char **lazy_rule_names = 0;
+    uint32_t lazy_rule_names_allocated_bytes = 0;
+    uint32_t number_of_lazy_rule_names = 0;
     enum {
         NO_PARAMETER,
         INPUT_FILE_PARAMETER,
         OUTPUT_FILE_PARAMETER,
         GRAMMAR_TEXT_PARAMETER,
+        ENTRY_RULE_PARAMETER,
+        LAZY_RULE_PARAMETER,
     } parameter_state = NO_PARAMETER;
     for (int i = 1; i < argc; ++i) {
         const char *short_name = "";
@@ -78,7 +93,64 @@ int main(int argc, char *argv[])
                 compile = true;
             else if (!strcmp(short_name, "C") || !strcmp(long_name, "color"))
                 force_terminal_colors = true;
-            else if (long_name[0] || short_name[0]) {
+            else if (!strcmp(long_name, "fixed-layout")) {
+                generator_options.fixed_layout = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "compact-refs")) {
+                generator_options.compact_refs = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "omit-ranges")) {
+                generator_options.omit_ranges = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "segmented-tree")) {
+                generator_options.segmented_tree = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "intern-ids")) {
+                generator_options.intern_identifiers = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "share-subtrees")) {
+                generator_options.share_subtrees = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "subtree-hashes")) {
+                generator_options.subtree_hashes = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "tree-compact")) {
+                generator_options.tree_compact = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "tree-index")) {
+                generator_options.tree_index = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "walker")) {
+                generator_options.walker = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "tree-export")) {
+                generator_options.tree_export = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "tree-save")) {
+                generator_options.tree_save = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "tokenize")) {
+                generator_options.tokenize = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "tree-extract")) {
+                generator_options.tree_extract = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "tree-edit")) {
+                generator_options.tree_edit = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "from-tokens")) {
+                generator_options.from_tokens = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "parse-limits")) {
+                generator_options.parse_limits = true;
+                generator_option = argv[i];
+            } else if (!strcmp(long_name, "entry-rule")) {
+                generator_option = argv[i];
+                parameter_state = ENTRY_RULE_PARAMETER;
+            } else if (!strcmp(long_name, "lazy-rule")) {
+                generator_option = argv[i];
+                parameter_state = LAZY_RULE_PARAMETER;
+            } else if (long_name[0] || short_name[0]) {
                 errorf("unknown option: %s%s", long_name[0] ? "--" : "-",
                  long_name[0] ? long_name : short_name);
                 print_error();
@@ -126,6 +198,36 @@ int main(int argc, char *argv[])
             parameter_state = NO_PARAMETER;
             break;
         }
+        case ENTRY_RULE_PARAMETER: {
+            if (short_name[0] || long_name[0]) {
+                errorf("missing rule name");
+                print_error();
+                needs_help = true;
+                break;
+            }
+            uint32_t index = number_of_entry_rule_names++;
+            entry_rule_names = grow_array(entry_rule_names,
+             &entry_rule_names_allocated_bytes,
+             sizeof(const char *) * number_of_entry_rule_names);
+            entry_rule_names[index] = argv[i];
+            parameter_state = NO_PARAMETER;
+            break;
+        }
+        case LAZY_RULE_PARAMETER: {
+            if (short_name[0] || long_name[0]) {
+                errorf("missing rule name");
+                print_error();
+                needs_help = true;
+                break;
+            }
+            uint32_t index = number_of_lazy_rule_names++;
+            lazy_rule_names = grow_array(lazy_rule_names,
+             &lazy_rule_names_allocated_bytes,
+             sizeof(const char *) * number_of_lazy_rule_names);
+            lazy_rule_names[index] = argv[i];
+            parameter_state = NO_PARAMETER;
+            break;
+        }
         }
         if (needs_help)
             break;
@@ -143,10 +245,37 @@ int main(int argc, char *argv[])
         fprintf(stderr, " -g grammar  --grammar grammar  specify the grammar text on the command line\n");
         fprintf(stderr, " -T          --test-format      use test format with combined input and grammar\n");
         fprintf(stderr, " -C          --color            force 256-color parse tree output\n");
+        fprintf(stderr, "             --fixed-layout     (with -c) use fixed-size parse tree fields\n");
+        fprintf(stderr, "             --compact-refs     (with -c) use 32-bit refs and source ranges\n");
+        fprintf(stderr, "             --omit-ranges      (with -c) don't store source ranges for rules\n");
+        fprintf(stderr, "             --segmented-tree   (with -c) store the parse tree in fixed-size segments\n");
+        fprintf(stderr, "             --intern-ids       (with -c) give each distinct identifier a numeric id\n");
+        fprintf(stderr, "             --share-subtrees   (with -c) store identical subtrees only once\n");
+        fprintf(stderr, "             --subtree-hashes   (with -c) store a hash of each match for owl_ref_hash\n");
+        fprintf(stderr, "             --tree-compact     (with -c) generate owl_tree_compact\n");
+        fprintf(stderr, "             --tree-index       (with -c) generate owl_parent and owl_rule_nth\n");
+        fprintf(stderr, "             --walker           (with -c) generate owl_walker and owl_walk\n");
+        fprintf(stderr, "             --tree-export      (with -c) generate the JSON and binary exporters\n");
+        fprintf(stderr, "             --tree-save        (with -c) generate owl_tree_save and owl_tree_load_mmap\n");
+        fprintf(stderr, "             --tokenize         (with -c) generate owl_tokenize\n");
+        fprintf(stderr, "             --tree-extract     (with -c) generate owl_tree_extract\n");
+        fprintf(stderr, "             --tree-edit        (with -c) generate owl_tree_edit_replace and snapshots\n");
+        fprintf(stderr, "             --from-tokens      (with -c) generate owl_tree_create_from_tokens\n");
+        fprintf(stderr, "             --parse-limits     (with -c) generate owl_tree_create_from_string_with_limits\n");
+        fprintf(stderr, "             --entry-rule rule  (with -c) also allow parsing starting from rule\n");
+        fprintf(stderr, "             --lazy-rule rule   (with -c and --segmented-tree) build matches of rule when they're first read\n");
         fprintf(stderr, " -V          --version          print version info and exit\n");
         fprintf(stderr, " -h          --help             output this help text\n");
         return 1;
     }
+    if (generator_option && !compile)
+        exit_with_errorf("the %s option requires -c", generator_option);
+    // A shared match has no single range to store.
+    if (generator_options.share_subtrees && !generator_options.omit_ranges)
+        exit_with_errorf("--share-subtrees requires --omit-ranges");
+    // Only compacting puts a tree in document order and drops old versions.
+    if (generator_options.tree_edit && !generator_options.tree_compact)
+        exit_with_errorf("--tree-edit requires --tree-compact");
     if (test_format) {
         size_t i = 0;
         for (; grammar_string[i]; ++i) {
@@ -247,16 +376,63 @@ int main(int argc, char *argv[])
     }
 #endif
 
-    struct ambiguity ambiguity = {0};
-    check_for_ambiguity(&combined, &ambiguity);
-    if (ambiguity.has_ambiguity) {
-        struct interpreter interpreter = {
-            .grammar = &grammar,
-            .combined = &combined,
-            .terminal_info = get_terminal_info(STDERR_FILENO),
-        };
-        output_ambiguity(&interpreter, &ambiguity, stderr);
+    if (report_ambiguity(&grammar, &combined))
         return 3;
+
+    if (number_of_entry_rule_names > 0) {
+        // Check each entry rule for ambiguity as if it were the root, then
+        // combine everything again with the entry rules included.
+        grammar.entry_rules = calloc(number_of_entry_rule_names,
+         sizeof(uint32_t));
+        uint32_t root_rule = grammar.root_rule;
+        for (uint32_t i = 0; i < number_of_entry_rule_names; ++i) {
+            const char *name = entry_rule_names[i];
+            uint32_t index = find_rule(&grammar, name);
+            bool duplicate = index == root_rule;
+            for (uint32_t j = 0; j < grammar.number_of_entry_rules; ++j) {
+                if (grammar.entry_rules[j] == index)
+                    duplicate = true;
+            }
+            if (duplicate)
+                continue;
+            struct combined_grammar entry_combined = {0};
+            grammar.root_rule = index;
+            combine(&entry_combined, &grammar);
+            if (report_ambiguity(&grammar, &entry_combined))
+                return 3;
+            combined_grammar_destroy(&entry_combined);
+            grammar.root_rule = root_rule;
+            grammar.entry_rules[grammar.number_of_entry_rules++] = index;
+        }
+        combined_grammar_destroy(&combined);
+        combine(&combined, &grammar);
+    }
+
+    if (number_of_lazy_rule_names > 0) {
+        // A match's hash depends on all of its children.
+        if (generator_options.subtree_hashes)
+            exit_with_errorf("--lazy-rule can't be used with --subtree-hashes");
+        // Building a match later adds to the tree, so the bytes it's already
+        // handed out can't move.
+        if (!generator_options.segmented_tree)
+            exit_with_errorf("--lazy-rule requires --segmented-tree");
+        grammar.lazy_rules = calloc(number_of_lazy_rule_names,
+         sizeof(uint32_t));
+        for (uint32_t i = 0; i < number_of_lazy_rule_names; ++i) {
+            const char *name = lazy_rule_names[i];
+            uint32_t index = find_rule(&grammar, name);
+            if (!is_single_bracket(&grammar.rules[index])) {
+                exit_with_errorf("'%s' can't be lazy -- a lazy rule must be a "
+                 "single guard bracket like [ '{' ... '}' ]", name);
+            }
+            bool duplicate = false;
+            for (uint32_t j = 0; j < grammar.number_of_lazy_rules; ++j) {
+                if (grammar.lazy_rules[j] == index)
+                    duplicate = true;
+            }
+            if (!duplicate)
+                grammar.lazy_rules[grammar.number_of_lazy_rules++] = index;
+        }
     }
 
     struct deterministic_grammar deterministic = {0};
@@ -268,6 +444,7 @@ int main(int argc, char *argv[])
             .grammar = &grammar,
             .combined = &combined,
             .deterministic = &deterministic,
+            .options = generator_options,
         };
         generate(&generator);
     } else {
@@ -297,9 +474,58 @@ int main(int argc, char *argv[])
     owl_tree_destroy(tree);
     free(input_string);
     free(grammar_string_to_free);
+    free(entry_rule_names);
+    free(lazy_rule_names);
     return 0;
 }
 
+static uint32_t find_rule(struct grammar *grammar, const char *name)
+{
+    uint32_t index = 0;
+    for (; index < grammar->number_of_rules; ++index) {
+        struct rule *rule = &grammar->rules[index];
+        if (rule->name_length == strlen(name) &&
+         !memcmp(rule->name, name, rule->name_length))
+            break;
+    }
+    if (index >= grammar->number_of_rules)
+        exit_with_errorf("there's no rule named '%s'", name);
+    if (grammar->rules[index].is_token)
+        exit_with_errorf("'%s' is a token class, not a rule", name);
+    return index;
+}
+
+// Returns true if the rule matches exactly one guard bracket, like
+// `block = [ '{' stmt* '}' ]`.
+static bool is_single_bracket(struct rule *rule)
+{
+    if (rule->number_of_choices > 0 || rule->number_of_brackets != 1)
+        return false;
+    struct automaton *automaton = &rule->automaton;
+    struct state start = automaton->states[automaton->start_state];
+    if (start.accepting || start.number_of_transitions != 1 ||
+     start.transitions[0].symbol != rule->brackets[0].symbol)
+        return false;
+    struct state end = automaton->states[start.transitions[0].target];
+    return end.accepting && end.number_of_transitions == 0;
+}
+
+static bool report_ambiguity(struct grammar *grammar,
+ struct combined_grammar *combined)
+{
+    struct ambiguity ambiguity = {0};
+    check_for_ambiguity(combined, &ambiguity);
+    if (!ambiguity.has_ambiguity)
+        return false;
+    struct interpreter interpreter = {
+        .grammar = grammar,
+        .combined = combined,
+        .terminal_info = get_terminal_info(STDERR_FILENO),
+    };
+    output_ambiguity(&interpreter, &ambiguity, stderr);
+    return true;
+}
+
 static const char *colors_8[] = {
     "\033[31m",
     "\033[32m",
@@ -25,6 +25,17 @@
 #define FINISH_TOKEN(rule, next_sibling, info) 0
 #endif
 
+// Matches of rules for which SKIP_RULE_LOOKUP is true are left out of the
+// tree, along with everything inside them.  Tokens left out this way are
+// passed to SKIP_TOKEN instead of FINISH_TOKEN.
+#ifndef SKIP_RULE_LOOKUP
+#define SKIP_RULE_LOOKUP(rule, info) false
+#endif
+
+#ifndef SKIP_TOKEN
+#define SKIP_TOKEN(rule, info)
+#endif
+
 #ifndef RULE_T
 #error Please define the RULE_T type.
 #endif
@@ -113,6 +124,11 @@ struct construct_state {
     struct construct_node *node_freelist;
     struct construct_expression *expression_freelist;
 
+    // The rules of the skipped matches we're inside, innermost last.
+    RULE_T *skipped_rules;
+    size_t skipped_depth;
+    size_t skipped_capacity;
+
     void *info;
 };
 
@@ -328,17 +344,66 @@ static FINISHED_NODE_T construct_finish(struct construct_state *s,
         s->expression_freelist = expr->parent;
         free(expr);
     }
+    free(s->skipped_rules);
+    s->skipped_rules = 0;
+    s->skipped_capacity = 0;
     return finished;
 }
 
+static void construct_skip_push(struct construct_state *s, RULE_T rule)
+{
+    if (s->skipped_depth >= s->skipped_capacity) {
+        size_t capacity = s->skipped_capacity ? s->skipped_capacity * 2 : 16;
+        RULE_T *rules = realloc(s->skipped_rules, capacity * sizeof(RULE_T));
+        if (!rules)
+            abort();
+        s->skipped_rules = rules;
+        s->skipped_capacity = capacity;
+    }
+    s->skipped_rules[s->skipped_depth++] = rule;
+}
+
+// Inside a skipped match, we only keep track of which rule each slot belongs
+// to, so the tokens can be skipped too.
+static void construct_skipped_action_apply(struct construct_state *s,
+ uint16_t action)
+{
+    RULE_T rule = s->skipped_rules[s->skipped_depth - 1];
+    switch (CONSTRUCT_ACTION_GET_TYPE(action)) {
+    case ACTION_END_SLOT:
+    case ACTION_END_EXPRESSION_SLOT:
+        construct_skip_push(s, RULE_LOOKUP(rule,
+         CONSTRUCT_ACTION_GET_SLOT(action), s->info));
+        break;
+    case ACTION_BEGIN_SLOT:
+    case ACTION_BEGIN_EXPRESSION_SLOT:
+        s->skipped_depth--;
+        break;
+    case ACTION_TOKEN_SLOT:
+        SKIP_TOKEN(RULE_LOOKUP(rule, CONSTRUCT_ACTION_GET_SLOT(action),
+         s->info), s->info);
+        break;
+    default:
+        break;
+    }
+}
+
 static void construct_action_apply(struct construct_state *s, uint16_t action,
  size_t offset)
 {
+    if (s->skipped_depth > 0) {
+        construct_skipped_action_apply(s, action);
+        return;
+    }
     switch (CONSTRUCT_ACTION_GET_TYPE(action)) {
     case ACTION_END_SLOT: {
-        struct construct_node *node = construct_node_alloc(s,
-         RULE_LOOKUP(s->under_construction->rule,
-          CONSTRUCT_ACTION_GET_SLOT(action), s->info));
+        RULE_T rule = RULE_LOOKUP(s->under_construction->rule,
+         CONSTRUCT_ACTION_GET_SLOT(action), s->info);
+        if (SKIP_RULE_LOOKUP(rule, s->info)) {
+            construct_skip_push(s, rule);
+            break;
+        }
+        struct construct_node *node = construct_node_alloc(s, rule);
         node->next = s->under_construction;
         node->slot_index = CONSTRUCT_ACTION_GET_SLOT(action);
         node->end_location = offset;
@@ -346,9 +411,14 @@ static void construct_action_apply(struct construct_state *s, uint16_t action,
         break;
     }
     case ACTION_END_EXPRESSION_SLOT: {
+        RULE_T rule = RULE_LOOKUP(s->under_construction->rule,
+         CONSTRUCT_ACTION_GET_SLOT(action), s->info);
+        if (SKIP_RULE_LOOKUP(rule, s->info)) {
+            construct_skip_push(s, rule);
+            break;
+        }
         struct construct_expression *expr = construct_expression_alloc(s,
-         RULE_LOOKUP(s->under_construction->rule,
-         CONSTRUCT_ACTION_GET_SLOT(action), s->info));
+         rule);
         expr->parent = s->current_expression;
         s->current_expression = expr;
         expr->slot_index = CONSTRUCT_ACTION_GET_SLOT(action);
@@ -386,9 +456,13 @@ static void construct_action_apply(struct construct_state *s, uint16_t action,
         break;
     case ACTION_TOKEN_SLOT: {
         uint16_t slot = CONSTRUCT_ACTION_GET_SLOT(action);
+        RULE_T rule = RULE_LOOKUP(s->under_construction->rule, slot, s->info);
+        if (SKIP_RULE_LOOKUP(rule, s->info)) {
+            SKIP_TOKEN(rule, s->info);
+            break;
+        }
         FINISHED_NODE_T *finished = &s->under_construction->slots[slot];
-        *finished = FINISH_TOKEN(RULE_LOOKUP(s->under_construction->rule, slot,
-         s->info), *finished, s->info);
+        *finished = FINISH_TOKEN(rule, *finished, s->info);
         break;
     }
     case ACTION_END_OPERAND: {
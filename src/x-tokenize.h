@@ -36,6 +36,12 @@
 #define ALLOCATE_STRING(n, info) malloc(n)
 #endif
 
+// Called before each token is added to a run.  If it returns true, the run
+// ends before the token, and no more tokens are read.
+#ifndef TOKEN_LIMIT_REACHED
+#define TOKEN_LIMIT_REACHED(tokens_read, offset, length, info) false
+#endif
+
 #ifndef ALLOW_DASHES_IN_IDENTIFIERS
 #define ALLOW_DASHES_IN_IDENTIFIERS(...) false
 #endif
@@ -75,6 +81,9 @@ struct owl_default_tokenizer {
     TOKEN_T number_token;
     TOKEN_T string_token;
 
+    // The number of tokens read so far (not counting bracket symbols).
+    size_t tokens_read;
+
     // The `info` pointer is passed to READ_KEYWORD_TOKEN.
     void *info;
 };
@@ -257,6 +266,9 @@ static bool owl_default_tokenizer_advance(struct owl_default_tokenizer
         }
         if (end_token && number_of_tokens + 1 >= TOKEN_RUN_LENGTH)
             break;
+        if (TOKEN_LIMIT_REACHED(tokenizer->tokens_read, offset, token_length,
+         tokenizer->info))
+            break;
         if (!encode_token_length(run, &lengths_size, token_length, whitespace))
             break;
         if (token == IDENTIFIER_TOKEN) {
@@ -292,6 +304,7 @@ static bool owl_default_tokenizer_advance(struct owl_default_tokenizer
         run->tokens[number_of_tokens] = token;
         whitespace = 0;
         number_of_tokens++;
+        tokenizer->tokens_read++;
         offset += token_length;
         if (end_token) {
             assert(number_of_tokens < TOKEN_RUN_LENGTH);
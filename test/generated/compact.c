@@ -0,0 +1,23 @@
+// owl -c ../example/json-ish.owl --tree-compact
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+int main(void)
+{
+    struct owl_tree *tree =
+     owl_tree_create_from_string("[1, {\"a\": [true, null]}, -2]");
+    owl_tree_compact(tree);
+    owl_tree_print(tree);
+    // Compacting a tree that's already in document order does nothing.
+    owl_tree_compact(tree);
+    owl_tree_print(tree);
+    owl_tree_destroy(tree);
+
+    // Error trees are left alone.
+    tree = owl_tree_create_from_string("[1,");
+    owl_tree_compact(tree);
+    printf("error %d\n", owl_tree_get_error(tree, 0));
+    owl_tree_destroy(tree);
+    return 0;
+}
@@ -0,0 +1,62 @@
+// owl -c ../example/json-ish.owl --tree-compact --tree-edit
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+static struct owl_ref nth_value(struct owl_tree *tree, int n)
+{
+    struct owl_ref ref = owl_tree_get_parsed_value(tree).value;
+    while (n-- > 0)
+        ref = owl_next(ref);
+    return ref;
+}
+
+int main(void)
+{
+    struct owl_tree *tree = owl_tree_create_from_string("[1, [2, 3], 4]");
+    // Edits need a tree in document order.
+    printf("before compacting %d\n",
+     owl_tree_edit_replace(nth_value(tree, 0), nth_value(tree, 2)));
+    owl_tree_compact(tree);
+    struct owl_snapshot original = owl_tree_snapshot(tree);
+
+    printf("replace %d\n",
+     owl_tree_edit_replace(nth_value(tree, 0), nth_value(tree, 1)));
+    owl_tree_print(tree);
+    struct owl_snapshot replaced = owl_tree_snapshot(tree);
+    printf("remove %d\n", owl_tree_edit_replace(nth_value(tree, 2),
+     (struct owl_ref){ .empty = true }));
+    owl_tree_print(tree);
+
+    owl_tree_rollback(tree, replaced);
+    owl_tree_print(tree);
+    owl_tree_rollback(tree, original);
+    owl_tree_print(tree);
+
+    // Edit inside a nested list, then again in the same version.
+    struct owl_ref inner = parsed_value_get(nth_value(tree, 1)).value;
+    struct owl_ref old_four = nth_value(tree, 2);
+    printf("nested %d\n", owl_tree_edit_replace(owl_next(inner), inner));
+    printf("again %d\n", owl_tree_edit_replace(nth_value(tree, 0), nth_value(tree, 2)));
+    owl_tree_print(tree);
+    // The nested list's first match was copied, but the matches after the
+    // edited one are shared with the old version.
+    printf("stale ref %d\n", owl_tree_edit_replace(inner,
+     (struct owl_ref){ .empty = true }));
+    printf("shared ref %d\n", owl_tree_edit_replace(old_four,
+     (struct owl_ref){ .empty = true }));
+    owl_tree_print(tree);
+    owl_tree_rollback(tree, original);
+
+    // Copy a match in from another tree, then compact away old versions.
+    struct owl_tree *snippet = owl_tree_create_from_string("[{\"k\": null}]");
+    printf("copy %d\n", owl_tree_edit_replace(nth_value(tree, 1),
+     nth_value(snippet, 0)));
+    owl_tree_destroy(snippet);
+    owl_tree_compact(tree);
+    owl_tree_print(tree);
+    // Compacting moved the nodes the snapshot refers to.
+    printf("stale snapshot %d\n", owl_tree_rollback(tree, original));
+    owl_tree_destroy(tree);
+    return 0;
+}
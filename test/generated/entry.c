@@ -0,0 +1,40 @@
+// owl -c generated/entry.owl --entry-rule setting --entry-rule value
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+static void parse_setting(const char *string)
+{
+    struct owl_tree *tree = owl_tree_create_from_string_as_setting(string);
+    struct source_range range;
+    enum owl_error error = owl_tree_get_error(tree, &range);
+    if (error != ERROR_NONE)
+        printf("error %d at %zu-%zu\n", error, range.start, range.end);
+    else {
+        struct parsed_setting setting =
+         parsed_setting_get(owl_tree_root_ref(tree));
+        struct parsed_identifier name = parsed_identifier_get(setting.identifier);
+        printf("setting %.*s\n", (int)name.length, name.identifier);
+        owl_tree_print(tree);
+    }
+    owl_tree_destroy(tree);
+}
+
+int main(void)
+{
+    parse_setting("width = [1, 2]");
+    // A whole document isn't a single setting.
+    parse_setting("a = 1 b = 2");
+    parse_setting("a b");
+
+    struct owl_tree *tree = owl_tree_create_from_string_as_value("[x, [3]]");
+    struct parsed_value value = parsed_value_get(owl_tree_root_ref(tree));
+    printf("value type %d, list type %d\n", value.type, PARSED_LIST);
+    owl_tree_print(tree);
+    owl_tree_destroy(tree);
+
+    tree = owl_tree_create_from_string("a = 1 b = c");
+    owl_tree_print(tree);
+    owl_tree_destroy(tree);
+    return 0;
+}
@@ -0,0 +1,23 @@
+// owl -c ../example/json-ish.owl --tree-export
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+int main(void)
+{
+    struct owl_tree *tree =
+     owl_tree_create_from_string("[1.5, {\"a\": true}, -2]");
+    printf("%d\n", owl_tree_write_json(tree, stdout));
+
+    FILE *file = tmpfile();
+    if (!file)
+        return 1;
+    printf("%d\n", owl_tree_write_binary(tree, file));
+    long size = ftell(file);
+    rewind(file);
+    for (long i = 0; i < size; ++i)
+        printf("%02x%c", getc(file), i % 16 == 15 || i == size - 1 ? '\n' : ' ');
+    fclose(file);
+    owl_tree_destroy(tree);
+    return 0;
+}
@@ -0,0 +1,30 @@
+// owl -c ../example/json-ish.owl --tree-extract
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+int main(void)
+{
+    struct owl_tree *tree =
+     owl_tree_create_from_string("[1, {\"a\": [true, \"b\"]}, 2]");
+    struct parsed_value root = owl_tree_get_parsed_value(tree);
+    struct owl_ref object = owl_next(root.value);
+
+    struct owl_tree *copy = owl_tree_extract(object, true);
+    struct owl_tree *shared = owl_tree_extract(object, false);
+    owl_tree_destroy(tree);
+    owl_tree_print(copy);
+    owl_tree_print(shared);
+
+    // Extracting from an extracted tree.
+    struct parsed_value value = parsed_value_get(owl_tree_root_ref(copy));
+    struct owl_tree *inner = owl_tree_extract(value.value, true);
+    owl_tree_print(inner);
+    struct parsed_string key = parsed_string_get(value.string);
+    printf("%.*s\n", (int)key.length, key.string);
+
+    owl_tree_destroy(inner);
+    owl_tree_destroy(shared);
+    owl_tree_destroy(copy);
+    return 0;
+}
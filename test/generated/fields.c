@@ -0,0 +1,32 @@
+// owl -c ../example/json-ish.owl --fixed-layout
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+static void print_value(struct owl_ref ref, int depth)
+{
+    struct source_range range = parsed_value_range(ref);
+    printf("%*s%d [%zu, %zu)\n", depth * 2, "", parsed_value_type(ref),
+     range.start, range.end);
+    for (struct owl_ref r = parsed_value_field_string(ref); !r.empty;
+     r = owl_next(r)) {
+        struct parsed_string string = parsed_string_get(r);
+        printf("%*s\"%.*s\"\n", depth * 2 + 2, "", (int)string.length,
+         string.string);
+    }
+    struct owl_ref number = parsed_value_field_number(ref);
+    if (!number.empty)
+        printf("%*s%g\n", depth * 2 + 2, "", parsed_number_get(number).number);
+    for (struct owl_ref r = parsed_value_field_value(ref); !r.empty;
+     r = owl_next(r))
+        print_value(r, depth + 1);
+}
+
+int main(void)
+{
+    struct owl_tree *tree =
+     owl_tree_create_from_string("[1, {\"a\": [true, -2.5], \"b\": null}]");
+    print_value(owl_tree_root_ref(tree), 0);
+    owl_tree_destroy(tree);
+    return 0;
+}
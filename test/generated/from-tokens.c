@@ -0,0 +1,49 @@
+// owl -c ../example/json-ish.owl --from-tokens
+#include <stdio.h>
+#include <string.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+static uint32_t keyword(const char *text)
+{
+    return owl_keyword_number(text, strlen(text));
+}
+
+int main(void)
+{
+    // The string token's contents come from a heredoc the built-in tokenizer
+    // can't read.
+    const char *text = "[1, <<EOF hi EOF, true]";
+    struct owl_input_token tokens[] = {
+        { TOKEN_CLASS_KEYWORD, keyword("["), { 0, 1 } },
+        { TOKEN_CLASS_NUMBER, 0, { 1, 2 }, .number = 1 },
+        { TOKEN_CLASS_KEYWORD, keyword(","), { 2, 3 } },
+        { TOKEN_CLASS_STRING, 0, { 4, 16 }, .string = "hi",
+          .string_length = 2 },
+        { TOKEN_CLASS_KEYWORD, keyword(","), { 16, 17 } },
+        { TOKEN_CLASS_KEYWORD, keyword("true"), { 18, 22 } },
+        { TOKEN_CLASS_KEYWORD, keyword("]"), { 22, 23 } },
+    };
+    size_t n = sizeof(tokens) / sizeof(tokens[0]);
+    printf("unknown keyword %u\n", keyword("nope") == UINT32_MAX);
+    struct owl_tree *tree = owl_tree_create_from_tokens(tokens, n, text);
+    owl_tree_print(tree);
+    owl_tree_destroy(tree);
+
+    struct source_range range;
+    tokens[2].keyword = UINT32_MAX;
+    tree = owl_tree_create_from_tokens(tokens, n, text);
+    printf("bad keyword: error %d", owl_tree_get_error(tree, &range));
+    printf(" (%zu-%zu)\n", range.start, range.end);
+    owl_tree_destroy(tree);
+    tokens[2].keyword = keyword(",");
+    tokens[3].range.end = 2;
+    tree = owl_tree_create_from_tokens(tokens, n, text);
+    printf("overlapping: error %d", owl_tree_get_error(tree, &range));
+    printf(" (%zu-%zu)\n", range.start, range.end);
+    owl_tree_destroy(tree);
+    tree = owl_tree_create_from_tokens(tokens, 2, text);
+    printf("incomplete: error %d\n", owl_tree_get_error(tree, 0));
+    owl_tree_destroy(tree);
+    return 0;
+}
@@ -0,0 +1,30 @@
+// owl -c ../example/json-ish.owl --subtree-hashes --tree-compact
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+int main(void)
+{
+    struct owl_tree *tree = owl_tree_create_from_string(
+     "[{\"a\": [1, 2]},  {\"a\":[1,2]}, {\"a\": [2, 1]}]");
+    struct owl_ref objects[3];
+    objects[0] = parsed_value_get(owl_tree_root_ref(tree)).value;
+    for (int i = 1; i < 3; ++i)
+        objects[i] = owl_next(objects[i - 1]);
+    uint64_t hashes[3];
+    for (int i = 0; i < 3; ++i)
+        hashes[i] = owl_ref_hash(objects[i]);
+    // Whitespace and position don't matter, but order does.
+    printf("first and second equal: %d\n", hashes[0] == hashes[1]);
+    printf("second and third equal: %d\n", hashes[1] == hashes[2]);
+    printf("empty ref: %llu\n",
+     (unsigned long long)owl_ref_hash(parsed_value_get(objects[0]).number));
+
+    // Hashes are copied along with the tree.
+    uint64_t root_hash = owl_ref_hash(owl_tree_root_ref(tree));
+    owl_tree_compact(tree);
+    printf("same after compacting: %d\n",
+     owl_ref_hash(owl_tree_root_ref(tree)) == root_hash);
+    owl_tree_destroy(tree);
+    return 0;
+}
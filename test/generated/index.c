@@ -0,0 +1,35 @@
+// owl -c ../example/json-ish.owl --tree-index --tree-compact
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+static void print_values(struct owl_tree *tree)
+{
+    size_t n = owl_rule_count(tree, RULE_VALUE);
+    printf("%zu values, %zu strings\n", n, owl_rule_count(tree, RULE_STRING));
+    for (size_t i = 0; i < n; ++i) {
+        struct owl_ref ref = owl_rule_nth(tree, RULE_VALUE, i);
+        struct parsed_value value = parsed_value_get(ref);
+        struct owl_ref parent = owl_parent(ref);
+        printf("value %zu: %zu-%zu", i, value.range.start, value.range.end);
+        if (parent.empty)
+            printf(", root\n");
+        else {
+            struct parsed_value p = parsed_value_get(parent);
+            printf(", inside %zu-%zu\n", p.range.start, p.range.end);
+        }
+    }
+    printf("out of range: %d\n", owl_rule_nth(tree, RULE_VALUE, n).empty);
+}
+
+int main(void)
+{
+    struct owl_tree *tree =
+     owl_tree_create_from_string("[1, [2, 3], {\"a\": 4}]");
+    print_values(tree);
+    // Compacting drops the index, which is rebuilt in the new order.
+    owl_tree_compact(tree);
+    print_values(tree);
+    owl_tree_destroy(tree);
+    return 0;
+}
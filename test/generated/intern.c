@@ -0,0 +1,27 @@
+// owl -c generated/names.owl --intern-ids
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+int main(void)
+{
+    struct owl_tree *tree = owl_tree_create_from_string("a, b, a, c, b");
+    struct parsed_names names = owl_tree_get_parsed_names(tree);
+    for (struct owl_ref r = names.identifier; !r.empty; r = owl_next(r)) {
+        struct parsed_identifier identifier = parsed_identifier_get(r);
+        printf("%.*s: %u\n", (int)identifier.length, identifier.identifier,
+         identifier.id);
+    }
+    uint32_t count = owl_tree_identifier_count(tree);
+    printf("%u identifiers\n", count);
+    for (uint32_t id = 0; id <= count; ++id) {
+        size_t length;
+        const char *text = owl_tree_identifier_text(tree, id, &length);
+        if (text)
+            printf("%u: %.*s\n", id, (int)length, text);
+        else
+            printf("%u: none\n", id);
+    }
+    owl_tree_destroy(tree);
+    return 0;
+}
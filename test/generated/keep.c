@@ -0,0 +1,28 @@
+// owl -c ../example/json-ish.owl
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+int main(void)
+{
+    const char *string = "{\"a\": [1, \"b\"], \"c\": -2}";
+    // Only values are kept, so strings and numbers are left out.
+    enum owl_rule keep[] = { RULE_VALUE };
+    struct owl_tree *tree =
+     owl_tree_create_from_string_keeping(string, keep, 1);
+    owl_tree_print(tree);
+    owl_tree_destroy(tree);
+
+    // The root rule is always kept, even when it isn't listed.
+    keep[0] = RULE_STRING;
+    tree = owl_tree_create_from_string_keeping(string, keep, 1);
+    owl_tree_print(tree);
+    owl_tree_destroy(tree);
+
+    tree = owl_tree_create_from_string_keeping("[1 2]", keep, 1);
+    struct source_range range;
+    printf("error %d at %zu-%zu\n", owl_tree_get_error(tree, &range),
+     range.start, range.end);
+    owl_tree_destroy(tree);
+    return 0;
+}
@@ -0,0 +1,21 @@
+// owl -c generated/lazy.owl --lazy-rule block --segmented-tree --tree-compact --tree-index
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+int main(void)
+{
+    const char *string = "fn f { g(1); if x { h(2); } } let y = [3, 4]; "
+     "fn k { do { } }";
+    struct owl_tree *tree = owl_tree_create_from_string(string);
+    struct parsed_program program = owl_tree_get_parsed_program(tree);
+    // Reading one block only builds that block.
+    struct parsed_item item = parsed_item_get(program.item);
+    struct parsed_block block = parsed_block_get(item.block);
+    printf("block %zu-%zu\n", block.range.start, block.range.end);
+    printf("%zu blocks\n", owl_rule_count(tree, RULE_BLOCK));
+    owl_tree_compact(tree);
+    owl_tree_print(tree);
+    owl_tree_destroy(tree);
+    return 0;
+}
@@ -0,0 +1,30 @@
+// owl -c ../example/json-ish.owl --parse-limits
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+static void parse(const char *string, struct owl_parse_limits limits)
+{
+    struct owl_tree *tree =
+     owl_tree_create_from_string_with_limits(string, &limits);
+    struct source_range range = { 0, 0 };
+    enum owl_error error = owl_tree_get_error(tree, &range);
+    printf("%s -> error %d (%zu-%zu)\n", string, error, range.start, range.end);
+    owl_tree_destroy(tree);
+}
+
+int main(void)
+{
+    parse("[1, 2, 3]", (struct owl_parse_limits){ .max_tokens = 7 });
+    parse("[1, 2, 3]", (struct owl_parse_limits){ .max_tokens = 6 });
+    parse("[[[1]]]", (struct owl_parse_limits){ .max_nesting_depth = 3 });
+    parse("[[[1]]]", (struct owl_parse_limits){ .max_nesting_depth = 2 });
+    parse("[[[1]]]", (struct owl_parse_limits){ .max_input_bytes = 7 });
+    parse("[[[1]]]", (struct owl_parse_limits){ .max_input_bytes = 6 });
+    parse("[1, 2, 3, 4, 5, 6, 7, 8]",
+     (struct owl_parse_limits){ .max_tree_bytes = 16 });
+    parse("[1, 2, 3, 4, 5, 6, 7, 8]",
+     (struct owl_parse_limits){ .max_tree_bytes = 4096 });
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+// owl -c ../example/json-ish.owl
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+int main(void)
+{
+    const char *string = "[1,\n 2,\n\n 3]";
+    struct owl_tree *tree = owl_tree_create_from_string(string);
+    size_t length = strlen(string);
+    for (size_t offset = 0; offset <= length + 1; ++offset) {
+        size_t line;
+        size_t column;
+        if (owl_tree_line_column(tree, offset, &line, &column))
+            printf("%zu: %zu:%zu\n", offset, line, column);
+        else
+            printf("%zu: past the end\n", offset);
+    }
+    owl_tree_destroy(tree);
+    return 0;
+}
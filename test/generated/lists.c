@@ -0,0 +1,31 @@
+// owl -c ../example/json-ish.owl
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+int main(void)
+{
+    struct owl_tree *tree =
+     owl_tree_create_from_string("[1, \"a\", [], true, -5, null]");
+    struct parsed_value root = owl_tree_get_parsed_value(tree);
+    printf("count %zu\n", owl_count(root.value));
+    printf("empty count %zu\n", owl_count(parsed_value_get(root.value).value));
+
+    struct owl_ref refs[4];
+    size_t n = owl_collect(root.value, refs, 4);
+    printf("collected %zu\n", n);
+    for (size_t i = 0; i < 4; ++i)
+        printf("ref %zu: %d\n", i, parsed_value_get(refs[i]).type);
+
+    struct parsed_value values[8];
+    n = parsed_value_get_many(root.value, values, 8);
+    printf("unpacked %zu\n", n);
+    for (size_t i = 0; i < n; ++i) {
+        printf("value %zu: %d %zu-%zu\n", i, values[i].type,
+         values[i].range.start, values[i].range.end);
+    }
+    n = parsed_value_get_many(root.value, values, 2);
+    printf("unpacked %zu of 6\n", n);
+    owl_tree_destroy(tree);
+    return 0;
+}
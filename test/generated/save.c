@@ -0,0 +1,74 @@
+// owl -c ../example/json-ish.owl --tree-save --tree-compact
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+static const char *path = "generated/saved.tree";
+
+static bool save(struct owl_tree *tree)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool saved = owl_tree_save(tree, fd);
+    close(fd);
+    return saved;
+}
+
+int main(void)
+{
+    const char *string = "[1, {\"a\": [true, null]}, \"b\"]";
+    struct owl_tree *tree = owl_tree_create_from_string(string);
+    owl_tree_compact(tree);
+    printf("saved %d\n", save(tree));
+    owl_tree_destroy(tree);
+
+    tree = owl_tree_load_mmap(path, string);
+    printf("error %d\n", owl_tree_get_error(tree, 0));
+    printf("valid %d\n", owl_tree_load_validate(tree));
+    owl_tree_print(tree);
+    owl_tree_destroy(tree);
+
+    // Damage to the tree's bytes isn't noticed until the tree is validated.
+    FILE *file = fopen(path, "r+b");
+    if (file) {
+        static const unsigned char damage[16] = {
+            0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+            0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f, 0x7f,
+        };
+        fseek(file, 72, SEEK_SET);
+        fwrite(damage, 1, sizeof(damage), file);
+        fclose(file);
+    }
+    tree = owl_tree_load_mmap(path, string);
+    printf("damaged: error %d, valid %d\n", owl_tree_get_error(tree, 0),
+     owl_tree_load_validate(tree));
+    owl_tree_destroy(tree);
+
+    // A different string doesn't match the saved ranges.
+    tree = owl_tree_load_mmap(path, "[]");
+    printf("short string: error %d\n", owl_tree_get_error(tree, 0));
+    owl_tree_destroy(tree);
+
+    // Neither does a truncated file.
+    file = fopen(path, "r+b");
+    char header[40];
+    if (file && fread(header, 1, sizeof(header), file) == sizeof(header)) {
+        fclose(file);
+        file = fopen(path, "wb");
+        fwrite(header, 1, sizeof(header), file);
+    }
+    if (file)
+        fclose(file);
+    tree = owl_tree_load_mmap(path, string);
+    printf("truncated: error %d\n", owl_tree_get_error(tree, 0));
+    owl_tree_destroy(tree);
+
+    tree = owl_tree_create_from_string("[");
+    printf("error tree saved %d\n", save(tree));
+    owl_tree_destroy(tree);
+    unlink(path);
+    return 0;
+}
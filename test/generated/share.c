@@ -0,0 +1,32 @@
+// owl -c ../example/json-ish.owl --share-subtrees --omit-ranges
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+int main(void)
+{
+    struct owl_tree *tree = owl_tree_create_from_string(
+     "[{\"a\": [1, 2]}, {\"a\": [1, 2]}, {\"a\": [3, 2]}]");
+    owl_tree_print(tree);
+    struct owl_ref object = parsed_value_get(owl_tree_root_ref(tree)).value;
+    struct owl_ref arrays[3];
+    for (int i = 0; i < 3; ++i, object = owl_next(object))
+        arrays[i] = parsed_value_get(object).value;
+    printf("first and second arrays shared: %d\n",
+     owl_refs_equal(arrays[0], arrays[1]));
+    printf("second and third arrays shared: %d\n",
+     owl_refs_equal(arrays[1], arrays[2]));
+
+    // Lists are shared from the end, so [1, 2] and [3, 2] share their last
+    // element.
+    struct owl_ref two_in_first = owl_next(parsed_value_get(arrays[0]).value);
+    struct owl_ref two_in_third = owl_next(parsed_value_get(arrays[2]).value);
+    printf("last elements shared: %d\n",
+     owl_refs_equal(two_in_first, two_in_third));
+    struct parsed_number two =
+     parsed_number_get(parsed_value_get(two_in_third).number);
+    printf("number %g, range unavailable %d\n", two.number,
+     two.range.start == OWL_RANGE_UNAVAILABLE);
+    owl_tree_destroy(tree);
+    return 0;
+}
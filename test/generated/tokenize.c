@@ -0,0 +1,29 @@
+// owl -c ../example/json-ish.owl --tokenize
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+static void print_token(void *context, const struct owl_token *token)
+{
+    (void)context;
+    printf("class %d keyword %u %zu-%zu\n", token->token_class,
+     token->token_class == TOKEN_CLASS_KEYWORD ? token->keyword : 0,
+     token->range.start, token->range.end);
+}
+
+static void tokenize(const char *text, size_t length)
+{
+    size_t end = owl_tokenize(text, length, print_token, 0);
+    printf("tokenized %zu of %zu\n", end, length);
+}
+
+int main(void)
+{
+    tokenize("[1, \"a\", true] null", 19);
+    tokenize("[1, $]", 6);
+    tokenize("", 0);
+    // Only the first `length` bytes are read.
+    tokenize("[1, 23]", 5);
+    tokenize("[1, \0]", 6);
+    return 0;
+}
@@ -0,0 +1,62 @@
+// owl -c ../example/json-ish.owl --walker
+#include <stdio.h>
+#define OWL_PARSER_IMPLEMENTATION
+#include "parser.h"
+
+static bool enter_value(void *context, struct owl_ref ref,
+ const struct parsed_value *value)
+{
+    (void)ref;
+    int *depth = context;
+    printf("%*senter value %zu-%zu\n", *depth * 2, "", value->range.start,
+     value->range.end);
+    (*depth)++;
+    // Skip the insides of objects.
+    return value->type != PARSED_OBJECT;
+}
+
+static void leave_value(void *context, struct owl_ref ref,
+ const struct parsed_value *value)
+{
+    (void)ref;
+    int *depth = context;
+    (*depth)--;
+    printf("%*sleave value %zu-%zu\n", *depth * 2, "", value->range.start,
+     value->range.end);
+}
+
+static bool enter_number(void *context, struct owl_ref ref,
+ const struct parsed_number *number)
+{
+    (void)ref;
+    int *depth = context;
+    printf("%*snumber %g\n", *depth * 2, "", number->number);
+    return true;
+}
+
+int main(void)
+{
+    struct owl_tree *tree =
+     owl_tree_create_from_string("[1, [2, 3], {\"a\": 4}]");
+    struct owl_visitor visitor = {
+        .enter_value = enter_value,
+        .leave_value = leave_value,
+        .enter_number = enter_number,
+    };
+    int depth = 0;
+    owl_walk(tree, &visitor, &depth);
+
+    struct owl_walker *walker = owl_walker_create(tree);
+    struct owl_walk_event event;
+    while (owl_walker_next(walker, &event)) {
+        printf("%s %d depth %zu\n",
+         event.direction == WALK_ENTER ? "enter" : "leave", event.rule,
+         (size_t)event.depth);
+        if (event.direction == WALK_ENTER && event.rule == RULE_VALUE &&
+         event.match->value.type == PARSED_ARRAY && event.depth > 0)
+            owl_walker_skip_children(walker);
+    }
+    owl_walker_destroy(walker);
+    owl_tree_destroy(tree);
+    return 0;
+}